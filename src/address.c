@@ -0,0 +1,122 @@
+#include "address.h"
+
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+
+static inline size_t address_length(int family) {
+	return family == AF_INET ? 4 : family == AF_INET6 ? 16 : 0;
+}
+
+bool address_parse(const char* text, int family, struct address* address) {
+	struct address parsed = { 0 };
+
+	if((family == 0 || family == AF_INET) && inet_pton(AF_INET, text, parsed.bytes) == 1) {
+		parsed.family = AF_INET;
+	}
+	else if((family == 0 || family == AF_INET6) && inet_pton(AF_INET6, text, parsed.bytes) == 1) {
+		parsed.family = AF_INET6;
+	}
+	else {
+		return false;
+	}
+
+	*address = parsed;
+	return true;
+}
+
+char* address_format(const struct address* address, char* text, size_t size) {
+	if(address->family == 0 || inet_ntop(address->family, address->bytes, text, size) == NULL) {
+		text[0] = 0;
+	}
+
+	return text;
+}
+
+bool address_equal(const struct address* a, const struct address* b) {
+	return a->family == b->family && memcmp(a->bytes, b->bytes, address_length(a->family)) == 0;
+}
+
+struct address_range {
+	uint8_t prefix[16];
+	unsigned int length; // in bits
+};
+
+static const struct address_range NON_GLOBAL_IPV4[] = {
+	{ { 0 }, 8 }, // this network
+	{ { 10 }, 8 },
+	{ { 100, 64 }, 10 }, // carrier grade nat
+	{ { 127 }, 8 },
+	{ { 169, 254 }, 16 },
+	{ { 172, 16 }, 12 },
+	{ { 192, 0, 0 }, 24 },
+	{ { 192, 0, 2 }, 24 },
+	{ { 192, 168 }, 16 },
+	{ { 198, 18 }, 15 },
+	{ { 198, 51, 100 }, 24 },
+	{ { 203, 0, 113 }, 24 },
+	{ { 224 }, 3 } // multicast and reserved
+};
+
+static const struct address_range GLOBAL_IPV6 = { { 0x20 }, 3 };
+static const struct address_range DOCUMENTATION_IPV6 = { { 0x20, 0x01, 0x0d, 0xb8 }, 32 };
+
+static bool address_in_range(const struct address* address, const struct address_range* range) {
+	unsigned int bytes = range->length / 8, bits = range->length % 8;
+
+	return memcmp(address->bytes, range->prefix, bytes) == 0
+		&& (bits == 0 || ((address->bytes[bytes] ^ range->prefix[bytes]) & (0xff << (8 - bits))) == 0);
+}
+
+bool address_is_global(const struct address* address) {
+	if(address->family == AF_INET) {
+		for(size_t i = 0; i < sizeof(NON_GLOBAL_IPV4) / sizeof(NON_GLOBAL_IPV4[0]); ++i) {
+			if(address_in_range(address, NON_GLOBAL_IPV4 + i)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	// unique local, link local and the other special ranges are outside of the global unicast one
+	return address->family == AF_INET6 && address_in_range(address, &GLOBAL_IPV6) && !address_in_range(address, &DOCUMENTATION_IPV6);
+}
+
+bool address_from_interface(const char* interface, int family, struct address* address) {
+	struct ifaddrs *list, *current;
+	bool found = false;
+
+	if(getifaddrs(&list) == -1) {
+		return false;
+	}
+
+	for(current = list; current != NULL && !found; current = current->ifa_next) {
+		struct address candidate = { .family = family };
+
+		if(current->ifa_addr == NULL || current->ifa_addr->sa_family != family || strcmp(current->ifa_name, interface) != 0) {
+			continue;
+		}
+
+		if(family == AF_INET) {
+			memcpy(candidate.bytes, &((const struct sockaddr_in*) current->ifa_addr)->sin_addr, 4);
+		}
+		else {
+			memcpy(candidate.bytes, &((const struct sockaddr_in6*) current->ifa_addr)->sin6_addr, 16);
+		}
+
+		if(address_is_global(&candidate)) {
+			*address = candidate;
+			found = true;
+		}
+	}
+
+	freeifaddrs(list);
+
+	return found;
+}
+
+const char* address_record_type(int family) {
+	return family == AF_INET6 ? "AAAA" : "A";
+}
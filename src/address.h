@@ -0,0 +1,49 @@
+#ifndef ADDRESS_H
+#define ADDRESS_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// longest text form of an address, including the string terminator
+#define ADDRESS_MAX_TEXT_LENGTH INET6_ADDRSTRLEN
+
+/**
+ * Ip address in network byte order, family is AF_INET or AF_INET6 (0 if no address is set)
+ **/
+struct address {
+	int family;
+	uint8_t bytes[16];
+};
+
+/**
+ * Parses the text form of an address, family can be 0 to accept both
+ **/
+bool address_parse(const char* text, int family, struct address* address);
+
+/**
+ * Writes the text form of the address, an empty string if it is not set
+ **/
+char* address_format(const struct address* address, char* text, size_t size);
+
+bool address_equal(const struct address* a, const struct address* b);
+
+/**
+ * True if the address can be reached from the internet: private, shared, loopback, link local, multicast and documentation ranges are not
+ **/
+bool address_is_global(const struct address* address);
+
+/**
+ * First global address of the family assigned to the interface
+ **/
+bool address_from_interface(const char* interface, int family, struct address* address);
+
+/**
+ * "A" or "AAAA"
+ **/
+const char* address_record_type(int family);
+
+#endif
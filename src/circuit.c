@@ -0,0 +1,106 @@
+#include "circuit.h"
+
+#include <string.h>
+
+#include "lib/logger.h"
+#include "metrics.h"
+#include "utils.h"
+
+// consecutive failures that open a closed circuit
+#define CIRCUIT_FAILURE_THRESHOLD 5
+#define CIRCUIT_OPEN_MS 30000
+
+#define CIRCUIT_MAX_HOSTS 16
+
+static struct circuit_breaker circuits[CIRCUIT_MAX_HOSTS];
+static size_t circuits_count = 0;
+
+struct circuit_breaker* circuit_get(const char* host) {
+	for(size_t i = 0; i < circuits_count; ++i) {
+		if(strcmp(circuits[i].host, host) == 0) {
+			return circuits + i;
+		}
+	}
+
+	if(circuits_count >= CIRCUIT_MAX_HOSTS) {
+		return NULL;
+	}
+
+	struct circuit_breaker* circuit = circuits + circuits_count++;
+
+	*circuit = (struct circuit_breaker) { .state = CIRCUIT_CLOSED };
+	strncpy(circuit->host, host, CIRCUIT_HOST_MAX_LENGTH);
+
+	return circuit;
+}
+
+static void circuit_open(struct circuit_breaker* circuit) {
+	circuit->state = CIRCUIT_OPEN;
+	circuit->probing = false;
+	clock_gettime(CLOCK_MONOTONIC, &circuit->opened_at);
+
+	metrics_inc(METRIC_CIRCUIT_OPENED);
+	log_warning("Circuit for '%s' opened, calls will fail fast for %d ms", circuit->host, CIRCUIT_OPEN_MS);
+}
+
+bool circuit_allow(struct circuit_breaker* circuit) {
+	if(circuit == NULL) {
+		return true;
+	}
+
+	switch(circuit->state) {
+		case CIRCUIT_CLOSED:
+			return true;
+		case CIRCUIT_OPEN:
+			if(elapsed_ms_since(&circuit->opened_at) >= CIRCUIT_OPEN_MS) {
+				log_status("Circuit for '%s' half-open, sending a probe call", circuit->host);
+				circuit->state = CIRCUIT_HALF_OPEN;
+				circuit->probing = true;
+				return true;
+			}
+			break;
+		case CIRCUIT_HALF_OPEN:
+			// only one probe at a time
+			if(!circuit->probing) {
+				circuit->probing = true;
+				return true;
+			}
+			break;
+	}
+
+	metrics_inc(METRIC_CIRCUIT_REJECTED);
+	return false;
+}
+
+void circuit_success(struct circuit_breaker* circuit) {
+	if(circuit == NULL) {
+		return;
+	}
+
+	if(circuit->state != CIRCUIT_CLOSED) {
+		log_status("Circuit for '%s' closed", circuit->host);
+	}
+
+	circuit->state = CIRCUIT_CLOSED;
+	circuit->failures = 0;
+	circuit->probing = false;
+}
+
+void circuit_failure(struct circuit_breaker* circuit) {
+	if(circuit == NULL) {
+		return;
+	}
+
+	++circuit->failures;
+
+	// a failed probe opens the circuit again for a whole period
+	if(circuit->state == CIRCUIT_HALF_OPEN || (circuit->state == CIRCUIT_CLOSED && circuit->failures >= CIRCUIT_FAILURE_THRESHOLD)) {
+		circuit_open(circuit);
+	}
+}
+
+void circuit_release(struct circuit_breaker* circuit) {
+	if(circuit != NULL && circuit->state == CIRCUIT_HALF_OPEN) {
+		circuit->probing = false;
+	}
+}
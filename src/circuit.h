@@ -0,0 +1,45 @@
+#ifndef CIRCUIT_H
+#define CIRCUIT_H 1
+
+#include <stdbool.h>
+#include <time.h>
+
+#define CIRCUIT_HOST_MAX_LENGTH 255
+
+enum circuit_state {
+	CIRCUIT_CLOSED, // calls go through, consecutive failures are counted
+	CIRCUIT_OPEN, // calls fail fast until the open period expires
+	CIRCUIT_HALF_OPEN // a single probe call decides if the circuit closes or opens again
+};
+
+struct circuit_breaker {
+	char host[CIRCUIT_HOST_MAX_LENGTH + 1];
+	enum circuit_state state;
+	unsigned int failures;
+	bool probing;
+	struct timespec opened_at;
+};
+
+/**
+ * Returns the breaker associated with the host, creating it if needed.
+ * Returns NULL if the host table is full, callers should then let the call through.
+ **/
+struct circuit_breaker* circuit_get(const char* host);
+
+/**
+ * Returns true if a call to the host can be performed.
+ * When the open period has expired the circuit moves to half-open and only the first caller gets through as probe.
+ **/
+bool circuit_allow(struct circuit_breaker* circuit);
+
+void circuit_success(struct circuit_breaker* circuit);
+
+void circuit_failure(struct circuit_breaker* circuit);
+
+/**
+ * To be called instead of circuit_success or circuit_failure when an allowed call is not performed after all,
+ * a half-open circuit lets the next caller probe
+ **/
+void circuit_release(struct circuit_breaker* circuit);
+
+#endif
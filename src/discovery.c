@@ -0,0 +1,995 @@
+#include "discovery.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <net/route.h>
+
+#include <curl/curl.h>
+
+#include "lib/logger.h"
+#include "lib/latency.h"
+#include "lib/stun.h"
+#include "lib/dns.h"
+#include "lib/natpmp.h"
+#include "http.h"
+#include "resolver.h"
+#include "providers.h"
+#include "records.h"
+#include "retry.h"
+#include "metrics.h"
+#include "utils.h"
+
+// retry policy, delays use exponential backoff with full jitter
+#define DISCOVERY_MAX_ATTEMPTS 4
+#define DISCOVERY_RETRY_BASE_DELAY_MS 250
+#define DISCOVERY_RETRY_MAX_DELAY_MS 4000
+
+// a duplicate request is sent once the first one is slower than this percentile of the observed latencies
+#define HEDGE_LATENCY_PERCENTILE 95
+#define HEDGE_MIN_SAMPLES 8
+#define HEDGE_MIN_DELAY_MS 100
+
+#define DISCOVERY_MAX_REQUESTS (DISCOVERY_MAX_TARGETS * DISCOVERY_MAX_QUORUM)
+#define DISCOVERY_POLL_MS 1000
+
+// udp requests are retransmitted with a doubling timeout until the total timeout of the host expires
+#define UDP_INITIAL_RTO_MS 250
+#define UDP_MAX_MESSAGE_SIZE 576
+
+enum request_state {
+	REQUEST_WAITING, // for the next attempt
+	REQUEST_RUNNING,
+	REQUEST_DONE,
+	REQUEST_FAILED,
+	REQUEST_CANCELLED // not needed anymore, the quorum was reached by the others
+};
+
+struct address_buffer {
+	char text[ADDRESS_MAX_TEXT_LENGTH];
+	size_t length;
+};
+
+struct discovery_request;
+
+enum udp_answer {
+	UDP_IGNORED, // not an answer to the request
+	UDP_ADDRESS,
+	UDP_REFUSED // an answer without a usable address, the attempt is over
+};
+
+/**
+ * Discovery protocol running over a single udp exchange, selected by the scheme of the provider url
+ **/
+struct udp_backend {
+	const char* scheme;
+	long default_port;
+	size_t (*build)(struct discovery_request* request, uint8_t* buffer, size_t size);
+	enum udp_answer (*parse)(struct discovery_request* request, const uint8_t* message, size_t length);
+};
+
+/**
+ * A discovery with its retries. Every http attempt can run on two handles (the primary and the hedged one),
+ * udp attempts use a socket polled along with the handles.
+ **/
+struct discovery_request {
+	struct provider* providers[PROVIDERS_MAX]; // in the order they are tried
+	size_t provider_count;
+	struct provider* provider; // of the current attempt
+	const char* url;
+	int family;
+	size_t target_index; // in the targets passed to discover_addresses
+	const char* interface; // NULL for the default route
+	CURL* handles[2];
+	bool active[2];
+	struct address_buffer buffers[2];
+	struct circuit_breaker* circuit;
+	enum request_state state;
+	unsigned int attempt;
+	long hedge_after_ms; // -1 if the attempt is not hedged
+	const struct udp_backend* backend; // NULL for http providers
+	int socket; // -1 when no udp attempt is running
+	uint8_t transaction_id[STUN_TRANSACTION_ID_SIZE];
+	long rto_ms;
+	long timeout_ms;
+	struct timespec retransmit_at;
+	struct timespec started;
+	struct timespec next_attempt_at;
+	struct address address;
+};
+
+static const struct retry_policy discovery_retry_policy = {
+	.max_attempts = DISCOVERY_MAX_ATTEMPTS,
+	.base_delay_ms = DISCOVERY_RETRY_BASE_DELAY_MS,
+	.max_delay_ms = DISCOVERY_RETRY_MAX_DELAY_MS
+};
+
+// number of providers that must be queried for every family, their majority decides the address
+static size_t quorum = 1;
+
+// handles are kept between runs to reuse their state
+static CURLM* multi = NULL;
+static CURL* handles[DISCOVERY_MAX_REQUESTS][2] = { { NULL } };
+
+static bool init_handles(size_t count) {
+	if(multi == NULL && (multi = curl_multi_init()) == NULL) {
+		return false;
+	}
+
+	for(size_t i = 0; i < count; ++i) {
+		for(int j = 0; j < 2; ++j) {
+			if(handles[i][j] == NULL && (handles[i][j] = curl_easy_init()) == NULL) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+void discovery_cleanup() {
+	for(size_t i = 0; i < DISCOVERY_MAX_REQUESTS; ++i) {
+		curl_easy_cleanup(handles[i][0]);
+		curl_easy_cleanup(handles[i][1]);
+		handles[i][0] = handles[i][1] = NULL;
+	}
+
+	curl_multi_cleanup(multi);
+	multi = NULL;
+}
+
+void discovery_configure(size_t new_quorum) {
+	static const int FAMILIES[] = { AF_INET, AF_INET6 };
+	size_t count;
+	struct provider* providers = providers_get(&count);
+
+	quorum = new_quorum < 1 ? 1 : new_quorum > DISCOVERY_MAX_QUORUM ? DISCOVERY_MAX_QUORUM : new_quorum;
+
+	// the quorum can't be larger than the providers that vote, a single one is trusted alone
+	for(size_t i = 0; i < sizeof(FAMILIES) / sizeof(FAMILIES[0]) && quorum > 1; ++i) {
+		size_t voters = 0;
+
+		for(size_t j = 0; j < count; ++j) {
+			voters += providers[j].family == FAMILIES[i];
+		}
+
+		if(voters > 0 && voters < quorum && records_need_family(FAMILIES[i])) {
+			log_warning("DISCOVERY_QUORUM is %zu but there %s only %zu %s provider%s, the quorum is lowered to %zu",
+				quorum, voters == 1 ? "is" : "are", voters, address_record_type(FAMILIES[i]), voters == 1 ? "" : "s", voters);
+		}
+	}
+}
+
+const char* discovery_url(int family) {
+	struct provider* provider = providers_best(family);
+
+	return provider != NULL ? provider->url : NULL;
+}
+
+// callback for external address curl call
+static size_t address_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata) {
+	struct address_buffer* address = userdata;
+	size_t size = itemSize * itemCount,
+		available = sizeof(address->text) - 1 - address->length,
+		copied = size < available ? size : available;
+
+	memcpy(address->text + address->length, buffer, copied);
+	address->length += copied;
+	address->text[address->length] = 0;
+
+	return size;
+}
+
+static inline long timespec_diff_ms(const struct timespec* a, const struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static inline void timespec_add_ms(struct timespec* time, long ms) {
+	time->tv_sec += ms / 1000;
+	time->tv_nsec += (ms % 1000) * 1000000L;
+
+	if(time->tv_nsec >= 1000000000L) {
+		time->tv_nsec -= 1000000000L;
+		++time->tv_sec;
+	}
+}
+
+static size_t build_stun_request(struct discovery_request* request, uint8_t* buffer, size_t size) {
+	return stun_build_binding_request(buffer, size, request->transaction_id);
+}
+
+static enum udp_answer parse_stun_response(struct discovery_request* request, const uint8_t* message, size_t length) {
+	struct address address = { 0 };
+
+	if(!stun_parse_binding_response(message, length, request->transaction_id, &address.family, address.bytes) || address.family != request->family) {
+		return UDP_IGNORED;
+	}
+
+	request->address = address;
+
+	return UDP_ADDRESS;
+}
+
+#define DNS_DEFAULT_PORT 53
+
+/**
+ * Question of a 'dns://<server>[:<port>]/<name>/<A|AAAA|TXT>' url
+ **/
+static bool dns_url_question(const char* url, char* name, size_t size, uint16_t* type) {
+	const char* path = strchr(url + strlen("dns://"), '/');
+	const char* type_text = path != NULL ? strrchr(path, '/') : NULL;
+
+	if(path == NULL || type_text == path || (size_t) (type_text - path - 1) >= size) {
+		return false;
+	}
+
+	snprintf(name, size, "%.*s", (int) (type_text - path - 1), path + 1);
+
+	if(strcmp(type_text, "/A") == 0) {
+		*type = DNS_TYPE_A;
+	}
+	else if(strcmp(type_text, "/AAAA") == 0) {
+		*type = DNS_TYPE_AAAA;
+	}
+	else if(strcmp(type_text, "/TXT") == 0) {
+		*type = DNS_TYPE_TXT;
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+static size_t build_dns_request(struct discovery_request* request, uint8_t* buffer, size_t size) {
+	char name[DNS_MAX_NAME_LENGTH + 1];
+	uint16_t type;
+
+	if(!dns_url_question(request->url, name, sizeof(name), &type)) {
+		log_warning("Invalid dns discovery url '%s', expected 'dns://<server>[:<port>]/<name>/<A|AAAA|TXT>'", request->url);
+		return 0;
+	}
+
+	// the first bytes of the transaction id are the query id
+	return dns_build_query(buffer, size, request->transaction_id[0] << 8 | request->transaction_id[1], name, type, true);
+}
+
+/**
+ * The address is the data of an A or AAAA answer, or the text of a TXT one (the first that is an address of the family)
+ **/
+static enum udp_answer parse_dns_response(struct discovery_request* request, const uint8_t* message, size_t length) {
+	char name[DNS_MAX_NAME_LENGTH + 1];
+	uint16_t type;
+	struct dns_answer answers[8];
+	int rcode,
+		count = dns_url_question(request->url, name, sizeof(name), &type)
+			? dns_parse_response(message, length, request->transaction_id[0] << 8 | request->transaction_id[1], type, answers, 8, &rcode) : -1;
+
+	for(int i = 0; i < count; ++i) {
+		struct address address = { 0 };
+
+		if(type == DNS_TYPE_TXT) {
+			char text[DNS_MAX_RDATA_LENGTH + 1];
+
+			// a character string is prefixed by its length
+			if(answers[i].length == 0 || answers[i].data[0] >= answers[i].length) {
+				continue;
+			}
+
+			snprintf(text, sizeof(text), "%.*s", answers[i].data[0], (const char*) answers[i].data + 1);
+
+			if(!address_parse(text, request->family, &address)) {
+				continue;
+			}
+		}
+		else if((type == DNS_TYPE_A && request->family == AF_INET && answers[i].length == 4)
+			|| (type == DNS_TYPE_AAAA && request->family == AF_INET6 && answers[i].length == 16)) {
+			address.family = request->family;
+			memcpy(address.bytes, answers[i].data, answers[i].length);
+		}
+		else {
+			continue;
+		}
+
+		request->address = address;
+		return UDP_ADDRESS;
+	}
+
+	return UDP_IGNORED;
+}
+
+static size_t build_natpmp_request(struct discovery_request* request, uint8_t* buffer, size_t size) {
+	// nat-pmp only knows about ipv4
+	return request->family == AF_INET ? natpmp_build_address_request(buffer, size) : 0;
+}
+
+/**
+ * A gateway that refuses to answer, or that is itself behind another nat and only knows a private address, can't help
+ **/
+static enum udp_answer parse_natpmp_response(struct discovery_request* request, const uint8_t* message, size_t length) {
+	struct address address = { .family = AF_INET };
+	uint16_t result;
+
+	if(!natpmp_parse_address_response(message, length, &result, address.bytes)) {
+		return UDP_IGNORED;
+	}
+
+	if(result != NATPMP_RESULT_SUCCESS) {
+		log_warning("The gateway refused to tell the external address (nat-pmp result = %u)", result);
+		return UDP_REFUSED;
+	}
+
+	if(!address_is_global(&address)) {
+		log_warning("The external address of the gateway is not a global one, it is behind another nat");
+		return UDP_REFUSED;
+	}
+
+	request->address = address;
+
+	return UDP_ADDRESS;
+}
+
+static const struct udp_backend UDP_BACKENDS[] = {
+	{ "stun://", STUN_DEFAULT_PORT, build_stun_request, parse_stun_response },
+	{ "dns://", DNS_DEFAULT_PORT, build_dns_request, parse_dns_response },
+	{ "natpmp://", NATPMP_PORT, build_natpmp_request, parse_natpmp_response }
+};
+
+static const struct udp_backend* find_udp_backend(const char* url) {
+	for(size_t i = 0; i < sizeof(UDP_BACKENDS) / sizeof(UDP_BACKENDS[0]); ++i) {
+		if(strncmp(url, UDP_BACKENDS[i].scheme, strlen(UDP_BACKENDS[i].scheme)) == 0) {
+			return UDP_BACKENDS + i;
+		}
+	}
+
+	return NULL;
+}
+
+// -1 until there are enough samples for the percentile to be meaningful
+static long hedge_delay_ms(const char* url) {
+	const struct endpoint_latency* endpoint = endpoint_latency_for_url(url);
+
+	if(endpoint == NULL || latency_count(&endpoint->total) < HEDGE_MIN_SAMPLES) {
+		return -1;
+	}
+
+	long delay = (long) latency_percentile(&endpoint->total, HEDGE_LATENCY_PERCENTILE);
+
+	return delay > HEDGE_MIN_DELAY_MS ? delay : HEDGE_MIN_DELAY_MS;
+}
+
+static void start_handle(struct discovery_request* request, int index) {
+	CURL* curl = request->handles[index];
+
+	request->buffers[index] = (struct address_buffer) { 0 };
+
+	setup_call(curl, request->url, address_callback, request->buffers + index);
+	curl_easy_setopt(curl, CURLOPT_IPRESOLVE, request->family == AF_INET6 ? CURL_IPRESOLVE_V6 : CURL_IPRESOLVE_V4);
+
+	if(request->interface != NULL) {
+		curl_easy_setopt(curl, CURLOPT_INTERFACE, request->interface);
+	}
+	curl_multi_add_handle(multi, curl);
+
+	request->active[index] = true;
+}
+
+static void stop_handle(struct discovery_request* request, int index) {
+	if(request->active[index]) {
+		curl_multi_remove_handle(multi, request->handles[index]);
+		request->active[index] = false;
+	}
+
+	curl_easy_reset(request->handles[index]);
+}
+
+/**
+ * Moves the request to its next attempt after the backoff, or fails it once there is none left
+ **/
+static void retry_request(struct discovery_request* request, bool retryable) {
+	providers_record(request->provider, false, 0);
+
+	// a provider that can't help is not a reason to give up while there are others
+	if(!(retryable || request->provider_count > 1) || request->attempt + 1 >= discovery_retry_policy.max_attempts) {
+		log_error("Can't discover the %s address%s%s, the last call to '%s' failed", address_record_type(request->family),
+			request->interface != NULL ? " of " : "", request->interface != NULL ? request->interface : "", request->url);
+		request->state = REQUEST_FAILED;
+		return;
+	}
+
+	unsigned int delay = retry_backoff_ms(&discovery_retry_policy, request->attempt++);
+
+	log_debug("Retrying the %s discovery in %u ms (attempt %u of %u)", address_record_type(request->family), delay, request->attempt + 1, discovery_retry_policy.max_attempts);
+	metrics_inc(METRIC_DISCOVERY_RETRIES);
+
+	clock_gettime(CLOCK_MONOTONIC, &request->next_attempt_at);
+	timespec_add_ms(&request->next_attempt_at, delay);
+
+	request->state = REQUEST_WAITING;
+}
+
+static void fail_attempt(struct discovery_request* request, CURLcode result, const struct call_info* info) {
+	log_warning("Call to '%s' failed (curl result = '%s', http status = %ld)", request->url, curl_easy_strerror(result), info->http_status);
+
+	retry_request(request, report_call_failure(request->circuit, result, info));
+}
+
+static void stop_udp(struct discovery_request* request) {
+	if(request->socket != -1) {
+		close(request->socket);
+		request->socket = -1;
+	}
+}
+
+static void fail_udp(struct discovery_request* request, const char* reason) {
+	log_warning("Call to '%s' failed (%s)", request->url, reason);
+	stop_udp(request);
+
+	// like for http, no answer is a transport failure
+	circuit_failure(request->circuit);
+	retry_request(request, request->circuit == NULL || request->circuit->state != CIRCUIT_OPEN);
+}
+
+/**
+ * Gateway of the ipv4 default route, read from the kernel routing table
+ **/
+static bool default_gateway(int family, struct address* address) {
+	FILE* file = family == AF_INET ? fopen("/proc/net/route", "r") : NULL;
+	char line[256], interface[32];
+	unsigned int destination, gateway, flags;
+	bool found = false;
+
+	if(file == NULL) {
+		return false;
+	}
+
+	while(!found && fgets(line, sizeof(line), file) != NULL) {
+		// the addresses are written in hex, in network byte order
+		if(sscanf(line, "%31s %x %x %x", interface, &destination, &gateway, &flags) == 4 && destination == 0 && (flags & RTF_GATEWAY)) {
+			address->family = AF_INET;
+			memcpy(address->bytes, &gateway, 4);
+			found = true;
+		}
+	}
+
+	fclose(file);
+
+	return found;
+}
+
+/**
+ * Address of the udp server, from the url literal, the resolver cache or getaddrinfo as last resort
+ **/
+static bool udp_server_address(struct discovery_request* request, struct sockaddr_storage* server, socklen_t* length) {
+	char host[RESOLVER_HOST_MAX_LENGTH + 1], port_text[8];
+	long port;
+	struct address address;
+
+	if(!url_host_port(request->url, host, sizeof(host), &port)) {
+		if(!url_host(request->url, host, sizeof(host))) {
+			return false;
+		}
+
+		port = request->backend->default_port;
+	}
+
+	// the url parser keeps the brackets of ipv6 literals
+	if(host[0] == '[') {
+		memmove(host, host + 1, strlen(host));
+		host[strcspn(host, "]")] = 0;
+	}
+
+	memset(server, 0, sizeof(*server));
+
+	if(strcmp(host, DISCOVERY_GATEWAY_HOST) == 0 ? default_gateway(request->family, &address)
+		: address_parse(host, request->family, &address) || resolver_address(host, request->family, &address)) {
+		if(address.family == AF_INET) {
+			struct sockaddr_in* ipv4 = (struct sockaddr_in*) server;
+
+			ipv4->sin_family = AF_INET;
+			ipv4->sin_port = htons(port);
+			memcpy(&ipv4->sin_addr, address.bytes, 4);
+			*length = sizeof(struct sockaddr_in);
+		}
+		else {
+			struct sockaddr_in6* ipv6 = (struct sockaddr_in6*) server;
+
+			ipv6->sin6_family = AF_INET6;
+			ipv6->sin6_port = htons(port);
+			memcpy(&ipv6->sin6_addr, address.bytes, 16);
+			*length = sizeof(struct sockaddr_in6);
+		}
+
+		return true;
+	}
+
+	struct addrinfo hints = { .ai_family = request->family, .ai_socktype = SOCK_DGRAM }, *result;
+
+	snprintf(port_text, sizeof(port_text), "%ld", port);
+
+	if(getaddrinfo(host, port_text, &hints, &result) != 0) {
+		return false;
+	}
+
+	memcpy(server, result->ai_addr, result->ai_addrlen);
+	*length = result->ai_addrlen;
+	freeaddrinfo(result);
+
+	return true;
+}
+
+/**
+ * Binds the socket to the source address or to the device of the uplink, like curl does with CURLOPT_INTERFACE
+ **/
+static bool bind_udp(struct discovery_request* request) {
+	struct address source;
+
+	if(!address_parse(request->interface, request->family, &source)) {
+		return setsockopt(request->socket, SOL_SOCKET, SO_BINDTODEVICE, request->interface, strlen(request->interface)) == 0;
+	}
+
+	struct sockaddr_storage local = { 0 };
+	socklen_t length;
+
+	if(source.family == AF_INET) {
+		((struct sockaddr_in*) &local)->sin_family = AF_INET;
+		memcpy(&((struct sockaddr_in*) &local)->sin_addr, source.bytes, 4);
+		length = sizeof(struct sockaddr_in);
+	}
+	else {
+		((struct sockaddr_in6*) &local)->sin6_family = AF_INET6;
+		memcpy(&((struct sockaddr_in6*) &local)->sin6_addr, source.bytes, 16);
+		length = sizeof(struct sockaddr_in6);
+	}
+
+	return bind(request->socket, (const struct sockaddr*) &local, length) == 0;
+}
+
+static bool send_udp(struct discovery_request* request) {
+	uint8_t message[UDP_MAX_MESSAGE_SIZE];
+	size_t length = request->backend->build(request, message, sizeof(message));
+
+	return length > 0 && send(request->socket, message, length, 0) == (ssize_t) length;
+}
+
+static void start_udp(struct discovery_request* request) {
+	struct sockaddr_storage server;
+	socklen_t server_length;
+
+	for(size_t i = 0; i < sizeof(request->transaction_id); ++i) {
+		request->transaction_id[i] = random() & 0xff;
+	}
+
+	if(!udp_server_address(request, &server, &server_length)) {
+		fail_udp(request, "the host can't be resolved");
+		return;
+	}
+
+	request->socket = socket(request->family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if(request->socket != -1 && request->interface != NULL && !bind_udp(request)) {
+		fail_udp(request, "the socket couldn't be bound to the interface");
+		return;
+	}
+
+	// connecting the socket discards datagrams coming from other addresses
+	if(request->socket == -1 || connect(request->socket, (const struct sockaddr*) &server, server_length) == -1 || !send_udp(request)) {
+		fail_udp(request, "the request couldn't be sent");
+		return;
+	}
+
+	request->rto_ms = UDP_INITIAL_RTO_MS;
+	request->timeout_ms = endpoint_total_timeout_ms(endpoint_latency_for_url(request->url));
+	request->retransmit_at = request->started;
+	timespec_add_ms(&request->retransmit_at, request->rto_ms);
+}
+
+/**
+ * Retransmits the request when its timer expires, returns the milliseconds until the next timer
+ **/
+static long check_udp(struct discovery_request* request, const struct timespec* now) {
+	long elapsed_ms = timespec_diff_ms(now, &request->started);
+
+	if(elapsed_ms >= request->timeout_ms) {
+		metrics_inc(METRIC_CALL_TIMEOUTS);
+		fail_udp(request, "timed out");
+		return DISCOVERY_POLL_MS;
+	}
+
+	if(timespec_diff_ms(&request->retransmit_at, now) <= 0) {
+		log_debug("Retransmitting the request to '%s'", request->url);
+		send_udp(request);
+
+		request->rto_ms *= 2;
+		request->retransmit_at = *now;
+		timespec_add_ms(&request->retransmit_at, request->rto_ms);
+	}
+
+	long retransmit_ms = timespec_diff_ms(&request->retransmit_at, now),
+		timeout_ms = request->timeout_ms - elapsed_ms;
+
+	return retransmit_ms < timeout_ms ? retransmit_ms : timeout_ms;
+}
+
+static void receive_udp(struct discovery_request* request) {
+	uint8_t message[UDP_MAX_MESSAGE_SIZE];
+	ssize_t length;
+
+	// datagrams that are not an answer to the request are ignored
+	while(request->socket != -1 && (length = recv(request->socket, message, sizeof(message), 0)) > 0) {
+		enum udp_answer answer = request->backend->parse(request, message, length);
+
+		if(answer == UDP_IGNORED) {
+			continue;
+		}
+
+		if(answer == UDP_REFUSED) {
+			// the host is up, only another provider can help
+			stop_udp(request);
+			circuit_success(request->circuit);
+			retry_request(request, false);
+			return;
+		}
+
+		char host[TIMEOUTS_HOST_MAX_LENGTH + 1];
+		double elapsed_ms = elapsed_ms_since(&request->started);
+
+		stop_udp(request);
+		circuit_success(request->circuit);
+		providers_record(request->provider, true, elapsed_ms);
+
+		// there is no connection setup
+		if(url_host(request->url, host, sizeof(host))) {
+			endpoint_latency_record(endpoint_latency_get(host), -1, elapsed_ms);
+		}
+
+		request->state = REQUEST_DONE;
+	}
+}
+
+/**
+ * Picks the provider of the attempt, every attempt moves on to the next one skipping the hosts whose circuit is open.
+ * Returns false if all of them are open.
+ **/
+static bool select_provider(struct discovery_request* request) {
+	for(size_t i = 0; i < request->provider_count; ++i) {
+		struct provider* provider = request->providers[(request->attempt + i) % request->provider_count];
+		struct circuit_breaker* circuit = circuit_for_url(provider->url);
+
+		if(circuit_allow(circuit)) {
+			request->provider = provider;
+			request->url = provider->url;
+			request->circuit = circuit;
+			return true;
+		}
+
+		log_warning("Call to '%s' skipped, the circuit for the host is open", provider->url);
+	}
+
+	return false;
+}
+
+static void start_attempt(struct discovery_request* request) {
+	clock_gettime(CLOCK_MONOTONIC, &request->started);
+	request->backend = find_udp_backend(request->url);
+	request->state = REQUEST_RUNNING;
+
+	if(request->backend != NULL) {
+		log_debug("Sending the %s discovery request to '%s'%s%s", address_record_type(request->family), request->url,
+			request->interface != NULL ? " through " : "", request->interface != NULL ? request->interface : "");
+		request->hedge_after_ms = -1;
+		start_udp(request);
+		return;
+	}
+
+	request->hedge_after_ms = hedge_delay_ms(request->url);
+	start_handle(request, 0);
+
+	if(request->hedge_after_ms >= 0) {
+		log_debug("Performing call to '%s' (hedging after %ld ms)", request->url, request->hedge_after_ms);
+	}
+	else {
+		log_debug("Performing call to '%s'", request->url);
+	}
+}
+
+// removes surrounding whitespace in place
+static char* trim(char* text) {
+	char* end = text + strlen(text);
+
+	while(end > text && isspace((unsigned char) end[-1])) {
+		*--end = 0;
+	}
+
+	while(isspace((unsigned char) *text)) {
+		++text;
+	}
+
+	return text;
+}
+
+static void complete_handle(struct discovery_request* request, int index, CURLcode result) {
+	struct call_info info;
+
+	read_call_info(request->handles[index], &info);
+	stop_handle(request, index);
+
+	if(result == CURLE_OK && info.http_status == 200 && address_parse(trim(request->buffers[index].text), request->family, &request->address)) {
+		circuit_success(request->circuit);
+		record_call_latency(request->url, &info);
+		providers_record(request->provider, true, info.elapsed_ms);
+
+		if(index == 1) {
+			metrics_inc(METRIC_DISCOVERY_HEDGE_WINS);
+		}
+
+		// the slower request is abandoned
+		stop_handle(request, 1 - index);
+		request->state = REQUEST_DONE;
+	}
+	else if(!request->active[1 - index]) {
+		fail_attempt(request, result, &info);
+	}
+}
+
+static struct discovery_request* find_request(struct discovery_request* requests, size_t count, CURL* handle, int* index) {
+	for(size_t i = 0; i < count; ++i) {
+		for(int j = 0; j < 2; ++j) {
+			if(requests[i].handles[j] == handle) {
+				*index = j;
+				return requests + i;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void cancel_request(struct discovery_request* request) {
+	// the call tells nothing about the host, but it may have been the probe of its half-open circuit
+	if(request->state == REQUEST_RUNNING) {
+		circuit_release(request->circuit);
+	}
+
+	stop_handle(request, 0);
+	stop_handle(request, 1);
+	stop_udp(request);
+
+	request->state = REQUEST_CANCELLED;
+}
+
+/**
+ * Most common address among the completed requests of the target, with its votes
+ **/
+static const struct address* count_votes(const struct discovery_request* requests, size_t count, size_t target_index, size_t* votes) {
+	const struct address* best = NULL;
+
+	*votes = 0;
+
+	for(size_t i = 0; i < count; ++i) {
+		size_t current = 0;
+
+		if(requests[i].target_index != target_index || requests[i].state != REQUEST_DONE) {
+			continue;
+		}
+
+		for(size_t j = 0; j < count; ++j) {
+			current += requests[j].target_index == target_index && requests[j].state == REQUEST_DONE && address_equal(&requests[i].address, &requests[j].address);
+		}
+
+		if(current > *votes) {
+			best = &requests[i].address;
+			*votes = current;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Once the majority of the voters agree, the requests still running for the target are not needed
+ **/
+static void check_quorum(struct discovery_request* requests, size_t count, size_t target_index, size_t voters) {
+	size_t votes;
+
+	if(voters > 1 && count_votes(requests, count, target_index, &votes) != NULL && votes * 2 > voters) {
+		for(size_t i = 0; i < count; ++i) {
+			if(requests[i].target_index == target_index && (requests[i].state == REQUEST_WAITING || requests[i].state == REQUEST_RUNNING)) {
+				cancel_request(requests + i);
+			}
+		}
+	}
+}
+
+/**
+ * The address of the target, when voters > 1 it must be returned by the majority of them
+ **/
+static bool decide_address(const struct discovery_request* requests, size_t count, size_t target_index, size_t voters, struct address* address) {
+	size_t votes, answers = 0;
+	const struct address* best = count_votes(requests, count, target_index, &votes);
+	char text[ADDRESS_MAX_TEXT_LENGTH];
+
+	for(size_t i = 0; i < count; ++i) {
+		answers += requests[i].target_index == target_index && requests[i].state == REQUEST_DONE;
+	}
+
+	if(best == NULL || votes * 2 <= voters) {
+		if(best != NULL) {
+			log_error("Can't discover the %s address, no majority among %zu providers (at most %zu of them agree on '%s')",
+				address_record_type(best->family), voters, votes, address_format(best, text, sizeof(text)));
+			metrics_inc(METRIC_DISCOVERY_DISAGREEMENTS);
+		}
+
+		return false;
+	}
+
+	// the providers that answered something else are logged, they may be behind a proxy or a flapping nat
+	if(answers > votes) {
+		for(size_t i = 0; i < count; ++i) {
+			if(requests[i].target_index == target_index && requests[i].state == REQUEST_DONE && !address_equal(best, &requests[i].address)) {
+				log_warning("Discovery provider '%s' disagrees with the majority ('%s')", requests[i].url, address_format(&requests[i].address, text, sizeof(text)));
+			}
+		}
+
+		metrics_inc(METRIC_DISCOVERY_DISAGREEMENTS);
+	}
+
+	*address = *best;
+
+	return true;
+}
+
+size_t discover_addresses(const struct discovery_target* targets, size_t count, struct address* addresses) {
+	struct discovery_request requests[DISCOVERY_MAX_REQUESTS];
+	size_t voters[DISCOVERY_MAX_TARGETS] = { 0 }, request_count = 0;
+
+	if(count > DISCOVERY_MAX_TARGETS || !init_handles(count * quorum)) {
+		log_error("Couldn't allocate the curl handles for the discovery");
+		return 0;
+	}
+
+	for(size_t i = 0; i < count; ++i) {
+		struct provider* ranked[PROVIDERS_MAX];
+		size_t ranked_count = providers_rank(targets[i].family, ranked, PROVIDERS_MAX);
+
+		if(ranked_count == 0) {
+			log_error("There is no discovery provider for the %s records", address_record_type(targets[i].family));
+			continue;
+		}
+
+		voters[i] = quorum < ranked_count ? quorum : ranked_count;
+
+		for(size_t j = 0; j < voters[i]; ++j) {
+			struct discovery_request* request = requests + request_count;
+
+			*request = (struct discovery_request) {
+				.family = targets[i].family,
+				.target_index = i,
+				.interface = targets[i].interface != NULL && targets[i].interface[0] != 0 ? targets[i].interface : NULL,
+				.handles = { handles[request_count][0], handles[request_count][1] },
+				.socket = -1,
+				.state = REQUEST_WAITING
+			};
+
+			// a single request goes through all the providers, voters stick to their own so that none votes twice
+			if(voters[i] == 1) {
+				memcpy(request->providers, ranked, ranked_count * sizeof(struct provider*));
+				request->provider_count = ranked_count;
+			}
+			else {
+				request->providers[0] = ranked[j];
+				request->provider_count = 1;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &request->next_attempt_at);
+			++request_count;
+		}
+	}
+
+	for(;;) {
+		struct timespec now;
+		long wait_ms = DISCOVERY_POLL_MS;
+		bool pending = false;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for(size_t i = 0; i < request_count; ++i) {
+			struct discovery_request* request = requests + i;
+
+			if(request->state == REQUEST_WAITING) {
+				long due_ms = timespec_diff_ms(&request->next_attempt_at, &now);
+
+				if(due_ms > 0) {
+					wait_ms = due_ms < wait_ms ? due_ms : wait_ms;
+				}
+				else if(!select_provider(request)) {
+					log_error("Can't discover the %s address, the circuits of all the providers are open", address_record_type(request->family));
+					request->state = REQUEST_FAILED;
+				}
+				else {
+					start_attempt(request);
+				}
+			}
+
+			if(request->state == REQUEST_RUNNING && request->socket != -1) {
+				long timer_ms = check_udp(request, &now);
+
+				wait_ms = timer_ms < wait_ms ? timer_ms : wait_ms;
+			}
+
+			if(request->state == REQUEST_RUNNING && !request->active[1] && request->hedge_after_ms >= 0) {
+				long remaining_ms = request->hedge_after_ms - timespec_diff_ms(&now, &request->started);
+
+				if(remaining_ms <= 0) {
+					start_handle(request, 1);
+					request->hedge_after_ms = -1;
+
+					metrics_inc(METRIC_DISCOVERY_HEDGES);
+					log_debug("The call to '%s' is taking too long, sending a hedged request", request->url);
+				}
+				else {
+					wait_ms = remaining_ms < wait_ms ? remaining_ms : wait_ms;
+				}
+			}
+
+			pending |= request->state == REQUEST_WAITING || request->state == REQUEST_RUNNING;
+		}
+
+		if(!pending) {
+			break;
+		}
+
+		int running, queued;
+		bool completed = false;
+		CURLMsg* message;
+		struct curl_waitfd sockets[DISCOVERY_MAX_REQUESTS];
+		unsigned int socket_count = 0;
+
+		for(size_t i = 0; i < request_count; ++i) {
+			if(requests[i].state == REQUEST_RUNNING && requests[i].socket != -1) {
+				sockets[socket_count++] = (struct curl_waitfd) { .fd = requests[i].socket, .events = CURL_WAIT_POLLIN };
+			}
+		}
+
+		curl_multi_perform(multi, &running);
+
+		while((message = curl_multi_info_read(multi, &queued)) != NULL) {
+			int index;
+			struct discovery_request* request;
+
+			if(message->msg == CURLMSG_DONE && (request = find_request(requests, request_count, message->easy_handle, &index)) != NULL) {
+				// the result must be read before the handle gets removed
+				complete_handle(request, index, message->data.result);
+				completed = true;
+			}
+		}
+
+		if(!completed) {
+			curl_multi_poll(multi, sockets, socket_count, (int) wait_ms, NULL);
+		}
+
+		for(size_t i = 0; i < request_count; ++i) {
+			if(requests[i].state == REQUEST_RUNNING && requests[i].socket != -1) {
+				receive_udp(requests + i);
+			}
+		}
+
+		for(size_t i = 0; i < count; ++i) {
+			check_quorum(requests, request_count, i, voters[i]);
+		}
+	}
+
+	size_t found = 0;
+
+	for(size_t i = 0; i < count; ++i) {
+		addresses[i] = (struct address) { 0 };
+		found += voters[i] > 0 && decide_address(requests, request_count, i, voters[i], addresses + i);
+	}
+
+	return found;
+}
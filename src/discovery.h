@@ -0,0 +1,45 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "address.h"
+
+// host of the udp provider urls that stands for the gateway of the default route, like 'natpmp://_gateway'
+#define DISCOVERY_GATEWAY_HOST "_gateway"
+
+#define DISCOVERY_MAX_QUORUM 7
+#define DISCOVERY_MAX_TARGETS 8
+
+/**
+ * Address to discover: the family (AF_INET or AF_INET6) seen through an uplink, given as interface name or source address
+ * (NULL or empty for the default route)
+ **/
+struct discovery_target {
+	int family;
+	const char* interface;
+};
+
+/**
+ * Number of providers queried concurrently for every target, an address is accepted only if the majority of them returns it.
+ * With 1 (the default) the address of the first provider that answers is used.
+ **/
+void discovery_configure(size_t quorum);
+
+/**
+ * Url of the best provider for the family (AF_INET or AF_INET6), NULL if there is none
+ **/
+const char* discovery_url(int family);
+
+/**
+ * Queries the external address of every target concurrently, with retries and hedged requests.
+ * Every target goes to the best provider of its family, retries move on to the next ones, or to the best providers of the quorum.
+ * addresses[i] gets the address of targets[i], or an address with family 0 if the discovery failed.
+ * Returns the number of discovered addresses.
+ **/
+size_t discover_addresses(const struct discovery_target* targets, size_t count, struct address* addresses);
+
+void discovery_cleanup();
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sysexits.h>
+
+#include "address.h"
+#include "history.h"
+
+// records summed up at the end, the others are still listed
+#define SUMMARY_MAX_RECORDS 64
+
+struct record_summary {
+	char record_id[CLOUDFLARE_ID_SIZE + 1];
+	size_t changes;
+	size_t failures;
+	uint64_t latency_total_ms;
+	uint32_t latency_max_ms;
+	int64_t first_ms;
+	int64_t last_ms;
+};
+
+struct listing {
+	const char* record_id; // only the events of this record if not NULL
+	struct record_summary summaries[SUMMARY_MAX_RECORDS];
+	size_t summary_count;
+};
+
+static struct address event_address(const struct history_event* event, const uint8_t* bytes) {
+	struct address address = { .family = event->family == 6 ? AF_INET6 : AF_INET };
+	memcpy(address.bytes, bytes, sizeof(address.bytes));
+
+	// an all zero old address means that the record had none yet
+	static const uint8_t none[16] = { 0 };
+	if(memcmp(bytes, none, sizeof(none)) == 0) {
+		address.family = 0;
+	}
+
+	return address;
+}
+
+static struct record_summary* find_summary(struct listing* listing, const char* record_id) {
+	for(size_t i = 0; i < listing->summary_count; ++i) {
+		if(strcmp(listing->summaries[i].record_id, record_id) == 0) {
+			return listing->summaries + i;
+		}
+	}
+
+	if(listing->summary_count == SUMMARY_MAX_RECORDS) {
+		return NULL;
+	}
+
+	struct record_summary* summary = listing->summaries + listing->summary_count++;
+	*summary = (struct record_summary) { 0 };
+	snprintf(summary->record_id, sizeof(summary->record_id), "%s", record_id);
+
+	return summary;
+}
+
+static void print_event(const struct history_event* event, void* data) {
+	struct listing* listing = data;
+
+	if(listing->record_id != NULL && strcmp(listing->record_id, event->record_id) != 0) {
+		return;
+	}
+
+	struct address old_address = event_address(event, event->old_address), new_address = event_address(event, event->new_address);
+	char old_text[ADDRESS_MAX_TEXT_LENGTH], new_text[ADDRESS_MAX_TEXT_LENGTH], time_text[32];
+	time_t seconds = event->timestamp_ms / 1000;
+	struct tm time;
+
+	strftime(time_text, sizeof(time_text), "%Y-%m-%dT%H:%M:%S", gmtime_r(&seconds, &time));
+
+	printf("%s.%03dZ %-4s %s '%s' -> '%s' %u ms %s\n", time_text, (int) (event->timestamp_ms % 1000), event->family == 6 ? "AAAA" : "A",
+		event->record_id, address_format(&old_address, old_text, sizeof(old_text)), address_format(&new_address, new_text, sizeof(new_text)),
+		event->latency_ms, event->result == HISTORY_RESULT_UPDATED ? "updated" : "failed");
+
+	struct record_summary* summary = find_summary(listing, event->record_id);
+
+	if(summary == NULL) {
+		return;
+	}
+
+	if(summary->changes + summary->failures == 0) {
+		summary->first_ms = event->timestamp_ms;
+	}
+
+	summary->last_ms = event->timestamp_ms;
+	summary->latency_total_ms += event->latency_ms;
+
+	if(event->latency_ms > summary->latency_max_ms) {
+		summary->latency_max_ms = event->latency_ms;
+	}
+
+	if(event->result == HISTORY_RESULT_UPDATED) {
+		++summary->changes;
+	}
+	else {
+		++summary->failures;
+	}
+}
+
+int main(int argc, char** argv) {
+	struct listing* listing = calloc(1, sizeof(struct listing));
+	const char* path = HISTORY_FILE_PATH;
+
+	if(listing == NULL) {
+		return EX_OSERR;
+	}
+
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			path = argv[++i];
+		}
+		else if(argv[i][0] != '-' && listing->record_id == NULL) {
+			listing->record_id = argv[i];
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-f <history file>] [<record id>]\n", argv[0]);
+			free(listing);
+			return EX_USAGE;
+		}
+	}
+
+	if(!history_read(path, print_event, listing)) {
+		fprintf(stderr, "Couldn't read the history '%s'\n", path);
+		free(listing);
+		return EX_NOINPUT;
+	}
+
+	// how often the addresses flap and how long the api takes to accept them
+	for(size_t i = 0; i < listing->summary_count; ++i) {
+		struct record_summary* summary = listing->summaries + i;
+		size_t events = summary->changes + summary->failures;
+		double hours = (summary->last_ms - summary->first_ms) / 3600000.0;
+
+		printf("%s: %zu changes, %zu failures, %.1f changes per day, latency avg %llu ms max %u ms\n", summary->record_id,
+			summary->changes, summary->failures, hours > 0 ? summary->changes * 24 / hours : 0.0,
+			(unsigned long long) (summary->latency_total_ms / events), summary->latency_max_ms);
+	}
+
+	free(listing);
+
+	return EX_OK;
+}
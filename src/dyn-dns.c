@@ -7,7 +7,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/signalfd.h>
 #include <systemd/sd-daemon.h>
 
 #include <curl/curl.h>
@@ -16,30 +22,59 @@
 #include "lib/logger.h"
 #include "utils.h"
 #include "mlib.h"
-
+#include "retry.h"
+#include "metrics.h"
+#include "circuit.h"
+#include "scheduler.h"
+#include "timeouts.h"
+#include "resolver.h"
+#include "prewarm.h"
+#include "http.h"
+#include "address.h"
+#include "records.h"
+#include "discovery.h"
+#include "providers.h"
+#include "triggers.h"
+#include "verify.h"
+#include "reconcile.h"
+#include "outbox.h"
+#include "history.h"
+
+// default bounds of the adaptive timeouts, that are the observed p99 latencies multiplied by the factor
 #define CALL_TIMEOUT_SEC 5
+#define TIMEOUT_MIN_MS 500
+#define TIMEOUT_FACTOR 3
 
-#define EXT_IP_MAX_LENGTH 16
-#define EXT_IP_QUERY_URL "http://api.ipify.org/?format=text"
+// retry policy, delays use exponential backoff with full jitter
+#define PATCH_MAX_ATTEMPTS 4
+#define RETRY_BASE_DELAY_MS 250
+#define RETRY_MAX_DELAY_MS 4000
 
 #define CLOUDFLARE_DNS_UPDATE_METHOD "PATCH"
-#define CLOUDFLARE_DNS_UPDATE_URL "https://api.cloudflare.com/client/v4/zones/%s/dns_records/%s"
-#define CLOUDFLARE_AUTHORIZATION_HEADER "Authorization: Bearer %s"
+#define CLOUDFLARE_DNS_UPDATE_URL "https://" CLOUDFLARE_API_HOST "/client/v4/zones/%s/dns_records/%s"
 #define CLOUDFLARE_CONTENT_TYPE_HEADER "Content-Type: application/json"
 #define CLOUDFLARE_DNS_PATCH_DATA "{\"content\":\"%s\"}"
 
+// connections to the upstream hosts are opened this long before the predicted run
+#define PREWARM_LEAD_MS 2000
+#define CLOUDFLARE_API_ROOT_URL "https://" CLOUDFLARE_API_HOST "/client/v4/"
+
 #define DYN_DNS_ETC "/etc/dyn-dns/"
 #define ACCESS_CONFIG_FILE_PATH DYN_DNS_ETC "cloudflare.config"
 
 #define DYN_DNS_VAR "/var/lib/dyn-dns/"
 #define PREV_ADDRESS_FILE_PATH DYN_DNS_VAR "prev_address.dat"
+#define METRICS_FILE_PATH DYN_DNS_VAR "metrics.prom"
+#define PROVIDERS_FILE_PATH DYN_DNS_VAR "providers.dat"
+#define RECORDS_CACHE_FILE_PATH DYN_DNS_VAR "records.cache"
+#define OUTBOX_FILE_PATH DYN_DNS_VAR "outbox.log"
 
 #define CLOUDFLARE_MAX_TOKEN_SIZE 512
-#define CLOUDFLARE_ID_SIZE 32
 
 char token[CLOUDFLARE_MAX_TOKEN_SIZE + 1] = { 0 };
-char zone_id[CLOUDFLARE_ID_SIZE + 1] = { 0 };
-char record_id[CLOUDFLARE_ID_SIZE + 1] = { 0 };
+
+// the records are compared with what the api really holds (and their names resolved) once after every (re)load
+bool reconciled = false;
 
 bool load_config_variables(char* config_file_path) {
 	FILE* config_file = fopen(config_file_path, "r");
@@ -53,92 +88,102 @@ bool load_config_variables(char* config_file_path) {
 		if(temp != NULL)
 			strncpy(token, temp, CLOUDFLARE_MAX_TOKEN_SIZE);
 
-		temp = get_property_value(properties, "ZONE_ID");
-		if(temp != NULL)
-			strncpy(zone_id, temp, CLOUDFLARE_ID_SIZE);
+		if(records_load(properties) == 0)
+			log_warning("No dns record configured, expected ZONE_ID with RECORD_ID or RECORD_ID_AAAA, or RECORD or HOST lines");
 
-		temp = get_property_value(properties, "RECORD_ID");
-		if(temp != NULL)
-			strncpy(record_id, temp, CLOUDFLARE_ID_SIZE);
+		// the names resolved before the restart
+		records_read_cache(RECORDS_CACHE_FILE_PATH);
 
-		free_properties(properties);
-		fclose(config_file);
+		providers_load(properties);
 
-		return true;	
-	}
+		long quorum = 1;
 
-	return false;
-}
+		temp = get_property_value(properties, "DISCOVERY_QUORUM");
+		if(temp != NULL)
+			quorum = strtol(temp, NULL, 10);
 
-void setup_dir(char* dir) {
-	if (stat(dir, &(struct stat){}) == -1) {
-		if(mkdir(dir, 0700) != 0) {
-			sd_notifyf(0, "STATUS=Failed to start up: Couldn't create directory '%s'", dir);
-			exit(EX_NOPERM);
+		if(quorum < 1 || quorum > DISCOVERY_MAX_QUORUM) {
+			log_warning("Invalid DISCOVERY_QUORUM '%s', expected a number between 1 and %d", temp, DISCOVERY_MAX_QUORUM);
+			quorum = 1;
 		}
-	}
-}
 
-static inline CURLcode perform_call(CURL* curl, const char* url, size_t (*callback)(char*, size_t, size_t, void*)) {
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, CALL_TIMEOUT_SEC);
+		discovery_configure(quorum);
 
-	log_debug("Performing call to '%s'", url);
-	CURLcode result = curl_easy_perform(curl);
+		triggers_load(properties);
 
-	curl_easy_reset(curl);
+		temp = get_property_value(properties, "VERIFY_DNS");
+		verify_configure(temp != NULL && strcmp(temp, "true") == 0);
 
-	return result;
-}
+		temp = get_property_value(properties, "RECONCILE");
+		reconciled = temp != NULL && strcmp(temp, "false") == 0 && records_unresolved() == 0;
 
-char* read_prev_address() {
-	FILE* prev_address_file = fopen(PREV_ADDRESS_FILE_PATH, "r");
-	char* prev_address;
+		long token_quota = RATE_LIMIT_DEFAULT_QUOTA, token_window_sec = RATE_LIMIT_DEFAULT_WINDOW_SEC,
+			zone_quota = RATE_LIMIT_DEFAULT_QUOTA, zone_window_sec = RATE_LIMIT_DEFAULT_WINDOW_SEC;
 
-	// if it can't be opened it does not exist and we set an empty prev_address
-	if(prev_address_file != NULL) {
-		prev_address = reg_ptr(read_file(prev_address_file));
-		fclose(prev_address_file);
-		prev_address_file = NULL;
-	}
-	else {
-		prev_address = reg_ptr(malloc(1));
-		prev_address[0] = 0;
-	}
+		temp = get_property_value(properties, "RATE_LIMIT_TOKEN");
+		if(temp != NULL && !scheduler_parse_limit(temp, &token_quota, &token_window_sec))
+			log_warning("Invalid RATE_LIMIT_TOKEN '%s', expected '<requests>/<seconds>'", temp);
 
-	return prev_address;
-}
+		temp = get_property_value(properties, "RATE_LIMIT_ZONE");
+		if(temp != NULL && !scheduler_parse_limit(temp, &zone_quota, &zone_window_sec))
+			log_warning("Invalid RATE_LIMIT_ZONE '%s', expected '<requests>/<seconds>'", temp);
 
-void write_prev_address(char* address) {
-	FILE* prev_address_file = fopen(PREV_ADDRESS_FILE_PATH, "w");
-	fputs(address, prev_address_file);
-	fclose(prev_address_file);
-}
+		scheduler_set_limits(token_quota, token_window_sec, zone_quota, zone_window_sec);
 
-// current address call
-char current_address[EXT_IP_MAX_LENGTH + 1] = "";
+		long timeout_min_ms = TIMEOUT_MIN_MS, timeout_max_ms = CALL_TIMEOUT_SEC * 1000;
+		double timeout_factor = TIMEOUT_FACTOR;
 
-// callback for external address curl call
-size_t address_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata) {
-	size_t size = itemSize * itemCount,
-		max_size = size < EXT_IP_MAX_LENGTH ? size : EXT_IP_MAX_LENGTH;
+		temp = get_property_value(properties, "TIMEOUT_MIN_MS");
+		if(temp != NULL)
+			timeout_min_ms = strtol(temp, NULL, 10);
 
-	memcpy(current_address, buffer, max_size);
-	current_address[max_size] = 0;
+		temp = get_property_value(properties, "TIMEOUT_MAX_MS");
+		if(temp != NULL)
+			timeout_max_ms = strtol(temp, NULL, 10);
 
-	return size;
-}
+		temp = get_property_value(properties, "TIMEOUT_FACTOR");
+		if(temp != NULL)
+			timeout_factor = strtod(temp, NULL);
+
+		if(timeout_min_ms <= 0 || timeout_max_ms <= 0 || timeout_factor <= 0) {
+			log_warning("Invalid adaptive timeout properties, using the defaults");
+			timeout_min_ms = TIMEOUT_MIN_MS;
+			timeout_max_ms = CALL_TIMEOUT_SEC * 1000;
+			timeout_factor = TIMEOUT_FACTOR;
+		}
 
-char* query_current_address(CURL* curl) {
-	CURLcode result = perform_call(curl, EXT_IP_QUERY_URL, address_callback);
+		timeouts_configure(timeout_min_ms, timeout_max_ms, timeout_factor);
+
+		long prewarm_lead_ms = PREWARM_LEAD_MS;
+
+		temp = get_property_value(properties, "PREWARM_LEAD_MS");
+		if(temp != NULL)
+			prewarm_lead_ms = strtol(temp, NULL, 10);
+
+		prewarm_configure(prewarm_lead_ms);
+
+		temp = get_property_value(properties, "RESOLVER");
+		if(!resolver_configure(temp)) {
+			log_warning("Invalid RESOLVER '%s', using the nameserver from /etc/resolv.conf", temp);
+			resolver_configure(NULL);
+		}
 
-	if(result != CURLE_OK) {
-		log_error("Call to '" EXT_IP_QUERY_URL "' resulted in an error (curl result = '%s')", curl_easy_strerror(result));
-		return NULL;
+		free_properties(properties);
+		fclose(config_file);
+
+		return true;	
 	}
 
-	return current_address;
+	return false;
+}
+
+void setup_dir(char* dir) {
+	if (stat(dir, &(struct stat){}) == -1) {
+		if(mkdir(dir, 0700) != 0) {
+			sd_notifyf(0, "STATUS=Failed to start up: Couldn't create directory '%s'", dir);
+			exit(EX_NOPERM);
+		}
+	}
 }
 
 // cloudflare patch call
@@ -148,6 +193,8 @@ bool cloudflare_success = false;
 size_t cloudflare_patch_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata) {
 	size_t size = itemSize * itemCount;
 
+	(void) userdata;
+
 	// if we still need to search for the success string
 	if(!cloudflare_success) {
 		char* success_location = strstr(buffer, "\"success\":");
@@ -173,8 +220,19 @@ struct curl_slist* add_header(struct curl_slist* headersList, const char* header
 	return temp;
 }
 
-bool patch_cloudflare_record(CURL* curl) {
-	char* post_data = reg_ptr(format_string(CLOUDFLARE_DNS_PATCH_DATA, current_address));
+const struct retry_policy patch_retry_policy = {
+	.max_attempts = PATCH_MAX_ATTEMPTS,
+	.base_delay_ms = RETRY_BASE_DELAY_MS,
+	.max_delay_ms = RETRY_MAX_DELAY_MS
+};
+
+/**
+ * Patches the record with its retries, request_ms is the duration of the last request (-1 if none was made)
+ * without the waits for the rate limits and between the retries
+ **/
+bool patch_cloudflare_record(CURL* curl, struct record* record, char* address, double* request_ms) {
+	char* post_data = reg_ptr(format_string(CLOUDFLARE_DNS_PATCH_DATA, address));
+	char* url = reg_ptr(format_string(CLOUDFLARE_DNS_UPDATE_URL, record->zone_id, record->record_id));
 
 	log_debug("The request body is '%s'", post_data);
 
@@ -183,48 +241,444 @@ bool patch_cloudflare_record(CURL* curl) {
 	headers = add_header(headers, CLOUDFLARE_CONTENT_TYPE_HEADER);
 	reg_ptr_fn(headers, (void (*)(void *)) curl_slist_free_all);
 
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(post_data));
-	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, CLOUDFLARE_DNS_UPDATE_METHOD);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	struct circuit_breaker* circuit = circuit_for_url(url);
+	struct rate_limit_headers limits;
+	struct call_info info;
+	CURLcode result;
+
+	*request_ms = -1;
+
+	for(unsigned int attempt = 0; ; ++attempt) {
+		if(!circuit_allow(circuit)) {
+			log_error("Call to update the cloudflare record '%s' skipped, the circuit for the host is open", record->record_id);
+			return false;
+		}
+
+		if(!scheduler_acquire(token, record->zone_id)) {
+			circuit_release(circuit);
+			return false;
+		}
+
+		limits = (struct rate_limit_headers) { -1, -1, -1, -1, -1 };
+
+		// the options are set on every attempt since perform_call resets the handle
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(post_data));
+		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, CLOUDFLARE_DNS_UPDATE_METHOD);
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, rate_limit_header_callback);
+		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &limits);
+
+		cloudflare_success = false;
+		result = perform_call(curl, url, cloudflare_patch_callback, NULL, &info);
+		scheduler_update(token, &limits);
+		*request_ms = info.elapsed_ms;
+
+		if(result == CURLE_OK && cloudflare_success) {
+			circuit_success(circuit);
+			record_call_latency(url, &info);
+			return true;
+		}
+
+		log_warning("Call to update the cloudflare record '%s' failed (curl result = '%s', http status = %ld)", record->record_id, curl_easy_strerror(result), info.http_status);
+
+		if(!report_call_failure(circuit, result, &info) || !retry_wait(&patch_retry_policy, attempt)) {
+			break;
+		}
+
+		metrics_inc(METRIC_PATCH_RETRIES);
+	}
+
+	log_error("Error in the curl call to update the cloudflare record '%s' (curl result = '%s', cloudflare success = '%s')",
+		record->record_id, curl_easy_strerror(result), cloudflare_success ? "true" : "false");
+
+	// the record was deleted (or recreated with another id), its name gets resolved again on the next run
+	if(result == CURLE_OK && info.http_status == 404 && record->by_name) {
+		log_warning("The %s record '%s' doesn't exist anymore, its id will be resolved again", address_record_type(record->family), record->name);
+		records_forget(record);
+		records_write_cache(RECORDS_CACHE_FILE_PATH);
+		reconciled = false;
+	}
+
+	return false;
+}
+
+/**
+ * Opens (or keeps alive) the connections to the upstream hosts, so that the next run doesn't pay for the tcp and tls setup
+ **/
+void prewarm_connections(CURL* curl) {
+	const char* urls[3];
+	size_t count = 0;
+
+	if(records_need_family(AF_INET) && (urls[count] = discovery_url(AF_INET)) != NULL)
+		++count;
+
+	if(records_need_family(AF_INET6) && (urls[count] = discovery_url(AF_INET6)) != NULL)
+		++count;
 
-	CURLcode result = perform_call(curl, reg_ptr(format_string(CLOUDFLARE_DNS_UPDATE_URL, zone_id, record_id)), cloudflare_patch_callback);
+	urls[count++] = CLOUDFLARE_API_ROOT_URL;
 
-	if(result != CURLE_OK || !cloudflare_success) {
-		log_error("Error in the curl call to update the cloudflare record (curl result = '%s', cloudflare success = '%s')",
-			curl_easy_strerror(result), cloudflare_success ? "true" : "false");
+	for(size_t i = 0; i < count; ++i) {
+		char host[PREWARM_HOST_MAX_LENGTH + 1];
+		struct circuit_breaker* circuit = circuit_for_url(urls[i]);
+		struct call_info info;
 
+		// hosts that are down are left to the circuit breaker probes, udp providers have no connection to open
+		if(strncmp(urls[i], "http", 4) != 0 || !url_host(urls[i], host, sizeof(host)) || (circuit != NULL && circuit->state != CIRCUIT_CLOSED)) {
+			continue;
+		}
+
+		curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+		CURLcode result = perform_call(curl, urls[i], discard_callback, NULL, &info);
+
+		if(result != CURLE_OK) {
+			log_debug("Couldn't prewarm the connection to '%s' (curl result = '%s')", host, curl_easy_strerror(result));
+		}
+		else if(info.connect_ms >= 0) {
+			metrics_inc(METRIC_PREWARMS);
+			prewarm_record(host, info.connect_ms);
+		}
+	}
+
+	prewarm_done();
+}
+
+/**
+ * Waits for a signal of the signalfd or for a run of the triggers (sig is then 0), prewarming the connections when the
+ * next run is close
+ **/
+bool wait_event(int signal_fd, int* sig, CURL* curl) {
+	for(;;) {
+		struct pollfd fds[1 + TRIGGERS_MAX_FDS] = { { .fd = signal_fd, .events = POLLIN } };
+		size_t count = 1 + triggers_fds(fds + 1, TRIGGERS_MAX_FDS);
+
+		long run_ms = triggers_due_in_ms(), prewarm_ms = prewarm_due_in_ms(run_ms), timeout_ms = prewarm_ms;
+
+		if(run_ms >= 0 && (timeout_ms < 0 || run_ms < timeout_ms)) {
+			timeout_ms = run_ms;
+		}
+
+		int ready = poll(fds, count, timeout_ms > INT_MAX ? INT_MAX : (int) timeout_ms);
+
+		if(ready < 0) {
+			if(errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			struct signalfd_siginfo info;
+
+			if(read(signal_fd, &info, sizeof(info)) != sizeof(info))
+				return false;
+
+			*sig = info.ssi_signo;
+			return true;
+		}
+
+		if(triggers_handle(fds + 1, count - 1)) {
+			prewarm_uplink_changed();
+		}
+
+		if(triggers_due_in_ms() == 0) {
+			*sig = 0;
+			return true;
+		}
+
+		// the connections are opened while the events of the trigger settle
+		if(prewarm_due_in_ms(triggers_due_in_ms()) == 0) {
+			SCOPE(prewarm_connections(curl))
+		}
+	}
+}
+
+/**
+ * Lets the background resolver cache the addresses of all the upstream hosts
+ **/
+void watch_upstream_hosts() {
+	size_t count;
+	struct provider* providers = providers_get(&count);
+
+	for(size_t i = 0; i < count; ++i) {
+		char host[RESOLVER_HOST_MAX_LENGTH + 1];
+
+		if(url_host(providers[i].url, host, sizeof(host)) && strcmp(host, DISCOVERY_GATEWAY_HOST) != 0) {
+			resolver_watch(host);
+		}
+	}
+
+	resolver_watch(CLOUDFLARE_API_HOST);
+}
+
+// the published addresses changed since the state file was written
+static bool state_changed = false;
+
+/**
+ * Writes all the changes of the run at once, a single file replacement and sync whatever the number of records
+ **/
+static void write_state() {
+	if(state_changed) {
+		records_write_state(PREV_ADDRESS_FILE_PATH);
+		state_changed = false;
+	}
+}
+
+// address to write to a record, allocated for the scope of the run
+struct record_update {
+	struct record* record;
+	struct address address;
+};
+
+bool patch_record_job(CURL* curl, void* data) {
+	struct record_update* update = data;
+	char address[ADDRESS_MAX_TEXT_LENGTH], record_id[CLOUDFLARE_ID_SIZE + 1];
+	double request_ms;
+
+	// a record that doesn't exist anymore loses its id in the call
+	snprintf(record_id, sizeof(record_id), "%s", update->record->record_id);
+
+	bool patched = patch_cloudflare_record(curl, update->record, address_format(&update->address, address, sizeof(address)), &request_ms);
+
+	// the latency of the api, not the time the update was queued or retried
+	history_append(record_id, &update->record->published, &update->address, request_ms > 0 ? (long) (request_ms + 0.5) : 0, patched ? HISTORY_RESULT_UPDATED : HISTORY_RESULT_FAILED);
+
+	if(!patched) {
 		return false;
 	}
 
+	log_status("Cloudflare %s record '%s' updated successfully", address_record_type(update->record->family), update->record->record_id);
+	update->record->published = update->address;
+	state_changed = true;
+	outbox_done(update->record->record_id, &update->address);
+
 	return true;
 }
 
+/**
+ * Queues the patch of the record to the scheduler, the caller makes the outbox durable before draining it
+ **/
+static void queue_update(struct record* record, const struct address* address, enum job_priority priority) {
+	struct record_update* update = reg_ptr(malloc(sizeof(struct record_update)));
+	*update = (struct record_update) {
+		.record = record,
+		.address = *address
+	};
+
+	outbox_append(record->record_id, address);
+
+	scheduler_enqueue(&(struct api_job) {
+		.token = token,
+		.zone = record->zone_id,
+		.priority = priority,
+		.perform = patch_record_job,
+		.data = update
+	});
+}
+
+/**
+ * Queues the updates left pending by a previous process or by a failed or deferred patch, except for the records
+ * already updated by the run (updating can be NULL). Returns the number of queued updates
+ **/
+static size_t queue_replays(const bool* updating) {
+	size_t count, queued = 0;
+	struct record* records = records_get(&count);
+
+	for(size_t i = 0; i < count; ++i) {
+		struct address pending;
+		char text[ADDRESS_MAX_TEXT_LENGTH];
+
+		if(records[i].record_id[0] == 0 || (updating != NULL && updating[i]) || !outbox_pending(records[i].record_id, &pending)) {
+			continue;
+		}
+
+		if(address_equal(&records[i].published, &pending)) {
+			outbox_done(records[i].record_id, NULL);
+			continue;
+		}
+
+		log_status("Replaying the pending update of the %s record '%s' to '%s'", address_record_type(records[i].family), records[i].record_id, address_format(&pending, text, sizeof(text)));
+		metrics_inc(METRIC_OUTBOX_REPLAYED);
+
+		queue_update(records + i, &pending, JOB_PRIORITY_BACKGROUND);
+		++queued;
+	}
+
+	return queued;
+}
+
+/**
+ * Replays the pending updates in one batch at startup, without waiting for a discovery
+ **/
+void flush_outbox(CURL* curl) {
+	records_read_state(PREV_ADDRESS_FILE_PATH);
+
+	if(queue_replays(NULL) > 0) {
+		outbox_sync();
+		scheduler_drain(curl);
+	}
+
+	write_state();
+}
+
+/**
+ * Index of the discovery target of the record, the records sharing family and uplink share the target.
+ * Returns DISCOVERY_MAX_TARGETS if there is no room for another target.
+ **/
+static size_t add_target(struct discovery_target* targets, size_t* count, const struct record* record) {
+	for(size_t i = 0; i < *count; ++i) {
+		if(targets[i].family == record->family && strcmp(targets[i].interface, record->interface) == 0) {
+			return i;
+		}
+	}
+
+	if(*count >= DISCOVERY_MAX_TARGETS) {
+		return DISCOVERY_MAX_TARGETS;
+	}
+
+	targets[*count] = (struct discovery_target) {
+		.family = record->family,
+		.interface = record->interface
+	};
+
+	return (*count)++;
+}
+
+// array of count elements allocated for the scope of the run
+static void* run_array(size_t count, size_t size) {
+	void* array = reg_ptr(calloc(count + 1, size));
+
+	if(array == NULL) {
+		log_error("Couldn't allocate the run of %zu records", count);
+		exit(EX_OSERR);
+	}
+
+	return array;
+}
+
 void dyn_dns_run(CURL* curl) {
-	char *prev_address = read_prev_address(),
-		*current_address = query_current_address(curl);
+	struct discovery_target targets[DISCOVERY_MAX_TARGETS];
+	struct address addresses[DISCOVERY_MAX_TARGETS];
+	size_t target_count = 0, record_count;
+	struct record* records = records_get(&record_count);
+	struct address* local = run_array(record_count, sizeof(struct address));
+	size_t* record_targets = run_array(record_count, sizeof(size_t));
+
+	records_read_state(PREV_ADDRESS_FILE_PATH);
+
+	// the state file may be lost or stale, the records listed by the api replace it
+	if(!reconciled) {
+		reconciled = reconcile_records(token);
+		state_changed = true;
+		records_write_cache(RECORDS_CACHE_FILE_PATH);
+	}
+
+	for(size_t i = 0; i < record_count; ++i) {
+		local[i] = (struct address) { 0 };
+		record_targets[i] = DISCOVERY_MAX_TARGETS;
 
-	if(current_address == NULL) {
-		log_error("Can't update record, the query function for the current_address failed");
-		return;
+		if(records[i].record_id[0] == 0) {
+			continue;
+		}
+
+		// records bound to an interface with a public address don't need any network call
+		if(records[i].interface[0] != 0 && address_from_interface(records[i].interface, records[i].family, local + i)) {
+			log_debug("Using the address of interface '%s' for record '%s'", records[i].interface, records[i].record_id);
+		}
+		else if((record_targets[i] = add_target(targets, &target_count, records + i)) == DISCOVERY_MAX_TARGETS) {
+			log_error("Too many uplinks to discover, record '%s' is skipped (max %d)", records[i].record_id, DISCOVERY_MAX_TARGETS);
+		}
 	}
 
-	log_debug("The previous ip is '%s' the retrieved ip is '%s'", prev_address, current_address);
+	// all the families and uplinks are discovered concurrently
+	if(target_count > 0 && discover_addresses(targets, target_count, addresses) == 0) {
+		log_error("The discovery of the current addresses failed");
+	}
 
-	if(strcmp(prev_address, current_address)) {
-		log_status("Ip changed from '%s' to '%s' patching cloudflare dns record", prev_address, current_address);
+	struct record** pending = run_array(record_count, sizeof(struct record*));
+	struct address* pending_addresses = run_array(record_count, sizeof(struct address));
+	bool* published = run_array(record_count, sizeof(bool));
+	bool* updating = run_array(record_count, sizeof(bool));
+	size_t pending_count = 0;
 
-		if(patch_cloudflare_record(curl)) {
-			log_status("Cloudflare record updated successfully");
+	for(size_t i = 0; i < record_count; ++i) {
+		struct record* record = records + i;
+		const struct address* current = local[i].family != 0 ? local + i
+			: record_targets[i] < target_count && addresses[record_targets[i]].family != 0 ? addresses + record_targets[i] : NULL;
 
-			write_prev_address(current_address);
+		if(record->record_id[0] == 0) {
+			log_error("Can't update the %s record '%s', its id is not resolved", address_record_type(record->family), record->name);
+			continue;
+		}
+
+		if(current == NULL) {
+			log_error("Can't update record '%s', the discovery of the %s address failed", record->record_id, address_record_type(record->family));
+			continue;
+		}
+
+		char previous_text[ADDRESS_MAX_TEXT_LENGTH], current_text[ADDRESS_MAX_TEXT_LENGTH];
+
+		address_format(&record->published, previous_text, sizeof(previous_text));
+		address_format(current, current_text, sizeof(current_text));
+		log_debug("The previous ip of record '%s' is '%s' the retrieved ip is '%s'", record->record_id, previous_text, current_text);
+
+		if(!address_equal(&record->published, current)) {
+			pending[pending_count] = record;
+			pending_addresses[pending_count++] = *current;
+		}
+		else {
+			// an update left pending for another address is obsolete
+			outbox_done(record->record_id, NULL);
 		}
 	}
+
+	// the state file may be lost or stale, the records already holding the address don't need an update
+	if(pending_count > 0 && verify_published(pending, pending_addresses, pending_count, published) > 0) {
+		for(size_t i = 0; i < pending_count; ++i) {
+			if(published[i]) {
+				log_status("The %s record '%s' is already published with the current ip", address_record_type(pending[i]->family), pending[i]->record_id);
+				metrics_inc(METRIC_VERIFY_SKIPPED_UPDATES);
+				pending[i]->published = pending_addresses[i];
+				outbox_done(pending[i]->record_id, NULL);
+				state_changed = true;
+			}
+		}
+	}
+
+	bool changed = false;
+
+	for(size_t i = 0; i < pending_count; ++i) {
+		struct record* record = pending[i];
+		char previous_text[ADDRESS_MAX_TEXT_LENGTH], current_text[ADDRESS_MAX_TEXT_LENGTH];
+
+		if(published[i]) {
+			continue;
+		}
+
+		address_format(&record->published, previous_text, sizeof(previous_text));
+		address_format(pending_addresses + i, current_text, sizeof(current_text));
+		log_status("Ip changed from '%s' to '%s' patching cloudflare dns %s record '%s'", previous_text, current_text, address_record_type(record->family), record->record_id);
+
+		queue_update(record, pending_addresses + i, JOB_PRIORITY_ADDRESS_CHANGE);
+		updating[record - records] = true;
+		changed = true;
+	}
+
+	// the replays go behind the fresh updates in the same drain, a record gets a single update with its newest address
+	if(queue_replays(updating) > 0) {
+		changed = true;
+	}
+
+	// a single sync for all the updates of the run
+	if(changed) {
+		outbox_sync();
+		scheduler_drain(curl);
+	}
 	else {
 		log_debug("There is nothing to do");
 	}
 
-	return;
+	write_state();
 }
 
 int main() {
@@ -239,11 +693,25 @@ int main() {
 		exit(EX_CONFIG);
 	}
 	
+	// the provider choice learned before the restart
+	providers_read_state(PROVIDERS_FILE_PATH);
+
 	curl_global_init(CURL_GLOBAL_ALL);
 	atexit(curl_global_cleanup); // register cleanup function
 
+	if(!http_init()) {
+		sd_notifyf(0, "STATUS=Failed to start up: Couldn't allocate the curl share");
+		exit(EX_OSERR);
+	}
+	atexit(http_cleanup); // the handles are cleaned up before the share
+
 	CURL* curl = curl_easy_init();
 	reg_ptr_fn(curl, curl_easy_cleanup); // register curl variable for cleanup after application
+	atexit(discovery_cleanup);
+	atexit(scheduler_cleanup);
+
+	// seed for the retry jitter
+	srandom(time(NULL) ^ getpid());
 
 	sigset_t sigset;
 	sigemptyset(&sigset);
@@ -251,25 +719,54 @@ int main() {
 	sigaddset(&sigset, SIGHUP);
 	sigaddset(&sigset, SIGUSR1);
 
-	// blocking signals in the sigset to let sigwait handle them
+	// blocking signals in the sigset to receive them from the signalfd
 	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
+	int signal_fd = signalfd(-1, &sigset, SFD_CLOEXEC);
+
+	if(signal_fd == -1) {
+		sd_notifyf(0, "STATUS=Failed to start up: Couldn't create the signalfd");
+		exit(EX_OSERR);
+	}
+	atexit(triggers_cleanup);
+
+	// started after blocking the signals so that the thread inherits the mask
+	resolver_start();
+	watch_upstream_hosts();
+
+	history_open(HISTORY_FILE_PATH);
+	atexit(history_close);
+
+	// the updates that failed or were cut by the previous stop go out before the first run
+	outbox_open(OUTBOX_FILE_PATH);
+	atexit(outbox_close);
+
+	if(outbox_pending_count() > 0) {
+		SCOPE(flush_outbox(curl))
+	}
+
 	sd_notify(0, "READY=1");
 	log_status("The dyn-dns daemon successfully started up");
 
 	int sig;
 
-	while(sigwait(&sigset, &sig) == 0 && sig != SIGTERM) {
+	while(wait_event(signal_fd, &sig, curl) && sig != SIGTERM) {
 		if(sig == SIGHUP) {
 			if(load_config_variables(ACCESS_CONFIG_FILE_PATH)) {
+				watch_upstream_hosts();
 				log_status("Configurations reloaded");
 			}
 			else {
 				log_error("Couldn't reload configurations, please check the file '" ACCESS_CONFIG_FILE_PATH "'");
 			}
 		}
-		else if(sig == SIGUSR1) {
+		else if(sig == SIGUSR1 || sig == 0) {
+			// only the external timer has a cadence to learn, the runs of the triggers are scheduled in advance
+			prewarm_run_started(sig == SIGUSR1);
+			triggers_run_started();
 			SCOPE(dyn_dns_run(curl))
+			metrics_write(METRICS_FILE_PATH);
+			providers_write_state(PROVIDERS_FILE_PATH);
 		}
 	}
 
@@ -277,6 +774,9 @@ int main() {
 
 	sd_notify(0, "STOPPING=1");
 
+	// the process only exits once all the threads are done
+	resolver_stop();
+
 	pthread_exit(EXIT_SUCCESS);
 	//exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,157 @@
+#include "history.h"
+
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lib/logger.h"
+
+#define HISTORY_FILE_SIZE (sizeof(struct history_header) + HISTORY_CAPACITY * sizeof(struct history_event))
+
+static struct history_header* header = NULL;
+static struct history_event* events = NULL;
+
+bool history_open(const char* path) {
+	history_close();
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	struct stat status;
+
+	if(fd == -1 || fstat(fd, &status) != 0) {
+		log_warning("Couldn't open the history '%s', the changes won't be recorded", path);
+
+		if(fd != -1) {
+			close(fd);
+		}
+
+		return false;
+	}
+
+	// a file of another size is started over, truncating zeroes it
+	bool fresh = (size_t) status.st_size != HISTORY_FILE_SIZE;
+
+	if(fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, HISTORY_FILE_SIZE) != 0)) {
+		log_warning("Couldn't size the history '%s', the changes won't be recorded", path);
+		close(fd);
+		return false;
+	}
+
+	void* map = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED) {
+		log_warning("Couldn't map the history '%s', the changes won't be recorded", path);
+		return false;
+	}
+
+	header = map;
+	events = (struct history_event*) (header + 1);
+
+	if(fresh || header->magic != HISTORY_MAGIC || header->capacity != HISTORY_CAPACITY) {
+		memset(map, 0, HISTORY_FILE_SIZE);
+		header->magic = HISTORY_MAGIC;
+		header->capacity = HISTORY_CAPACITY;
+	}
+
+	return true;
+}
+
+void history_close() {
+	if(header != NULL) {
+		munmap(header, HISTORY_FILE_SIZE);
+		header = NULL;
+		events = NULL;
+	}
+}
+
+void history_append(const char* record_id, const struct address* old_address, const struct address* new_address, long latency_ms, enum history_result result) {
+	if(header == NULL) {
+		return;
+	}
+
+	// the slot is claimed with a single atomic add, the page cache writes it back without any syscall
+	uint64_t number = atomic_fetch_add_explicit(&header->next, 1, memory_order_relaxed);
+	struct history_event* event = events + number % HISTORY_CAPACITY;
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	atomic_store_explicit(&event->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	event->timestamp_ms = (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	event->latency_ms = latency_ms > 0 ? (uint32_t) latency_ms : 0;
+	event->family = new_address->family == AF_INET6 ? 6 : 4;
+	event->result = result;
+	memcpy(event->old_address, old_address->bytes, sizeof(event->old_address));
+	memcpy(event->new_address, new_address->bytes, sizeof(event->new_address));
+	strncpy(event->record_id, record_id, sizeof(event->record_id) - 1);
+	event->record_id[sizeof(event->record_id) - 1] = 0;
+
+	atomic_store_explicit(&event->sequence, number + 1, memory_order_release);
+}
+
+bool history_read(const char* path, void (*callback)(const struct history_event* event, void* data), void* data) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat status;
+
+	if(fd == -1 || fstat(fd, &status) != 0 || (size_t) status.st_size != HISTORY_FILE_SIZE) {
+		if(fd != -1) {
+			close(fd);
+		}
+
+		return false;
+	}
+
+	const struct history_header* mapped = mmap(NULL, HISTORY_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(mapped == MAP_FAILED) {
+		return false;
+	}
+
+	if(mapped->magic != HISTORY_MAGIC || mapped->capacity != HISTORY_CAPACITY) {
+		munmap((void*) mapped, HISTORY_FILE_SIZE);
+		return false;
+	}
+
+	const struct history_event* ring = (const struct history_event*) (mapped + 1);
+	uint64_t next = atomic_load_explicit(&mapped->next, memory_order_acquire);
+
+	for(uint64_t number = next > HISTORY_CAPACITY ? next - HISTORY_CAPACITY : 0; number < next; ++number) {
+		const struct history_event* event = ring + number % HISTORY_CAPACITY;
+		struct history_event copy;
+
+		// seqlock style read: the copy only counts if the sequence was the same before and after it
+		uint64_t sequence = atomic_load_explicit(&event->sequence, memory_order_acquire);
+
+		if(sequence != number + 1) {
+			continue;
+		}
+
+		copy.timestamp_ms = event->timestamp_ms;
+		copy.latency_ms = event->latency_ms;
+		copy.family = event->family;
+		copy.result = event->result;
+		memcpy(copy.old_address, event->old_address, sizeof(copy.old_address));
+		memcpy(copy.new_address, event->new_address, sizeof(copy.new_address));
+		memcpy(copy.record_id, event->record_id, sizeof(copy.record_id));
+		copy.record_id[sizeof(copy.record_id) - 1] = 0;
+
+		atomic_thread_fence(memory_order_acquire);
+
+		if(atomic_load_explicit(&event->sequence, memory_order_relaxed) != sequence) {
+			continue;
+		}
+
+		atomic_init(&copy.sequence, sequence);
+		callback(&copy, data);
+	}
+
+	munmap((void*) mapped, HISTORY_FILE_SIZE);
+
+	return true;
+}
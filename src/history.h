@@ -0,0 +1,62 @@
+#ifndef HISTORY_H
+#define HISTORY_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "address.h"
+#include "records.h"
+
+#define HISTORY_FILE_PATH "/var/lib/dyn-dns/history.dat"
+#define HISTORY_CAPACITY 4096
+
+#define HISTORY_MAGIC 0x31485944u // "DYH1"
+
+enum history_result {
+	HISTORY_RESULT_FAILED = 0,
+	HISTORY_RESULT_UPDATED = 1
+};
+
+/**
+ * Change of a record address, sequence is 0 while the slot is being written and the event number (from 1) after
+ **/
+struct history_event {
+	_Atomic uint64_t sequence;
+	int64_t timestamp_ms;
+	uint32_t latency_ms;
+	uint8_t family;
+	uint8_t result;
+	uint8_t old_address[16];
+	uint8_t new_address[16];
+	char record_id[CLOUDFLARE_ID_SIZE + 1];
+};
+
+/**
+ * Layout of the file, the events follow the header, next is the number of events ever written
+ **/
+struct history_header {
+	uint32_t magic;
+	uint32_t capacity;
+	_Atomic uint64_t next;
+};
+
+/**
+ * Maps the ring buffer file, it is created (or recreated if its layout differs) with HISTORY_CAPACITY events
+ **/
+bool history_open(const char* path);
+
+void history_close();
+
+/**
+ * Appends an event to the ring buffer without locking, overwriting the oldest one once it is full
+ **/
+void history_append(const char* record_id, const struct address* old_address, const struct address* new_address, long latency_ms, enum history_result result);
+
+/**
+ * Calls the callback with the events still in the file, oldest first, skipping the ones being written
+ **/
+bool history_read(const char* path, void (*callback)(const struct history_event* event, void* data), void* data);
+
+#endif
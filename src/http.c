@@ -0,0 +1,189 @@
+#include "http.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib/logger.h"
+#include "mlib.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "prewarm.h"
+
+static CURLSH* share = NULL;
+
+// encodings accepted for the responses, curl decodes them chunk by chunk before the write callbacks
+static char accept_encoding[32] = "";
+
+bool http_init() {
+	share = curl_share_init();
+
+	if(share == NULL) {
+		return false;
+	}
+
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	// only the decoders built into libcurl can be offered
+	const curl_version_info_data* version = curl_version_info(CURLVERSION_NOW);
+	size_t length = 0;
+
+	if(version->features & CURL_VERSION_BROTLI) {
+		length += snprintf(accept_encoding + length, sizeof(accept_encoding) - length, "br");
+	}
+
+	if(version->features & CURL_VERSION_LIBZ) {
+		length += snprintf(accept_encoding + length, sizeof(accept_encoding) - length, length > 0 ? ", gzip" : "gzip");
+	}
+
+	log_debug("Compressed responses accepted: '%s'", length > 0 ? accept_encoding : "none");
+
+	return true;
+}
+
+void http_cleanup() {
+	curl_share_cleanup(share);
+	share = NULL;
+}
+
+bool url_host_port(const char* url, char* host, size_t size, long* port) {
+	CURLU* handle = curl_url();
+	char *host_part = NULL, *port_part = NULL;
+	bool found = false;
+
+	if(handle != NULL && curl_url_set(handle, CURLUPART_URL, url, CURLU_NON_SUPPORT_SCHEME) == CURLUE_OK && curl_url_get(handle, CURLUPART_HOST, &host_part, 0) == CURLUE_OK) {
+		snprintf(host, size, "%s", host_part);
+		found = true;
+		curl_free(host_part);
+
+		if(port != NULL) {
+			found = curl_url_get(handle, CURLUPART_PORT, &port_part, CURLU_DEFAULT_PORT) == CURLUE_OK;
+
+			if(found) {
+				*port = strtol(port_part, NULL, 10);
+				curl_free(port_part);
+			}
+		}
+	}
+
+	curl_url_cleanup(handle);
+
+	return found;
+}
+
+bool url_host(const char* url, char* host, size_t size) {
+	return url_host_port(url, host, size, NULL);
+}
+
+struct endpoint_latency* endpoint_latency_for_url(const char* url) {
+	char host[TIMEOUTS_HOST_MAX_LENGTH + 1];
+
+	return url_host(url, host, sizeof(host)) ? endpoint_latency_get(host) : NULL;
+}
+
+struct circuit_breaker* circuit_for_url(const char* url) {
+	char host[CIRCUIT_HOST_MAX_LENGTH + 1];
+
+	return url_host(url, host, sizeof(host)) ? circuit_get(host) : NULL;
+}
+
+// passes the addresses cached by the background resolver to curl, so that no resolution happens during the call
+static inline void setup_resolve(CURL* curl, const char* url) {
+	char host[RESOLVER_HOST_MAX_LENGTH + 1];
+	long port;
+
+	if(url_host_port(url, host, sizeof(host), &port)) {
+		struct curl_slist* resolve = resolver_curl_resolve(host, port);
+
+		if(resolve != NULL) {
+			reg_ptr_fn(resolve, (void (*)(void *)) curl_slist_free_all);
+			curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+		}
+	}
+}
+
+void setup_call(CURL* curl, const char* url, write_callback_t callback, void* userdata) {
+	struct endpoint_latency* endpoint = endpoint_latency_for_url(url);
+
+	setup_resolve(curl, url);
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, userdata);
+
+	if(accept_encoding[0] != 0) {
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, accept_encoding);
+	}
+
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, endpoint_connect_timeout_ms(endpoint));
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, endpoint_total_timeout_ms(endpoint));
+}
+
+void read_call_info(CURL* curl, struct call_info* info) {
+	double connect_time = 0, app_connect_time = 0, total_time = 0;
+	long connects = 0;
+
+	info->http_status = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &info->http_status);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect_time);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &app_connect_time);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+
+	// the tls handshake is part of the connection phase, plain http calls only have the tcp one
+	info->connect_ms = connects > 0 ? (app_connect_time > 0 ? app_connect_time : connect_time) * 1000 : -1;
+	info->elapsed_ms = total_time * 1000;
+}
+
+CURLcode perform_call(CURL* curl, const char* url, write_callback_t callback, void* userdata, struct call_info* info) {
+	setup_call(curl, url, callback, userdata);
+
+	log_debug("Performing call to '%s'", url);
+	CURLcode result = curl_easy_perform(curl);
+
+	read_call_info(curl, info);
+	curl_easy_reset(curl);
+
+	return result;
+}
+
+void record_call_latency(const char* url, const struct call_info* info) {
+	char host[TIMEOUTS_HOST_MAX_LENGTH + 1];
+
+	if(url_host(url, host, sizeof(host))) {
+		endpoint_latency_record(endpoint_latency_get(host), info->connect_ms, info->elapsed_ms);
+		prewarm_account(host, info->connect_ms < 0);
+	}
+}
+
+bool call_retryable(CURLcode result, const struct call_info* info) {
+	if(result == CURLE_OPERATION_TIMEDOUT) {
+		metrics_inc(METRIC_CALL_TIMEOUTS);
+	}
+
+	return result != CURLE_OK || info->http_status == 429 || info->http_status >= 500;
+}
+
+bool report_call_failure(struct circuit_breaker* circuit, CURLcode result, const struct call_info* info) {
+	// throttling is paced by the scheduler, the host is answering and still worth another attempt
+	if(result == CURLE_OK && info->http_status == 429) {
+		circuit_success(circuit);
+		return true;
+	}
+
+	if(!call_retryable(result, info)) {
+		circuit_success(circuit);
+		return false;
+	}
+
+	circuit_failure(circuit);
+
+	return circuit == NULL || circuit->state != CIRCUIT_OPEN;
+}
+
+size_t discard_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata) {
+	(void) buffer;
+	(void) userdata;
+	return itemSize * itemCount;
+}
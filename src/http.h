@@ -0,0 +1,78 @@
+#ifndef HTTP_H
+#define HTTP_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <curl/curl.h>
+
+#include "circuit.h"
+#include "timeouts.h"
+
+typedef size_t (*write_callback_t)(char*, size_t, size_t, void*);
+
+// informations about a completed call, read before the handle gets reset
+struct call_info {
+	long http_status;
+	double connect_ms; // negative if an existing connection was reused
+	double elapsed_ms;
+};
+
+/**
+ * Creates the connection cache shared by all the handles, so that connections opened by a handle can be reused by the others,
+ * and picks the compressed encodings (brotli, gzip) the calls accept
+ **/
+bool http_init();
+
+void http_cleanup();
+
+/**
+ * Host and port (NULL if not needed) of the url, false if it can't be parsed.
+ * Urls of schemes unknown to curl (like the udp discovery ones) only have a port if it is explicit.
+ **/
+bool url_host_port(const char* url, char* host, size_t size, long* port);
+
+bool url_host(const char* url, char* host, size_t size);
+
+struct endpoint_latency* endpoint_latency_for_url(const char* url);
+
+/**
+ * Breaker of the host targeted by the url, NULL if it can't be determined (calls are then always allowed)
+ **/
+struct circuit_breaker* circuit_for_url(const char* url);
+
+/**
+ * Sets the options shared by all the calls: url, write callback, cached addresses, shared connections, compression and
+ * adaptive timeouts. Compressed bodies reach the callback already decoded, in chunks.
+ **/
+void setup_call(CURL* curl, const char* url, write_callback_t callback, void* userdata);
+
+void read_call_info(CURL* curl, struct call_info* info);
+
+/**
+ * Blocking call on the handle, that gets reset afterwards
+ **/
+CURLcode perform_call(CURL* curl, const char* url, write_callback_t callback, void* userdata, struct call_info* info);
+
+/**
+ * Feeds the adaptive timeouts of the host with a successful call
+ **/
+void record_call_latency(const char* url, const struct call_info* info);
+
+/**
+ * Transport errors, throttling and server errors are worth another attempt, other client errors are not
+ **/
+bool call_retryable(CURLcode result, const struct call_info* info);
+
+/**
+ * Reports the outcome of a failed call to the breaker. A throttled (429) or non retryable failure means that the host is answering.
+ * Returns true if another attempt can be made.
+ **/
+bool report_call_failure(struct circuit_breaker* circuit, CURLcode result, const struct call_info* info);
+
+/**
+ * Empty callback for calls whose body is not needed
+ **/
+size_t discard_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata);
+
+#endif
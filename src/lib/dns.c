@@ -0,0 +1,301 @@
+#include <string.h>
+
+#include "dns.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+
+static inline void write_u16(uint8_t* buffer, uint16_t value) {
+	buffer[0] = value >> 8;
+	buffer[1] = value & 0xff;
+}
+
+static inline uint16_t read_u16(const uint8_t* buffer) {
+	return (uint16_t) (buffer[0] << 8 | buffer[1]);
+}
+
+static inline uint32_t read_u32(const uint8_t* buffer) {
+	return (uint32_t) buffer[0] << 24 | (uint32_t) buffer[1] << 16 | (uint32_t) buffer[2] << 8 | buffer[3];
+}
+
+size_t dns_build_query(uint8_t* buffer, size_t size, uint16_t id, const char* name, uint16_t type, bool recursion_desired) {
+	size_t name_length = strlen(name);
+
+	// header + labels (one length byte more than the dotted name) + root label + type + class
+	if(name_length > DNS_MAX_NAME_LENGTH || DNS_HEADER_SIZE + name_length + 2 + 4 > size) {
+		return 0;
+	}
+
+	memset(buffer, 0, DNS_HEADER_SIZE);
+	write_u16(buffer, id);
+	write_u16(buffer + 2, recursion_desired ? DNS_FLAG_RD : 0);
+	write_u16(buffer + 4, 1); // one question
+
+	size_t position = DNS_HEADER_SIZE;
+	const char* label = name;
+
+	while(*label != 0) {
+		const char* end = strchr(label, '.');
+		size_t label_length = end != NULL ? (size_t) (end - label) : strlen(label);
+
+		if(label_length == 0 || label_length > 63) {
+			return 0;
+		}
+
+		buffer[position++] = label_length;
+		memcpy(buffer + position, label, label_length);
+		position += label_length;
+
+		label += label_length;
+		if(*label == '.') {
+			++label;
+		}
+	}
+
+	buffer[position++] = 0;
+	write_u16(buffer + position, type);
+	write_u16(buffer + position + 2, DNS_CLASS_IN);
+
+	return position + 4;
+}
+
+// position right after the (possibly compressed) name starting at position, 0 if malformed
+static size_t skip_name(const uint8_t* message, size_t length, size_t position) {
+	while(position < length) {
+		uint8_t label_length = message[position];
+
+		if(label_length == 0) {
+			return position + 1;
+		}
+
+		// a compression pointer ends the name
+		if((label_length & 0xc0) == 0xc0) {
+			return position + 2 <= length ? position + 2 : 0;
+		}
+
+		position += label_length + 1;
+	}
+
+	return 0;
+}
+
+int dns_parse_response(const uint8_t* message, size_t length, uint16_t id, uint16_t type, struct dns_answer* answers, size_t max_answers, int* rcode) {
+	if(length < DNS_HEADER_SIZE || read_u16(message) != id) {
+		return -1;
+	}
+
+	uint16_t flags = read_u16(message + 2),
+		questions = read_u16(message + 4),
+		answers_count = read_u16(message + 6);
+
+	if(!(flags & DNS_FLAG_QR) || (flags & DNS_FLAG_TC)) {
+		return -1;
+	}
+
+	*rcode = flags & 0x000f;
+
+	size_t position = DNS_HEADER_SIZE;
+
+	for(uint16_t i = 0; i < questions; ++i) {
+		position = skip_name(message, length, position);
+
+		if(position == 0 || position + 4 > length) {
+			return -1;
+		}
+
+		position += 4;
+	}
+
+	int found = 0;
+
+	for(uint16_t i = 0; i < answers_count && (size_t) found < max_answers; ++i) {
+		position = skip_name(message, length, position);
+
+		if(position == 0 || position + 10 > length) {
+			return -1;
+		}
+
+		uint16_t record_type = read_u16(message + position),
+			record_class = read_u16(message + position + 2),
+			record_length = read_u16(message + position + 8);
+		uint32_t ttl = read_u32(message + position + 4);
+
+		position += 10;
+
+		if(position + record_length > length) {
+			return -1;
+		}
+
+		if(record_class == DNS_CLASS_IN && (type == 0 || record_type == type) && record_length <= DNS_MAX_RDATA_LENGTH) {
+			answers[found].type = record_type;
+			answers[found].ttl = ttl;
+			answers[found].length = record_length;
+			answers[found].offset = position;
+			memcpy(answers[found].data, message + position, record_length);
+			++found;
+		}
+
+		position += record_length;
+	}
+
+	return found;
+}
+
+bool dns_read_name(const uint8_t* message, size_t length, size_t position, char* name, size_t size) {
+	size_t written = 0, jumps = 0;
+
+	while(position < length) {
+		uint8_t label_length = message[position];
+
+		if(label_length == 0) {
+			if(written == 0 && size > 0) {
+				name[written++] = '.';
+			}
+			else if(written > 0) {
+				--written; // trailing dot
+			}
+
+			if(written >= size) {
+				return false;
+			}
+
+			name[written] = 0;
+			return true;
+		}
+
+		// compression pointer, bounded so that pointer loops end
+		if((label_length & 0xc0) == 0xc0) {
+			if(position + 2 > length || ++jumps > 64) {
+				return false;
+			}
+
+			position = (label_length & 0x3f) << 8 | message[position + 1];
+			continue;
+		}
+
+		if(label_length > 63 || position + 1 + label_length > length || written + label_length + 1 >= size) {
+			return false;
+		}
+
+		memcpy(name + written, message + position + 1, label_length);
+		written += label_length;
+		name[written++] = '.';
+		position += label_length + 1;
+	}
+
+	return false;
+}
+
+#ifdef DNS_TEST
+
+// cc -DDNS_TEST dns.c && ./a.out
+
+#include <assert.h>
+#include <stdio.h>
+
+static inline void write_u32(uint8_t* buffer, uint32_t value) {
+	write_u16(buffer, value >> 16);
+	write_u16(buffer + 2, value & 0xffff);
+}
+
+// appends a resource record whose owner name is already encoded in name
+static size_t add_record(uint8_t* message, size_t length, const char* name, size_t name_length, uint16_t type, uint32_t ttl,
+		const char* data, size_t data_length) {
+	memcpy(message + length, name, name_length);
+	length += name_length;
+	write_u16(message + length, type);
+	write_u16(message + length + 2, DNS_CLASS_IN);
+	write_u32(message + length + 4, ttl);
+	write_u16(message + length + 8, data_length);
+	memcpy(message + length + 10, data, data_length);
+	write_u16(message + 6, read_u16(message + 6) + 1);
+
+	return length + 10 + data_length;
+}
+
+int main() {
+	uint8_t message[DNS_MAX_MESSAGE_SIZE];
+	struct dns_answer answers[4];
+	char name[DNS_MAX_NAME_LENGTH + 1], long_name[DNS_MAX_NAME_LENGTH + 2];
+	int rcode;
+
+	// queries
+	size_t length = dns_build_query(message, sizeof(message), 0x1234, "www.example.org", DNS_TYPE_A, true);
+	assert(length == DNS_HEADER_SIZE + 17 + 4);
+	assert(read_u16(message) == 0x1234 && read_u16(message + 2) == DNS_FLAG_RD && read_u16(message + 4) == 1);
+	assert(memcmp(message + DNS_HEADER_SIZE, "\3www\7example\3org\0", 17) == 0);
+	assert(read_u16(message + length - 4) == DNS_TYPE_A && read_u16(message + length - 2) == DNS_CLASS_IN);
+	assert(dns_read_name(message, length, DNS_HEADER_SIZE, name, sizeof(name)) && strcmp(name, "www.example.org") == 0);
+
+	assert(dns_build_query(message, length - 1, 1, "www.example.org", DNS_TYPE_A, true) == 0);
+	assert(dns_build_query(message, sizeof(message), 1, "www..org", DNS_TYPE_A, true) == 0);
+	memset(long_name, 'a', 64);
+	strcpy(long_name + 64, ".org");
+	assert(dns_build_query(message, sizeof(message), 1, long_name, DNS_TYPE_A, true) == 0);
+	memset(long_name, 'a', sizeof(long_name) - 1);
+	long_name[sizeof(long_name) - 1] = 0;
+	assert(dns_build_query(message, sizeof(message), 1, long_name, DNS_TYPE_A, true) == 0);
+
+	// the answer to the query: www.example.org CNAME host.example.org, host.example.org A, AAAA and TXT, all compressed
+	length = dns_build_query(message, sizeof(message), 0x1234, "www.example.org", DNS_TYPE_A, true);
+	write_u16(message + 2, DNS_FLAG_QR | DNS_FLAG_RD | 0x0080);
+	size_t cname = length + 2 + 10; // data of the first record
+	length = add_record(message, length, "\xc0\x0c", 2, DNS_TYPE_CNAME, 300, "\4host\xc0\x10", 7);
+	char pointer[2] = { 0xc0, cname };
+	length = add_record(message, length, pointer, 2, DNS_TYPE_A, 60, "\xcb\x00\x71\x05", 4);
+	length = add_record(message, length, pointer, 2, DNS_TYPE_AAAA, 120, "\x20\x01\x0d\xb8\0\0\0\0\0\0\0\0\0\0\0\x42", 16);
+	length = add_record(message, length, pointer, 2, DNS_TYPE_TXT, 30, "\5hello", 6);
+
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_A, answers, 4, &rcode) == 1 && rcode == DNS_RCODE_NOERROR);
+	assert(answers[0].type == DNS_TYPE_A && answers[0].ttl == 60 && answers[0].length == 4);
+	assert(memcmp(answers[0].data, "\xcb\x00\x71\x05", 4) == 0);
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_AAAA, answers, 4, &rcode) == 1 && answers[0].ttl == 120);
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_NS, answers, 4, &rcode) == 0);
+	assert(dns_parse_response(message, length, 0x1234, 0, answers, 2, &rcode) == 2);
+	assert(dns_parse_response(message, length, 0x1234, 0, answers, 4, &rcode) == 4);
+	assert(answers[0].type == DNS_TYPE_CNAME && answers[0].offset == cname && answers[3].type == DNS_TYPE_TXT);
+
+	// names behind pointers, including a pointer to a pointer
+	assert(dns_read_name(message, length, answers[0].offset, name, sizeof(name)) && strcmp(name, "host.example.org") == 0);
+	assert(dns_read_name(message, length, cname - 12, name, sizeof(name)) && strcmp(name, "www.example.org") == 0);
+	assert(dns_read_name(message, length, cname + 7, name, sizeof(name)) && strcmp(name, "host.example.org") == 0);
+	assert(!dns_read_name(message, length, answers[0].offset, name, 16)); // no room for the terminator
+	assert(dns_read_name((const uint8_t*) "\0", 1, 0, name, sizeof(name)) && strcmp(name, ".") == 0);
+
+	// malformed names: pointer loops, pointers and labels past the end
+	assert(!dns_read_name((const uint8_t*) "\xc0\x00", 2, 0, name, sizeof(name)));
+	assert(!dns_read_name((const uint8_t*) "\1a\xc0\x00", 4, 2, name, sizeof(name)));
+	assert(!dns_read_name((const uint8_t*) "\1a\xc0\x10", 4, 0, name, sizeof(name)));
+	assert(!dns_read_name((const uint8_t*) "\1a\xc0", 3, 0, name, sizeof(name)));
+	assert(!dns_read_name((const uint8_t*) "\5ab", 3, 0, name, sizeof(name)));
+	assert(!dns_read_name((const uint8_t*) "\1a", 2, 0, name, sizeof(name)));
+
+	// not an answer to the query, or cut short
+	assert(dns_parse_response(message, length, 0x4321, DNS_TYPE_A, answers, 4, &rcode) == -1);
+	assert(dns_parse_response(message, DNS_HEADER_SIZE - 1, 0x1234, DNS_TYPE_A, answers, 4, &rcode) == -1);
+	for(size_t cut = DNS_HEADER_SIZE; cut < length; ++cut) {
+		assert(dns_parse_response(message, cut, 0x1234, 0, answers, 4, &rcode) == -1);
+	}
+	write_u16(message + 2, DNS_FLAG_QR | DNS_FLAG_TC);
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_A, answers, 4, &rcode) == -1);
+	write_u16(message + 2, DNS_FLAG_RD);
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_A, answers, 4, &rcode) == -1);
+
+	// record data longer than the message
+	write_u16(message + 2, DNS_FLAG_QR);
+	write_u16(message + cname - 2, 0x0100);
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_A, answers, 4, &rcode) == -1);
+
+	// no such name
+	length = dns_build_query(message, sizeof(message), 0x1234, "nowhere.example.org", DNS_TYPE_A, true);
+	write_u16(message + 2, DNS_FLAG_QR | DNS_RCODE_NXDOMAIN);
+	assert(dns_parse_response(message, length, 0x1234, DNS_TYPE_A, answers, 4, &rcode) == 0 && rcode == DNS_RCODE_NXDOMAIN);
+
+	printf("PASSED\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal dns message encoder and decoder (rfc 1035), enough for single question queries
+ */
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_NS 2
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_TXT 16
+#define DNS_TYPE_AAAA 28
+
+#define DNS_CLASS_IN 1
+
+#define DNS_MAX_MESSAGE_SIZE 512
+#define DNS_MAX_NAME_LENGTH 255
+#define DNS_MAX_RDATA_LENGTH 255
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+struct dns_answer {
+	uint16_t type;
+	uint32_t ttl;
+	size_t length;
+	size_t offset; // position of data in the message, to read the names it contains
+	uint8_t data[DNS_MAX_RDATA_LENGTH];
+};
+
+/*
+ * Writes a recursive query for name and type in buffer
+ * Returns the message length or 0 if the name doesn't fit
+ */
+size_t dns_build_query(uint8_t* buffer, size_t size, uint16_t id, const char* name, uint16_t type, bool recursion_desired);
+
+/*
+ * Reads the answers of type (any type if 0) from a response to the query with the passed id
+ * Returns the number of answers written, or -1 if the message is not a valid response to the query
+ * The response code is written in rcode
+ */
+int dns_parse_response(const uint8_t* message, size_t length, uint16_t id, uint16_t type, struct dns_answer* answers, size_t max_answers, int* rcode);
+
+/*
+ * Writes the dotted form of the (possibly compressed) name starting at position in the message
+ * Returns false if the name is malformed or doesn't fit in size
+ */
+bool dns_read_name(const uint8_t* message, size_t length, size_t position, char* name, size_t size);
+
+#endif
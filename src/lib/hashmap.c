@@ -51,7 +51,20 @@ struct bucket {
     uint64_t dib:16;
 };
 
-// hashmap is an open addressed hash map using robinhood hashing.
+// table is the bucket array left by an incremental resize, its items move to
+// the current one a few buckets per operation.
+struct table {
+    void *buckets;  // NULL when no resize is in progress
+    size_t nbuckets;
+    size_t start;   // first bucket to move, a free one
+#ifdef HASHMAP_SWISS
+    size_t deleted;
+#endif
+};
+
+// hashmap is an open addressed hash map using robinhood hashing, or with
+// HASHMAP_SWISS defined a swiss table: a separate array of control bytes
+// holding 7 bits of the hash of every bucket, probed 16 buckets at a time.
 struct hashmap {
     void *(*malloc)(size_t);
     void *(*realloc)(void *, size_t);
@@ -73,8 +86,173 @@ struct hashmap {
     void *buckets;
     void *spare;
     void *edata;
+#ifdef HASHMAP_SWISS
+    int8_t *ctrl;   // at the start of buckets, the items follow
+    size_t deleted; // tombstones, they count toward growat
+#endif
+    size_t step;    // buckets moved per operation, 0 resizes at once
+    size_t migrated;
+    struct table old;
 };
 
+static uint64_t get_hash(struct hashmap *map, void *key) {
+    return map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+}
+
+#ifdef HASHMAP_SWISS
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A full bucket has the low 7 bits of its hash as control byte, the free ones
+// have the high bit set. Groups are aligned so that a lookup stops at the first
+// group with an empty bucket.
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define GROUP_WIDTH 16
+
+static size_t ctrl_h1(uint64_t hash) {
+    return hash >> 7;
+}
+
+static int8_t ctrl_h2(uint64_t hash) {
+    return hash & 0x7f;
+}
+
+// group_match returns a bit per control byte of the group equal to value.
+static uint32_t group_match(const int8_t *group, int8_t value) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] == value) << i;
+    }
+    return mask;
+#endif
+}
+
+// group_match_free returns a bit per empty or deleted bucket of the group.
+static uint32_t group_match_free(const int8_t *group) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] < 0) << i;
+    }
+    return mask;
+#endif
+}
+
+static bool full_in(struct hashmap *map, void *buckets, size_t nbuckets,
+                    size_t index)
+{
+    (void)map; (void)nbuckets;
+    return ((int8_t*)buckets)[index] >= 0;
+}
+
+static void *item_in(struct hashmap *map, void *buckets, size_t nbuckets,
+                     size_t index)
+{
+    return (char*)buckets+nbuckets+map->bucketsz*index;
+}
+
+static void *slot_at(struct hashmap *map, size_t index) {
+    return item_in(map, map->buckets, map->nbuckets, index);
+}
+
+// the control bytes come first, nbuckets is a multiple of GROUP_WIDTH so the
+// items stay aligned
+static size_t buckets_size(struct hashmap *map, size_t nbuckets) {
+    return (1+map->bucketsz)*nbuckets;
+}
+
+static void reset_buckets(struct hashmap *map) {
+    map->ctrl = map->buckets;
+    memset(map->ctrl, CTRL_EMPTY, map->nbuckets);
+    map->deleted = 0;
+}
+
+// find_bucket returns the index of the bucket holding the key, or SIZE_MAX.
+// The groups are visited in triangular order, which covers all of them since
+// their number is a power of two.
+static size_t find_bucket(struct hashmap *map, void *key, uint64_t hash) {
+    int8_t h2 = ctrl_h2(hash);
+    size_t gmask = map->nbuckets/GROUP_WIDTH-1;
+    size_t g = ctrl_h1(hash) & gmask;
+    for (size_t step = 1; ; step++) {
+        const int8_t *group = map->ctrl+g*GROUP_WIDTH;
+        // the items load while the control bytes are matched
+        __builtin_prefetch(slot_at(map, g*GROUP_WIDTH));
+        for (uint32_t m = group_match(group, h2); m; m &= m-1) {
+            size_t i = g*GROUP_WIDTH+__builtin_ctz(m);
+            if (map->compare(key, slot_at(map, i), map->udata) == 0) {
+                return i;
+            }
+        }
+        if (group_match(group, CTRL_EMPTY)) {
+            return SIZE_MAX;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+// insert_item places an item missing from the table in the first free bucket
+// of its probe sequence, deleted ones are reused.
+static void insert_item(struct hashmap *map, void *item, uint64_t hash) {
+    size_t gmask = map->nbuckets/GROUP_WIDTH-1;
+    size_t g = ctrl_h1(hash) & gmask;
+    size_t i;
+    for (size_t step = 1; ; step++) {
+        uint32_t avail = group_match_free(map->ctrl+g*GROUP_WIDTH);
+        if (avail) {
+            i = g*GROUP_WIDTH+__builtin_ctz(avail);
+            break;
+        }
+        g = (g + step) & gmask;
+    }
+    if (map->ctrl[i] == CTRL_DELETED) {
+        map->deleted--;
+    }
+    map->ctrl[i] = ctrl_h2(hash);
+    memcpy(slot_at(map, i), item, map->elsize);
+}
+
+static void remove_at(struct hashmap *map, size_t index) {
+    // lookups already stop at a group with an empty bucket, only the full
+    // groups need a tombstone to keep probing past it
+    if (group_match(map->ctrl+(index & ~(size_t)(GROUP_WIDTH-1)), CTRL_EMPTY)) {
+        map->ctrl[index] = CTRL_EMPTY;
+    } else {
+        map->ctrl[index] = CTRL_DELETED;
+        map->deleted++;
+    }
+}
+
+// migrate_buckets moves the items of n buckets of the old table, leaving
+// tombstones so that its lookups keep probing past them.
+static void migrate_buckets(struct hashmap *map, size_t n) {
+    int8_t *ctrl = map->old.buckets;
+    for (size_t moved = 0; map->migrated < map->old.nbuckets; moved++) {
+        if (moved == n) {
+            return;
+        }
+        size_t i = map->migrated++;
+        if (ctrl[i] >= 0) {
+            void *item = item_in(map, map->old.buckets, map->old.nbuckets, i);
+            insert_item(map, item, get_hash(map, item));
+            ctrl[i] = CTRL_DELETED;
+        }
+    }
+    map->free(map->old.buckets);
+    map->old.buckets = NULL;
+}
+
+#else
+
 static struct bucket *bucket_at(struct hashmap *map, size_t index) {
     return (struct bucket*)(((char*)map->buckets)+(map->bucketsz*index));
 }
@@ -83,8 +261,185 @@ static void *bucket_item(struct bucket *entry) {
     return ((char*)entry)+sizeof(struct bucket);
 }
 
-static uint64_t get_hash(struct hashmap *map, void *key) {
-    return map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+static bool full_in(struct hashmap *map, void *buckets, size_t nbuckets,
+                    size_t index)
+{
+    (void)nbuckets;
+    return ((struct bucket*)((char*)buckets+map->bucketsz*index))->dib != 0;
+}
+
+static void *item_in(struct hashmap *map, void *buckets, size_t nbuckets,
+                     size_t index)
+{
+    (void)nbuckets;
+    return (char*)buckets+map->bucketsz*index+sizeof(struct bucket);
+}
+
+static size_t buckets_size(struct hashmap *map, size_t nbuckets) {
+    return map->bucketsz*nbuckets;
+}
+
+static void reset_buckets(struct hashmap *map) {
+    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+}
+
+// find_bucket returns the index of the bucket holding the key, or SIZE_MAX.
+static size_t find_bucket(struct hashmap *map, void *key, uint64_t hash) {
+    size_t i = hash & map->mask;
+    for (;;) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (!bucket->dib) {
+            return SIZE_MAX;
+        }
+        if (bucket->hash == hash &&
+            map->compare(key, bucket_item(bucket), map->udata) == 0)
+        {
+            return i;
+        }
+        i = (i + 1) & map->mask;
+    }
+}
+
+// insert_bucket places the bucket of an item missing from the table, entry is
+// overwritten. It swaps through edata, the item returned in spare is kept.
+static void insert_bucket(struct hashmap *map, struct bucket *entry) {
+    entry->dib = 1;
+    size_t i = entry->hash & map->mask;
+    for (;;) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, map->bucketsz);
+            return;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(map->edata, bucket, map->bucketsz);
+            memcpy(bucket, entry, map->bucketsz);
+            memcpy(entry, map->edata, map->bucketsz);
+        }
+        i = (i + 1) & map->mask;
+        entry->dib += 1;
+    }
+}
+
+static void remove_at(struct hashmap *map, size_t index) {
+    struct bucket *bucket = bucket_at(map, index);
+    bucket->dib = 0;
+    for (;;) {
+        struct bucket *prev = bucket;
+        index = (index + 1) & map->mask;
+        bucket = bucket_at(map, index);
+        if (bucket->dib <= 1) {
+            prev->dib = 0;
+            break;
+        }
+        memcpy(prev, bucket, map->bucketsz);
+        prev->dib--;
+    }
+}
+
+// migrate_buckets moves the items of at least n buckets of the old table. It
+// only stops between two clusters: a lookup in the old table then reaches an
+// emptied bucket exactly when the whole cluster of the key was moved.
+static void migrate_buckets(struct hashmap *map, size_t n) {
+    size_t mask = map->old.nbuckets-1;
+    for (size_t moved = 0; map->migrated < map->old.nbuckets; moved++) {
+        size_t i = (map->old.start + map->migrated) & mask;
+        struct bucket *entry = (struct bucket*)((char*)map->old.buckets+
+                                                map->bucketsz*i);
+        if (!entry->dib && moved >= n) {
+            return;
+        }
+        if (entry->dib) {
+            insert_bucket(map, entry);
+            entry->dib = 0;
+        }
+        map->migrated++;
+    }
+    map->free(map->old.buckets);
+    map->old.buckets = NULL;
+}
+
+#endif
+
+static void *item_at(struct hashmap *map, size_t index) {
+    return item_in(map, map->buckets, map->nbuckets, index);
+}
+
+// swap_tables exchanges the current table with the old one, so that the
+// lookups and removals work on the old table too.
+static void swap_tables(struct hashmap *map) {
+    void *buckets = map->buckets;
+    size_t nbuckets = map->nbuckets;
+    map->buckets = map->old.buckets;
+    map->nbuckets = map->old.nbuckets;
+    map->mask = map->nbuckets-1;
+    map->old.buckets = buckets;
+    map->old.nbuckets = nbuckets;
+#ifdef HASHMAP_SWISS
+    size_t deleted = map->deleted;
+    map->deleted = map->old.deleted;
+    map->old.deleted = deleted;
+    map->ctrl = map->buckets;
+#endif
+}
+
+// find_old returns the index of the key in the old table, or SIZE_MAX.
+static size_t find_old(struct hashmap *map, void *key, uint64_t hash) {
+    if (!map->old.buckets) {
+        return SIZE_MAX;
+    }
+    swap_tables(map);
+    size_t i = find_bucket(map, key, hash);
+    swap_tables(map);
+    return i;
+}
+
+// take_old removes the item at index from the old table, it is returned in
+// the spare bucket.
+static void *take_old(struct hashmap *map, size_t index) {
+    swap_tables(map);
+    memcpy(map->spare, item_at(map, index), map->elsize);
+    remove_at(map, index);
+    swap_tables(map);
+    return map->spare;
+}
+
+static void migrate(struct hashmap *map) {
+    if (map->old.buckets) {
+        migrate_buckets(map, map->step);
+    }
+}
+
+// resize moves the items to a table of new_cap buckets, at once or over the
+// next operations in incremental mode.
+static bool resize(struct hashmap *map, size_t new_cap) {
+    if (map->old.buckets) {
+        migrate_buckets(map, SIZE_MAX);
+    }
+    void *buckets = map->malloc(buckets_size(map, new_cap));
+    if (!buckets) {
+        return false;
+    }
+    map->old.buckets = map->buckets;
+    map->old.nbuckets = map->nbuckets;
+    map->old.start = 0;
+#ifdef HASHMAP_SWISS
+    map->old.deleted = map->deleted;
+#else
+    // the migration starts after a free bucket so that no cluster is split
+    while (full_in(map, map->old.buckets, map->old.nbuckets, map->old.start)) {
+        map->old.start++;
+    }
+#endif
+    map->migrated = 0;
+    map->buckets = buckets;
+    map->nbuckets = new_cap;
+    map->mask = new_cap-1;
+    map->growat = new_cap*0.75;
+    map->shrinkat = new_cap*0.10;
+    reset_buckets(map);
+    migrate_buckets(map, map->step ? map->step : SIZE_MAX);
+    return true;
 }
 
 // hashmap_new_with_allocator returns a new hash map using a custom allocator.
@@ -104,7 +459,7 @@ struct hashmap *hashmap_new_with_allocator(
     _malloc = _malloc ? _malloc : malloc;
     _realloc = _realloc ? _realloc : realloc;
     _free = _free ? _free : free;
-    int ncap = 16;
+    size_t ncap = 16;
     if (cap < ncap) {
         cap = ncap;
     } else {
@@ -113,7 +468,11 @@ struct hashmap *hashmap_new_with_allocator(
         }
         cap = ncap;
     }
+#ifdef HASHMAP_SWISS
+    size_t bucketsz = elsize;
+#else
     size_t bucketsz = sizeof(struct bucket) + elsize;
+#endif
     while (bucketsz & (sizeof(uintptr_t)-1)) {
         bucketsz++;
     }
@@ -136,12 +495,12 @@ struct hashmap *hashmap_new_with_allocator(
     map->cap = cap;
     map->nbuckets = cap;
     map->mask = map->nbuckets-1;
-    map->buckets = _malloc(map->bucketsz*map->nbuckets);
+    map->buckets = _malloc(buckets_size(map, map->nbuckets));
     if (!map->buckets) {
         _free(map);
         return NULL;
     }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    reset_buckets(map);
     map->growat = map->nbuckets*0.75;
     map->shrinkat = map->nbuckets*0.10;
     map->malloc = _malloc;
@@ -188,62 +547,68 @@ struct hashmap *hashmap_new(size_t elsize, size_t cap,
 // that this operation does not perform any allocations.
 void hashmap_clear(struct hashmap *map, bool update_cap) {
     map->count = 0;
+    if (map->old.buckets) {
+        map->free(map->old.buckets);
+        map->old.buckets = NULL;
+    }
     if (update_cap) {
         map->cap = map->nbuckets;
     } else if (map->nbuckets != map->cap) {
-        void *new_buckets = map->malloc(map->bucketsz*map->cap);
+        void *new_buckets = map->malloc(buckets_size(map, map->cap));
         if (new_buckets) {
             map->free(map->buckets);
             map->buckets = new_buckets;
+            map->nbuckets = map->cap;
         }
-        map->nbuckets = map->cap;
     }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    reset_buckets(map);
     map->mask = map->nbuckets-1;
     map->growat = map->nbuckets*0.75;
     map->shrinkat = map->nbuckets*0.10;
 }
 
 
-static bool resize(struct hashmap *map, size_t new_cap) {
-    struct hashmap *map2 = hashmap_new(map->elsize, new_cap, map->seed1, 
-                                       map->seed1, map->hash, map->compare,
-                                       map->udata);
-    if (!map2) {
-        return false;
+#ifdef HASHMAP_SWISS
+
+// hashmap_set inserts or replaces an item in the hash map. If an item is
+// replaced then it is returned otherwise NULL is returned. This operation
+// may allocate memory. If the system is unable to allocate additional
+// memory then NULL is returned and hashmap_oom() returns true.
+void *hashmap_set(struct hashmap *map, void *item) {
+    if (!item) {
+        panic("item is null");
     }
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        struct bucket *entry = bucket_at(map, i);
-        if (!entry->dib) {
-            continue;
-        }
-        entry->dib = 1;
-        size_t j = entry->hash & map2->mask;
-        for (;;) {
-            struct bucket *bucket = bucket_at(map2, j);
-            if (bucket->dib == 0) {
-                memcpy(bucket, entry, map->bucketsz);
-                break;
-            }
-            if (bucket->dib < entry->dib) {
-                memcpy(map2->spare, bucket, map->bucketsz);
-                memcpy(bucket, entry, map->bucketsz);
-                memcpy(entry, map2->spare, map->bucketsz);
-            }
-            j = (j + 1) & map2->mask;
-            entry->dib += 1;
+    map->oom = false;
+    if (map->count+map->deleted >= map->growat) {
+        // mostly tombstones, a rehash at the same size drops them
+        size_t new_cap = map->count >= map->growat/2 ? map->nbuckets*2 :
+                                                       map->nbuckets;
+        if (!resize(map, new_cap)) {
+            map->oom = true;
+            return NULL;
         }
-	}
-    map->free(map->buckets);
-    map->buckets = map2->buckets;
-    map->nbuckets = map2->nbuckets;
-    map->mask = map2->mask;
-    map->growat = map2->growat;
-    map->shrinkat = map2->shrinkat;
-    map->free(map2);
-    return true;
+    }
+    migrate(map);
+
+    uint64_t hash = get_hash(map, item);
+    size_t i = find_bucket(map, item, hash);
+    if (i != SIZE_MAX) {
+        memcpy(map->spare, slot_at(map, i), map->elsize);
+        memcpy(slot_at(map, i), item, map->elsize);
+        return map->spare;
+    }
+    insert_item(map, item, hash);
+    map->count++;
+    i = find_old(map, item, hash);
+    if (i != SIZE_MAX) {
+        map->count--;
+        return take_old(map, i);
+    }
+    return NULL;
 }
 
+#else
+
 // hashmap_set inserts or replaces an item in the hash map. If an item is
 // replaced then it is returned otherwise NULL is returned. This operation
 // may allocate memory. If the system is unable to allocate additional
@@ -253,29 +618,34 @@ void *hashmap_set(struct hashmap *map, void *item) {
         panic("item is null");
     }
     map->oom = false;
-    if (map->count == map->growat) {
+    if (map->count >= map->growat) {
         if (!resize(map, map->nbuckets*2)) {
             map->oom = true;
             return NULL;
         }
     }
+    migrate(map);
 
-    
     struct bucket *entry = map->edata;
     entry->hash = get_hash(map, item);
     entry->dib = 1;
     memcpy(bucket_item(entry), item, map->elsize);
-    
+    // an item not moved yet is replaced in the current table
+    size_t moved = find_old(map, item, entry->hash);
+
     size_t i = entry->hash & map->mask;
 	for (;;) {
         struct bucket *bucket = bucket_at(map, i);
         if (bucket->dib == 0) {
             memcpy(bucket, entry, map->bucketsz);
+            if (moved != SIZE_MAX) {
+                return take_old(map, moved);
+            }
             map->count++;
 			return NULL;
 		}
-        if (entry->hash == bucket->hash && 
-            map->compare(bucket_item(entry), bucket_item(bucket), 
+        if (entry->hash == bucket->hash &&
+            map->compare(bucket_item(entry), bucket_item(bucket),
                          map->udata) == 0)
         {
             memcpy(map->spare, bucket_item(bucket), map->elsize);
@@ -292,38 +662,36 @@ void *hashmap_set(struct hashmap *map, void *item) {
 	}
 }
 
+#endif
+
 // hashmap_get returns the item based on the provided key. If the item is not
 // found then NULL is returned.
 void *hashmap_get(struct hashmap *map, void *key) {
     if (!key) {
         panic("key is null");
     }
+    migrate(map);
     uint64_t hash = get_hash(map, key);
-	size_t i = hash & map->mask;
-	for (;;) {
-        struct bucket *bucket = bucket_at(map, i);
-		if (!bucket->dib) {
-			return NULL;
-		}
-		if (bucket->hash == hash && 
-            map->compare(key, bucket_item(bucket), map->udata) == 0)
-        {
-            return bucket_item(bucket);
-		}
-		i = (i + 1) & map->mask;
-	}
+    size_t i = find_bucket(map, key, hash);
+    if (i != SIZE_MAX) {
+        return item_at(map, i);
+    }
+    i = find_old(map, key, hash);
+    if (i != SIZE_MAX) {
+        return item_in(map, map->old.buckets, map->old.nbuckets, i);
+    }
+    return NULL;
 }
 
 // hashmap_probe returns the item in the bucket at position or NULL if an item
-// is not set for that bucket. The position is 'moduloed' by the number of 
+// is not set for that bucket. The position is 'moduloed' by the number of
 // buckets in the hashmap.
 void *hashmap_probe(struct hashmap *map, uint64_t position) {
     size_t i = position & map->mask;
-    struct bucket *bucket = bucket_at(map, i);
-    if (!bucket->dib) {
+    if (!full_in(map, map->buckets, map->nbuckets, i)) {
 		return NULL;
 	}
-    return bucket_item(bucket);
+    return item_at(map, i);
 }
 
 
@@ -334,40 +702,38 @@ void *hashmap_delete(struct hashmap *map, void *key) {
         panic("key is null");
     }
     map->oom = false;
+    migrate(map);
     uint64_t hash = get_hash(map, key);
-	size_t i = hash & map->mask;
-	for (;;) {
-        struct bucket *bucket = bucket_at(map, i);
-		if (!bucket->dib) {
-			return NULL;
-		}
-		if (bucket->hash == hash && 
-            map->compare(key, bucket_item(bucket), map->udata) == 0)
-        {
-            memcpy(map->spare, bucket_item(bucket), map->elsize);
-            bucket->dib = 0;
-            for (;;) {
-                struct bucket *prev = bucket;
-                i = (i + 1) & map->mask;
-                bucket = bucket_at(map, i);
-                if (bucket->dib <= 1) {
-                    prev->dib = 0;
-                    break;
-                }
-                memcpy(prev, bucket, map->bucketsz);
-                prev->dib--;
-            }
-            map->count--;
-            if (map->nbuckets > map->cap && map->count <= map->shrinkat) {
-                // Ignore the return value. It's ok for the resize operation to
-                // fail to allocate enough memory because a shrink operation
-                // does not change the integrity of the data.
-                resize(map, map->nbuckets/2);
-            }
-			return map->spare;
-		}
-		i = (i + 1) & map->mask;
-	}
+    size_t i = find_bucket(map, key, hash);
+    if (i != SIZE_MAX) {
+        memcpy(map->spare, item_at(map, i), map->elsize);
+        remove_at(map, i);
+    } else if ((i = find_old(map, key, hash)) != SIZE_MAX) {
+        take_old(map, i);
+    } else {
+        return NULL;
+    }
+    map->count--;
+    if (map->nbuckets > map->cap && map->count <= map->shrinkat) {
+        // Ignore the return value. It's ok for the resize operation to
+        // fail to allocate enough memory because a shrink operation
+        // does not change the integrity of the data.
+        resize(map, map->nbuckets/2);
+    }
+    return map->spare;
+}
+
+// hashmap_set_incremental makes the resizes incremental: instead of moving
+// all the items at once, every hashmap_set, hashmap_get and hashmap_delete
+// moves those of `step` buckets (or a few more) until the resize is done.
+// Meanwhile hashmap_get may also move items, so the pointers it returns are
+// only valid until the next operation. A step of 0, the default, resizes at
+// once.
+void hashmap_set_incremental(struct hashmap *map, size_t step) {
+    map->step = step;
+    if (!step && map->old.buckets) {
+        migrate_buckets(map, SIZE_MAX);
+    }
 }
 
 // hashmap_count returns the number of items in the hash map.
@@ -378,29 +744,45 @@ size_t hashmap_count(struct hashmap *map) {
 // hashmap_free frees the hash map
 void hashmap_free(struct hashmap *map) {
     if (!map) return;
+    if (map->old.buckets) {
+        map->free(map->old.buckets);
+    }
     map->free(map->buckets);
     map->free(map);
 }
 
-// hashmap_oom returns true if the last hashmap_set() call failed due to the 
+// hashmap_oom returns true if the last hashmap_set() call failed due to the
 // system being out of memory.
 bool hashmap_oom(struct hashmap *map) {
     return map->oom;
 }
 
+static bool scan_buckets(struct hashmap *map, void *buckets, size_t nbuckets,
+                         bool (*iter)(const void *item, void *udata),
+                         void *udata)
+{
+    for (size_t i = 0; i < nbuckets; i++) {
+        if (full_in(map, buckets, nbuckets, i)) {
+            if (!iter(item_in(map, buckets, nbuckets, i), udata)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 // hashmap_scan iterates over all items in the hash map
 // Param `iter` can return false to stop iteration early.
 // Returns false if the iteration has been stopped early.
-bool hashmap_scan(struct hashmap *map, 
+bool hashmap_scan(struct hashmap *map,
                   bool (*iter)(const void *item, void *udata), void *udata)
 {
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib) {
-            if (!iter(bucket_item(bucket), udata)) {
-                return false;
-            }
-        }
+    if (!scan_buckets(map, map->buckets, map->nbuckets, iter, udata)) {
+        return false;
+    }
+    if (map->old.buckets) {
+        return scan_buckets(map, map->old.buckets, map->old.nbuckets, iter,
+                            udata);
     }
     return true;
 }
@@ -464,12 +846,12 @@ static uint64_t SIP64(const uint8_t *in, const size_t inlen,
     const int left = inlen & 7;
     uint64_t b = ((uint64_t)inlen) << 56;
     switch (left) {
-    case 7: b |= ((uint64_t)in[6]) << 48;
-    case 6: b |= ((uint64_t)in[5]) << 40;
-    case 5: b |= ((uint64_t)in[4]) << 32;
-    case 4: b |= ((uint64_t)in[3]) << 24;
-    case 3: b |= ((uint64_t)in[2]) << 16;
-    case 2: b |= ((uint64_t)in[1]) << 8;
+    case 7: b |= ((uint64_t)in[6]) << 48; /* fallthrough */
+    case 6: b |= ((uint64_t)in[5]) << 40; /* fallthrough */
+    case 5: b |= ((uint64_t)in[4]) << 32; /* fallthrough */
+    case 4: b |= ((uint64_t)in[3]) << 24; /* fallthrough */
+    case 3: b |= ((uint64_t)in[2]) << 16; /* fallthrough */
+    case 2: b |= ((uint64_t)in[1]) << 8; /* fallthrough */
     case 1: b |= ((uint64_t)in[0]); break;
     case 0: break;
     }
@@ -524,23 +906,23 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
     uint32_t k3 = 0;
     uint32_t k4 = 0;
     switch(len & 15) {
-    case 15: k4 ^= tail[14] << 16;
-    case 14: k4 ^= tail[13] << 8;
+    case 15: k4 ^= tail[14] << 16; /* fallthrough */
+    case 14: k4 ^= tail[13] << 8; /* fallthrough */
     case 13: k4 ^= tail[12] << 0;
-             k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4;
-    case 12: k3 ^= tail[11] << 24;
-    case 11: k3 ^= tail[10] << 16;
-    case 10: k3 ^= tail[ 9] << 8;
+             k4 *= c4; k4  = ROTL32(k4,18); k4 *= c1; h4 ^= k4; /* fallthrough */
+    case 12: k3 ^= tail[11] << 24; /* fallthrough */
+    case 11: k3 ^= tail[10] << 16; /* fallthrough */
+    case 10: k3 ^= tail[ 9] << 8; /* fallthrough */
     case  9: k3 ^= tail[ 8] << 0;
-             k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3;
-    case  8: k2 ^= tail[ 7] << 24;
-    case  7: k2 ^= tail[ 6] << 16;
-    case  6: k2 ^= tail[ 5] << 8;
+             k3 *= c3; k3  = ROTL32(k3,17); k3 *= c4; h3 ^= k3; /* fallthrough */
+    case  8: k2 ^= tail[ 7] << 24; /* fallthrough */
+    case  7: k2 ^= tail[ 6] << 16; /* fallthrough */
+    case  6: k2 ^= tail[ 5] << 8; /* fallthrough */
     case  5: k2 ^= tail[ 4] << 0;
-             k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
-    case  4: k1 ^= tail[ 3] << 24;
-    case  3: k1 ^= tail[ 2] << 16;
-    case  2: k1 ^= tail[ 1] << 8;
+             k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2; /* fallthrough */
+    case  4: k1 ^= tail[ 3] << 24; /* fallthrough */
+    case  3: k1 ^= tail[ 2] << 16; /* fallthrough */
+    case  2: k1 ^= tail[ 1] << 8; /* fallthrough */
     case  1: k1 ^= tail[ 0] << 0;
              k1 *= c1; k1  = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
     };
@@ -567,6 +949,7 @@ uint64_t hashmap_sip(const void *data, size_t len,
 uint64_t hashmap_murmur(const void *data, size_t len, 
                         uint64_t seed0, uint64_t seed1)
 {
+    (void)seed1; // murmur takes a single seed, the signature is the one of the hash callbacks
     char out[16];
     MM86128(data, len, seed0, &out);
     return *(uint64_t*)out;
@@ -576,13 +959,19 @@ uint64_t hashmap_murmur(const void *data, size_t len,
 // TESTS AND BENCHMARKS
 // $ cc -DHASHMAP_TEST hashmap.c && ./a.out              # run tests
 // $ cc -DHASHMAP_TEST -O3 hashmap.c && BENCH=1 ./a.out  # run benchmarks
+// add -DHASHMAP_SWISS to test or benchmark the swiss table variant
 //==============================================================================
 #ifdef HASHMAP_TEST
 
 static size_t deepcount(struct hashmap *map) {
     size_t count = 0;
     for (size_t i = 0; i < map->nbuckets; i++) {
-        if (bucket_at(map, i)->dib) {
+        if (full_in(map, map->buckets, map->nbuckets, i)) {
+            count++;
+        }
+    }
+    for (size_t i = 0; map->old.buckets && i < map->old.nbuckets; i++) {
+        if (full_in(map, map->old.buckets, map->old.nbuckets, i)) {
             count++;
         }
     }
@@ -654,10 +1043,11 @@ static uint64_t hash_int(const void *item, uint64_t seed0, uint64_t seed1) {
     return hashmap_murmur(item, sizeof(int), seed0, seed1);
 }
 
-static void all() {
+static void all(size_t step) {
     int seed = getenv("SEED")?atoi(getenv("SEED")):time(NULL);
     int N = getenv("N")?atoi(getenv("N")):2000;
-    printf("seed=%d, count=%d, item_size=%zu\n", seed, N, sizeof(int));
+    printf("seed=%d, count=%d, item_size=%zu, step=%zu\n", seed, N, 
+           sizeof(int), step);
     srand(seed);
 
     rand_alloc_fail = true;
@@ -676,6 +1066,7 @@ static void all() {
 
     while (!(map = hashmap_new(sizeof(int), 0, seed, seed, 
                                hash_int, compare_ints_udata, NULL))) {}
+    hashmap_set_incremental(map, step);
     shuffle(vals, N, sizeof(int));
     for (int i = 0; i < N; i++) {
         // // printf("== %d ==\n", vals[i]);
@@ -782,6 +1173,42 @@ static void all() {
     }
 }
 
+// churn keeps a large map at a steady size while replacing its items, which
+// leaves tombstones behind in the swiss table variant
+static void churn(size_t step) {
+    int N = getenv("CHURN")?atoi(getenv("CHURN")):200000;
+    rand_alloc_fail = false;
+
+    struct hashmap *map = hashmap_new(sizeof(int), 0, 1, 2, hash_int, 
+                                      compare_ints_udata, NULL);
+    assert(map);
+    hashmap_set_incremental(map, step);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &i));
+    }
+    for (int round = 0; round < 4; round++) {
+        for (int i = round*N; i < (round+1)*N; i++) {
+            int old = i, new = i+N;
+            assert(hashmap_delete(map, &old));
+            assert(!hashmap_set(map, &new));
+        }
+        assert(hashmap_count(map) == (size_t)N);
+        assert(deepcount(map) == (size_t)N);
+        for (int i = (round+1)*N; i < (round+2)*N; i++) {
+            int *v = hashmap_get(map, &i);
+            assert(v && *v == i);
+        }
+        int missing = round*N;
+        assert(!hashmap_get(map, &missing));
+    }
+    hashmap_free(map);
+
+    if (total_allocs != 0) {
+        fprintf(stderr, "total_allocs: expected 0, got %lu\n", total_allocs);
+        exit(1);
+    }
+}
+
 #define bench(name, N, code) {{ \
     if (strlen(name) > 0) { \
         printf("%-14s ", name); \
@@ -869,6 +1296,27 @@ static void benchmarks() {
 
     hashmap_free(map);
 
+    // the slowest set, a resize at once moves all the items
+    for (size_t step = 0; step <= 32; step += 32) {
+        map = hashmap_new(sizeof(int), 0, seed, seed, hash_int, 
+                          compare_ints_udata, NULL);
+        hashmap_set_incremental(map, step);
+        double max_ns = 0;
+        for (int i = 0; i < N; i++) {
+            struct timespec begin, end;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            assert(!hashmap_set(map, &vals[i]));
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ns = (end.tv_sec-begin.tv_sec)*1e9+(end.tv_nsec-begin.tv_nsec);
+            if (ns > max_ns) {
+                max_ns = ns;
+            }
+        }
+        printf("set (step %-2zu)  %d ops, slowest %.3f ms\n", step, N, 
+               max_ns/1e6);
+        hashmap_free(map);
+    }
+
     
     xfree(vals);
 
@@ -886,7 +1334,10 @@ int main() {
         benchmarks();
     } else {
         printf("Running hashmap.c tests...\n");
-        all();
+        all(0);
+        churn(0);
+        all(3);
+        churn(3);
         printf("PASSED\n");
     }
 }
@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "hashmap_rcu.h"
+
+// epoch of a reader outside of any snapshot
+#define QUIESCENT UINT64_MAX
+
+struct hashmap_rcu_reader {
+	_Alignas(64) struct hashmap_rcu* map; // a slot per cache line, the readers don't share any
+	_Atomic bool used;
+	_Atomic uint64_t epoch; // epoch of the map when the reader entered, QUIESCENT after it left
+};
+
+struct retired_snapshot {
+	struct hashmap* snapshot;
+	uint64_t epoch; // readers that entered at this epoch or later can't hold the snapshot
+	struct retired_snapshot* next;
+};
+
+struct hashmap_rcu {
+	_Atomic(struct hashmap*) current;
+	_Atomic uint64_t epoch;
+	pthread_mutex_t writer;
+	struct retired_snapshot* retired; // only used by the writer holding the lock
+
+	size_t elsize;
+	uint64_t seed0, seed1;
+	uint64_t (*hash)(const void* item, uint64_t seed0, uint64_t seed1);
+	int (*compare)(const void* a, const void* b, void* udata);
+	void* udata;
+
+	struct hashmap_rcu_reader readers[HASHMAP_RCU_MAX_READERS];
+};
+
+static struct hashmap* new_snapshot(struct hashmap_rcu* map, size_t cap) {
+	return hashmap_new(map->elsize, cap, map->seed0, map->seed1, map->hash, map->compare, map->udata);
+}
+
+struct hashmap_rcu* hashmap_rcu_new(size_t elsize, uint64_t seed0, uint64_t seed1,
+	uint64_t (*hash)(const void* item, uint64_t seed0, uint64_t seed1),
+	int (*compare)(const void* a, const void* b, void* udata), void* udata) {
+	struct hashmap_rcu* map = aligned_alloc(_Alignof(struct hashmap_rcu), sizeof(struct hashmap_rcu));
+
+	if(map == NULL) {
+		return NULL;
+	}
+
+	memset(map, 0, sizeof(struct hashmap_rcu));
+	map->elsize = elsize;
+	map->seed0 = seed0;
+	map->seed1 = seed1;
+	map->hash = hash;
+	map->compare = compare;
+	map->udata = udata;
+
+	struct hashmap* empty = new_snapshot(map, 0);
+
+	if(empty == NULL) {
+		free(map);
+		return NULL;
+	}
+
+	atomic_init(&map->current, empty);
+	atomic_init(&map->epoch, 0);
+	pthread_mutex_init(&map->writer, NULL);
+
+	for(size_t i = 0; i < HASHMAP_RCU_MAX_READERS; ++i) {
+		map->readers[i].map = map;
+		atomic_init(&map->readers[i].used, false);
+		atomic_init(&map->readers[i].epoch, QUIESCENT);
+	}
+
+	return map;
+}
+
+void hashmap_rcu_free(struct hashmap_rcu* map) {
+	if(map == NULL) {
+		return;
+	}
+
+	while(map->retired != NULL) {
+		struct retired_snapshot* retired = map->retired;
+		map->retired = retired->next;
+		hashmap_free(retired->snapshot);
+		free(retired);
+	}
+
+	hashmap_free(atomic_load(&map->current));
+	pthread_mutex_destroy(&map->writer);
+	free(map);
+}
+
+struct hashmap_rcu_reader* hashmap_rcu_register(struct hashmap_rcu* map) {
+	for(size_t i = 0; i < HASHMAP_RCU_MAX_READERS; ++i) {
+		bool used = false;
+
+		if(atomic_compare_exchange_strong(&map->readers[i].used, &used, true)) {
+			return map->readers + i;
+		}
+	}
+
+	return NULL;
+}
+
+void hashmap_rcu_unregister(struct hashmap_rcu_reader* reader) {
+	hashmap_rcu_leave(reader);
+	atomic_store_explicit(&reader->used, false, memory_order_release);
+}
+
+struct hashmap* hashmap_rcu_enter(struct hashmap_rcu_reader* reader) {
+	struct hashmap_rcu* map = reader->map;
+
+	atomic_store_explicit(&reader->epoch, atomic_load_explicit(&map->epoch, memory_order_acquire), memory_order_relaxed);
+
+	// pairs with the fence of the reclaim: either the writer sees this reader or this reader sees the new snapshot
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return atomic_load_explicit(&map->current, memory_order_acquire);
+}
+
+void hashmap_rcu_leave(struct hashmap_rcu_reader* reader) {
+	// the reads of the snapshot happen before the writer can see the reader gone
+	atomic_store_explicit(&reader->epoch, QUIESCENT, memory_order_release);
+}
+
+static bool copy_item(const void* item, void* data) {
+	struct hashmap* copy = data;
+
+	hashmap_set(copy, (void*) item);
+
+	return !hashmap_oom(copy);
+}
+
+struct hashmap* hashmap_rcu_edit(struct hashmap_rcu* map, bool empty) {
+	pthread_mutex_lock(&map->writer);
+
+	// only the writers change the current snapshot, it can't move under the copy
+	struct hashmap* current = atomic_load_explicit(&map->current, memory_order_relaxed);
+	struct hashmap* copy = new_snapshot(map, empty ? 0 : hashmap_count(current));
+
+	if(copy != NULL && !empty && !hashmap_scan(current, copy_item, copy)) {
+		hashmap_free(copy);
+		copy = NULL;
+	}
+
+	if(copy == NULL) {
+		pthread_mutex_unlock(&map->writer);
+	}
+
+	return copy;
+}
+
+static size_t reclaim(struct hashmap_rcu* map) {
+	// pairs with the fence of hashmap_rcu_enter
+	atomic_thread_fence(memory_order_seq_cst);
+
+	uint64_t oldest = QUIESCENT;
+
+	for(size_t i = 0; i < HASHMAP_RCU_MAX_READERS; ++i) {
+		uint64_t epoch = atomic_load_explicit(&map->readers[i].epoch, memory_order_acquire);
+
+		if(epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	struct retired_snapshot** link = &map->retired;
+	size_t remaining = 0;
+
+	while(*link != NULL) {
+		struct retired_snapshot* retired = *link;
+
+		if(retired->epoch <= oldest) {
+			*link = retired->next;
+			hashmap_free(retired->snapshot);
+			free(retired);
+		}
+		else {
+			link = &retired->next;
+			++remaining;
+		}
+	}
+
+	return remaining;
+}
+
+void hashmap_rcu_publish(struct hashmap_rcu* map, struct hashmap* edited) {
+	struct retired_snapshot* retired = malloc(sizeof(struct retired_snapshot));
+
+	// the snapshots are never incremental, hashmap_get would move their items under the readers
+	hashmap_set_incremental(edited, 0);
+
+	struct hashmap* previous = atomic_exchange(&map->current, edited);
+	uint64_t epoch = atomic_fetch_add(&map->epoch, 1) + 1;
+
+	if(retired == NULL) {
+		// nowhere to keep it, it leaks rather than being freed under a reader
+		pthread_mutex_unlock(&map->writer);
+		return;
+	}
+
+	*retired = (struct retired_snapshot) {
+		.snapshot = previous,
+		.epoch = epoch,
+		.next = map->retired
+	};
+	map->retired = retired;
+
+	reclaim(map);
+	pthread_mutex_unlock(&map->writer);
+}
+
+void hashmap_rcu_cancel(struct hashmap_rcu* map, struct hashmap* edited) {
+	hashmap_free(edited);
+	pthread_mutex_unlock(&map->writer);
+}
+
+size_t hashmap_rcu_reclaim(struct hashmap_rcu* map) {
+	pthread_mutex_lock(&map->writer);
+	size_t remaining = reclaim(map);
+	pthread_mutex_unlock(&map->writer);
+
+	return remaining;
+}
+
+#ifdef HASHMAP_RCU_TEST
+
+#include <assert.h>
+#include <stdio.h>
+
+#define TEST_KEYS 256
+#define TEST_READERS 4
+#define TEST_VERSIONS 20000
+
+struct test_item {
+	int key;
+	int version;
+};
+
+static _Atomic bool stopping = false;
+
+static uint64_t test_hash(const void* item, uint64_t seed0, uint64_t seed1) {
+	return hashmap_murmur(&((const struct test_item*) item)->key, sizeof(int), seed0, seed1);
+}
+
+static int test_compare(const void* a, const void* b, void* udata) {
+	(void) udata;
+	return ((const struct test_item*) a)->key - ((const struct test_item*) b)->key;
+}
+
+// every snapshot holds all the keys of a single version, and the versions only go up
+static void* test_reader(void* data) {
+	struct hashmap_rcu_reader* reader = hashmap_rcu_register(data);
+	int last = -1;
+	size_t reads = 0;
+
+	assert(reader != NULL);
+
+	while(!atomic_load(&stopping)) {
+		struct hashmap* snapshot = hashmap_rcu_enter(reader);
+		int version = -1;
+
+		for(int key = 0; key < TEST_KEYS && hashmap_count(snapshot) > 0; ++key) {
+			struct test_item* item = hashmap_get(snapshot, &(struct test_item) { .key = key });
+
+			assert(item != NULL);
+			assert(version == -1 || item->version == version);
+			version = item->version;
+		}
+
+		hashmap_rcu_leave(reader);
+
+		assert(version >= last);
+		last = version;
+		++reads;
+	}
+
+	hashmap_rcu_unregister(reader);
+
+	return (void*) reads;
+}
+
+int main() {
+	struct hashmap_rcu* map = hashmap_rcu_new(sizeof(struct test_item), 0, 0, test_hash, test_compare, NULL);
+	pthread_t threads[TEST_READERS];
+	size_t reads = 0;
+
+	assert(map != NULL);
+
+	for(size_t i = 0; i < TEST_READERS; ++i) {
+		assert(pthread_create(threads + i, NULL, test_reader, map) == 0);
+	}
+
+	for(int version = 0; version < TEST_VERSIONS; ++version) {
+		// a reload now and then starts from an empty map
+		bool reload = version % 100 == 0;
+		struct hashmap* edited = hashmap_rcu_edit(map, reload);
+
+		assert(edited != NULL);
+		assert(hashmap_count(edited) == (reload ? 0 : TEST_KEYS));
+
+		// an incremental edit is finished before it is published
+		hashmap_set_incremental(edited, 1);
+
+		for(int key = 0; key < TEST_KEYS; ++key) {
+			hashmap_set(edited, &(struct test_item) { .key = key, .version = version });
+		}
+
+		if(version % 1000 == 999) {
+			hashmap_rcu_cancel(map, edited);
+		}
+		else {
+			hashmap_rcu_publish(map, edited);
+		}
+	}
+
+	atomic_store(&stopping, true);
+
+	for(size_t i = 0; i < TEST_READERS; ++i) {
+		void* result;
+
+		pthread_join(threads[i], &result);
+		reads += (size_t) result;
+	}
+
+	// nobody reads anymore, every replaced snapshot can go
+	assert(hashmap_rcu_reclaim(map) == 0);
+
+	struct hashmap_rcu_reader* readers[HASHMAP_RCU_MAX_READERS];
+
+	for(size_t i = 0; i < HASHMAP_RCU_MAX_READERS; ++i) {
+		assert((readers[i] = hashmap_rcu_register(map)) != NULL);
+	}
+
+	assert(hashmap_rcu_register(map) == NULL);
+
+	// a pinned snapshot outlives the publishes until its reader leaves
+	struct hashmap* pinned = hashmap_rcu_enter(readers[0]);
+	struct hashmap* edited = hashmap_rcu_edit(map, true);
+
+	hashmap_rcu_publish(map, edited);
+	assert(hashmap_rcu_reclaim(map) == 1);
+	assert(hashmap_count(pinned) == TEST_KEYS);
+
+	hashmap_rcu_leave(readers[0]);
+	assert(hashmap_rcu_reclaim(map) == 0);
+
+	for(size_t i = 0; i < HASHMAP_RCU_MAX_READERS; ++i) {
+		hashmap_rcu_unregister(readers[i]);
+	}
+
+	hashmap_rcu_free(map);
+
+	printf("PASSED (%zu reads)\n", reads);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef HASHMAP_RCU_H
+#define HASHMAP_RCU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+
+// threads registered to read a map at the same time
+#define HASHMAP_RCU_MAX_READERS 64
+
+/*
+ * Read-mostly hash map: readers look items up in an immutable snapshot without any lock,
+ * writers edit a private copy and publish it as the next snapshot with a single atomic store
+ * The replaced snapshots are freed once no reader can still hold them (epoch based reclamation)
+ */
+struct hashmap_rcu;
+
+/*
+ * Reader slot of a thread, only used by the thread that registered it
+ */
+struct hashmap_rcu_reader;
+
+struct hashmap_rcu* hashmap_rcu_new(size_t elsize, uint64_t seed0, uint64_t seed1,
+	uint64_t (*hash)(const void* item, uint64_t seed0, uint64_t seed1),
+	int (*compare)(const void* a, const void* b, void* udata), void* udata);
+
+/*
+ * Frees the map with all its snapshots, the readers and writers must be done with it
+ */
+void hashmap_rcu_free(struct hashmap_rcu* map);
+
+/*
+ * Claims a reader slot for the calling thread
+ * Returns NULL if all HASHMAP_RCU_MAX_READERS slots are taken
+ */
+struct hashmap_rcu_reader* hashmap_rcu_register(struct hashmap_rcu* map);
+
+void hashmap_rcu_unregister(struct hashmap_rcu_reader* reader);
+
+/*
+ * Pins the current snapshot until hashmap_rcu_leave, without ever waiting for a writer
+ * Only hashmap_get, hashmap_probe, hashmap_scan and hashmap_count may be used on the snapshot,
+ * its items stay valid until hashmap_rcu_leave. Entering again before leaving is not supported
+ */
+struct hashmap* hashmap_rcu_enter(struct hashmap_rcu_reader* reader);
+
+void hashmap_rcu_leave(struct hashmap_rcu_reader* reader);
+
+/*
+ * Starts an edit, the writers wait for each other: returns a copy of the current snapshot
+ * (or an empty map if empty is true) that the writer can change freely until it publishes it
+ * Returns NULL if out of memory, the edit is then over
+ */
+struct hashmap* hashmap_rcu_edit(struct hashmap_rcu* map, bool empty);
+
+/*
+ * Ends the edit by making the edited map the current snapshot, the replaced one is freed
+ * as soon as every reader that could have pinned it has left
+ */
+void hashmap_rcu_publish(struct hashmap_rcu* map, struct hashmap* edited);
+
+/*
+ * Ends the edit without publishing it
+ */
+void hashmap_rcu_cancel(struct hashmap_rcu* map, struct hashmap* edited);
+
+/*
+ * Frees the replaced snapshots that no reader holds anymore (publishing does it too)
+ * Returns the number of replaced snapshots still waiting for readers
+ */
+size_t hashmap_rcu_reclaim(struct hashmap_rcu* map);
+
+#endif
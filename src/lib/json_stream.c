@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "json_stream.h"
+
+void json_stream_init(struct json_stream* stream, json_value_callback_t on_value, json_close_callback_t on_close, void* userdata) {
+	memset(stream, 0, sizeof(struct json_stream));
+
+	stream->on_value = on_value;
+	stream->on_close = on_close;
+	stream->userdata = userdata;
+}
+
+static void append(struct json_stream* stream, char c) {
+	if(stream->length < JSON_STREAM_MAX_VALUE_LENGTH) {
+		stream->value[stream->length++] = c;
+	}
+}
+
+static void end_value(struct json_stream* stream, bool string) {
+	stream->value[stream->length] = 0;
+
+	if(string && stream->expect_key) {
+		strncpy(stream->key, stream->value, JSON_STREAM_MAX_KEY_LENGTH);
+		stream->key[JSON_STREAM_MAX_KEY_LENGTH] = 0;
+	}
+	else if(stream->on_value != NULL) {
+		stream->on_value(stream, stream->value, string);
+	}
+
+	stream->length = 0;
+}
+
+static bool open_container(struct json_stream* stream, bool object) {
+	if(stream->depth >= JSON_STREAM_MAX_DEPTH) {
+		return false;
+	}
+
+	++stream->depth;
+	strcpy(stream->keys[stream->depth], stream->key);
+	stream->objects[stream->depth] = object;
+	stream->key[0] = 0;
+	stream->expect_key = object;
+
+	return true;
+}
+
+static bool close_container(struct json_stream* stream, bool object) {
+	if(stream->depth == 0 || stream->objects[stream->depth] != object) {
+		return false;
+	}
+
+	if(stream->on_close != NULL) {
+		stream->on_close(stream);
+	}
+
+	--stream->depth;
+	strcpy(stream->key, stream->keys[stream->depth + 1]);
+	stream->expect_key = false;
+
+	return true;
+}
+
+bool json_stream_feed(struct json_stream* stream, const char* data, size_t size) {
+	for(size_t i = 0; i < size && !stream->failed; ++i) {
+		char c = data[i];
+
+		if(stream->in_string) {
+			if(stream->escaped) {
+				append(stream, c);
+				stream->escaped = false;
+			}
+			else if(c == '\\') {
+				stream->escaped = true;
+			}
+			else if(c == '"') {
+				stream->in_string = false;
+				end_value(stream, true);
+			}
+			else {
+				append(stream, c);
+			}
+
+			continue;
+		}
+
+		if(stream->in_literal) {
+			if(strchr(",}] \t\r\n", c) == NULL) {
+				append(stream, c);
+				continue;
+			}
+
+			stream->in_literal = false;
+			end_value(stream, false);
+		}
+
+		switch(c) {
+			case '"':
+				stream->in_string = true;
+				break;
+			case '{':
+			case '[':
+				stream->failed = !open_container(stream, c == '{');
+				break;
+			case '}':
+			case ']':
+				stream->failed = !close_container(stream, c == '}');
+				break;
+			case ',':
+				stream->expect_key = stream->objects[stream->depth];
+				stream->key[0] = 0;
+				break;
+			case ':':
+				stream->expect_key = false;
+				break;
+			case ' ':
+			case '\t':
+			case '\r':
+			case '\n':
+				break;
+			default:
+				stream->in_literal = true;
+				append(stream, c);
+				break;
+		}
+	}
+
+	return !stream->failed;
+}
@@ -0,0 +1,50 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Incremental json scanner: the document can be fed in chunks of any size (as they come from the network),
+ * the scalar values are reported with the keys of the containers holding them, nothing else is kept
+ */
+
+#define JSON_STREAM_MAX_DEPTH 8
+#define JSON_STREAM_MAX_KEY_LENGTH 31
+#define JSON_STREAM_MAX_VALUE_LENGTH 255 // longer strings are truncated
+
+struct json_stream;
+
+/*
+ * Called for every scalar, value is the text of the string (escapes only have their backslash removed) or of the literal
+ * The key of the value is stream->key, the ones of its containers stream->keys[1] to stream->keys[stream->depth - 1]
+ */
+typedef void (*json_value_callback_t)(struct json_stream* stream, const char* value, bool string);
+
+/*
+ * Called when an object or array ends, before leaving it (stream->depth still counts it)
+ */
+typedef void (*json_close_callback_t)(struct json_stream* stream);
+
+struct json_stream {
+	json_value_callback_t on_value;
+	json_close_callback_t on_close;
+	void* userdata;
+	int depth; // number of open containers
+	char keys[JSON_STREAM_MAX_DEPTH + 1][JSON_STREAM_MAX_KEY_LENGTH + 1]; // keys[i] is the key of the container at depth i
+	bool objects[JSON_STREAM_MAX_DEPTH + 1];
+	char key[JSON_STREAM_MAX_KEY_LENGTH + 1]; // key of the current value, empty in arrays
+	char value[JSON_STREAM_MAX_VALUE_LENGTH + 1];
+	size_t length;
+	bool in_string, escaped, in_literal, expect_key, failed;
+};
+
+void json_stream_init(struct json_stream* stream, json_value_callback_t on_value, json_close_callback_t on_close, void* userdata);
+
+/*
+ * Scans the next chunk of the document
+ * Returns false once the document is found malformed or nested too deep
+ */
+bool json_stream_feed(struct json_stream* stream, const char* data, size_t size);
+
+#endif
@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+void latency_record(struct latency_window* window, double ms) {
+	window->samples[window->next] = ms;
+	window->next = (window->next + 1) % LATENCY_WINDOW_SIZE;
+
+	if(window->count < LATENCY_WINDOW_SIZE) {
+		++window->count;
+	}
+}
+
+size_t latency_count(const struct latency_window* window) {
+	return window->count;
+}
+
+static int compare_samples(const void* a, const void* b) {
+	double x = *(const double*) a,
+		y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+double latency_percentile(const struct latency_window* window, double percentile) {
+	if(window->count == 0) {
+		return 0;
+	}
+
+	// the window is small enough that sorting a copy is cheaper than keeping an ordered structure
+	double sorted[LATENCY_WINDOW_SIZE];
+	memcpy(sorted, window->samples, window->count * sizeof(double));
+	qsort(sorted, window->count, sizeof(double), compare_samples);
+
+	size_t rank = (size_t) (percentile / 100 * window->count + 0.999999);
+
+	if(rank < 1) {
+		rank = 1;
+	}
+	else if(rank > window->count) {
+		rank = window->count;
+	}
+
+	return sorted[rank - 1];
+}
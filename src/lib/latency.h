@@ -0,0 +1,34 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+
+#define LATENCY_WINDOW_SIZE 64
+
+/*
+ * Sliding window of the most recent latency samples (in milliseconds)
+ * The oldest sample gets overwritten once the window is full
+ */
+struct latency_window {
+	double samples[LATENCY_WINDOW_SIZE];
+	size_t count;
+	size_t next;
+};
+
+/*
+ * Add a sample to the window
+ */
+void latency_record(struct latency_window* window, double ms);
+
+/*
+ * Number of samples currently held by the window
+ */
+size_t latency_count(const struct latency_window* window);
+
+/*
+ * Nearest-rank percentile (0-100) of the samples in the window
+ * Returns 0 if the window is empty
+ */
+double latency_percentile(const struct latency_window* window, double percentile);
+
+#endif
@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "natpmp.h"
+
+#define NATPMP_VERSION 0
+#define NATPMP_OPCODE_ADDRESS 0
+#define NATPMP_OPCODE_RESPONSE 0x80
+#define NATPMP_REQUEST_SIZE 2
+#define NATPMP_ADDRESS_RESPONSE_SIZE 12
+
+size_t natpmp_build_address_request(uint8_t* buffer, size_t size) {
+	if(size < NATPMP_REQUEST_SIZE) {
+		return 0;
+	}
+
+	buffer[0] = NATPMP_VERSION;
+	buffer[1] = NATPMP_OPCODE_ADDRESS;
+
+	return NATPMP_REQUEST_SIZE;
+}
+
+bool natpmp_parse_address_response(const uint8_t* message, size_t length, uint16_t* result, uint8_t* address) {
+	// version, opcode, result code, seconds since the mapping table was reset and the address
+	if(length < NATPMP_ADDRESS_RESPONSE_SIZE || message[0] != NATPMP_VERSION || message[1] != (NATPMP_OPCODE_RESPONSE | NATPMP_OPCODE_ADDRESS)) {
+		return false;
+	}
+
+	*result = (uint16_t) (message[2] << 8 | message[3]);
+
+	if(*result == NATPMP_RESULT_SUCCESS) {
+		memcpy(address, message + 8, 4);
+	}
+
+	return true;
+}
+
+#ifdef NATPMP_TEST
+
+// cc -DNATPMP_TEST natpmp.c && ./a.out
+
+#include <assert.h>
+#include <stdio.h>
+
+int main() {
+	uint8_t request[4], address[4] = { 0 };
+	uint16_t result;
+
+	assert(natpmp_build_address_request(request, 1) == 0);
+	assert(natpmp_build_address_request(request, sizeof(request)) == NATPMP_REQUEST_SIZE && request[0] == 0 && request[1] == 0);
+
+	// version 0, opcode 128, result, epoch, address
+	uint8_t response[NATPMP_ADDRESS_RESPONSE_SIZE + 4] = { 0, 128, 0, 0, 0, 0, 0x12, 0x34, 203, 0, 113, 5, 0xff, 0xff, 0xff, 0xff };
+
+	assert(natpmp_parse_address_response(response, NATPMP_ADDRESS_RESPONSE_SIZE, &result, address));
+	assert(result == NATPMP_RESULT_SUCCESS && memcmp(address, "\xcb\x00\x71\x05", 4) == 0);
+	assert(natpmp_parse_address_response(response, sizeof(response), &result, address) && result == NATPMP_RESULT_SUCCESS);
+
+	// a refusal leaves the address untouched
+	memset(address, 0, sizeof(address));
+	response[3] = 3; // network failure
+	assert(natpmp_parse_address_response(response, NATPMP_ADDRESS_RESPONSE_SIZE, &result, address) && result == 3);
+	assert(memcmp(address, "\0\0\0\0", 4) == 0);
+	response[2] = 1;
+	assert(natpmp_parse_address_response(response, NATPMP_ADDRESS_RESPONSE_SIZE, &result, address) && result == 0x0103);
+	response[2] = response[3] = 0;
+
+	// a short answer, our own request echoed back, a mapping answer and another version
+	for(size_t length = 0; length < NATPMP_ADDRESS_RESPONSE_SIZE; ++length) {
+		assert(!natpmp_parse_address_response(response, length, &result, address));
+	}
+	assert(!natpmp_parse_address_response(request, NATPMP_REQUEST_SIZE, &result, address));
+	response[1] = 0;
+	assert(!natpmp_parse_address_response(response, NATPMP_ADDRESS_RESPONSE_SIZE, &result, address));
+	response[1] = 129;
+	assert(!natpmp_parse_address_response(response, NATPMP_ADDRESS_RESPONSE_SIZE, &result, address));
+	response[1] = 128;
+	response[0] = 2; // PCP
+	assert(!natpmp_parse_address_response(response, NATPMP_ADDRESS_RESPONSE_SIZE, &result, address));
+
+	printf("PASSED\n");
+
+	return 0;
+}
+
+#endif
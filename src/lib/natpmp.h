@@ -0,0 +1,28 @@
+#ifndef NATPMP_H
+#define NATPMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal nat-pmp client messages (rfc 6886), enough to ask the gateway for its external ipv4 address
+ */
+
+#define NATPMP_PORT 5351
+#define NATPMP_RESULT_SUCCESS 0
+
+/*
+ * Writes an external address request (opcode 0) in buffer
+ * Returns the message length or 0 if the buffer is too small
+ */
+size_t natpmp_build_address_request(uint8_t* buffer, size_t size);
+
+/*
+ * Reads an external address response, the result code is written in result and the address (4 bytes, network byte order)
+ * only when the result is NATPMP_RESULT_SUCCESS
+ * Returns false if the message is not an external address response
+ */
+bool natpmp_parse_address_response(const uint8_t* message, size_t length, uint16_t* result, uint8_t* address);
+
+#endif
@@ -0,0 +1,264 @@
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "stun.h"
+
+#define STUN_MAGIC_COOKIE 0x2112a442
+#define STUN_BINDING_REQUEST 0x0001
+#define STUN_BINDING_SUCCESS 0x0101
+
+#define STUN_ATTRIBUTE_MAPPED_ADDRESS 0x0001
+#define STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS 0x0020
+
+#define STUN_ADDRESS_FAMILY_IPV4 0x01
+#define STUN_ADDRESS_FAMILY_IPV6 0x02
+
+static inline void write_u16(uint8_t* buffer, uint16_t value) {
+	buffer[0] = value >> 8;
+	buffer[1] = value & 0xff;
+}
+
+static inline void write_u32(uint8_t* buffer, uint32_t value) {
+	write_u16(buffer, value >> 16);
+	write_u16(buffer + 2, value & 0xffff);
+}
+
+static inline uint16_t read_u16(const uint8_t* buffer) {
+	return (uint16_t) (buffer[0] << 8 | buffer[1]);
+}
+
+static inline uint32_t read_u32(const uint8_t* buffer) {
+	return (uint32_t) buffer[0] << 24 | (uint32_t) buffer[1] << 16 | (uint32_t) buffer[2] << 8 | buffer[3];
+}
+
+size_t stun_build_binding_request(uint8_t* buffer, size_t size, const uint8_t* transaction_id) {
+	if(size < STUN_HEADER_SIZE) {
+		return 0;
+	}
+
+	write_u16(buffer, STUN_BINDING_REQUEST);
+	write_u16(buffer + 2, 0); // no attributes
+	write_u32(buffer + 4, STUN_MAGIC_COOKIE);
+	memcpy(buffer + 8, transaction_id, STUN_TRANSACTION_ID_SIZE);
+
+	return STUN_HEADER_SIZE;
+}
+
+/*
+ * Reads a (XOR-)MAPPED-ADDRESS value, the xored one is masked with the cookie and the transaction id
+ */
+static bool read_address(const uint8_t* value, size_t length, const uint8_t* header, bool xored, int* family, uint8_t* address) {
+	size_t address_length;
+
+	if(length < 4) {
+		return false;
+	}
+
+	switch(value[1]) {
+		case STUN_ADDRESS_FAMILY_IPV4:
+			*family = AF_INET;
+			address_length = 4;
+			break;
+		case STUN_ADDRESS_FAMILY_IPV6:
+			*family = AF_INET6;
+			address_length = 16;
+			break;
+		default:
+			return false;
+	}
+
+	if(length < 4 + address_length) {
+		return false;
+	}
+
+	for(size_t i = 0; i < address_length; ++i) {
+		// the mask is the magic cookie followed by the transaction id, both right after the message type and length
+		address[i] = value[4 + i] ^ (xored ? header[4 + i] : 0);
+	}
+
+	return true;
+}
+
+bool stun_parse_binding_response(const uint8_t* message, size_t length, const uint8_t* transaction_id, int* family, uint8_t* address) {
+	if(length < STUN_HEADER_SIZE || read_u16(message) != STUN_BINDING_SUCCESS || read_u32(message + 4) != STUN_MAGIC_COOKIE
+		|| memcmp(message + 8, transaction_id, STUN_TRANSACTION_ID_SIZE) != 0) {
+		return false;
+	}
+
+	size_t end = STUN_HEADER_SIZE + read_u16(message + 2),
+		position = STUN_HEADER_SIZE;
+	bool found = false;
+
+	if(end > length) {
+		return false;
+	}
+
+	while(position + 4 <= end) {
+		uint16_t type = read_u16(message + position),
+			attribute_length = read_u16(message + position + 2);
+		const uint8_t* value = message + position + 4;
+		uint8_t parsed[16];
+		int parsed_family;
+
+		if(position + 4 + attribute_length > end) {
+			return false;
+		}
+
+		if((type == STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS || (type == STUN_ATTRIBUTE_MAPPED_ADDRESS && !found))
+			&& read_address(value, attribute_length, message, type == STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, &parsed_family, parsed)) {
+			*family = parsed_family;
+			memcpy(address, parsed, parsed_family == AF_INET ? 4 : 16);
+			found = true;
+
+			if(type == STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS) {
+				return true;
+			}
+		}
+
+		// attributes are padded to a multiple of 4 bytes
+		position += 4 + ((attribute_length + 3) & ~3);
+	}
+
+	return found;
+}
+
+#ifdef STUN_TEST
+
+// cc -DSTUN_TEST stun.c && ./a.out
+
+#include <assert.h>
+#include <stdio.h>
+
+static const uint8_t TEST_ID[STUN_TRANSACTION_ID_SIZE] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+static const uint8_t TEST_IPV4[4] = { 203, 0, 113, 5 };
+static const uint8_t TEST_IPV6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x42 };
+
+// header of a binding response, the attributes are appended by add_attribute
+static size_t test_header(uint8_t* message, uint16_t type) {
+	write_u16(message, type);
+	write_u16(message + 2, 0);
+	write_u32(message + 4, STUN_MAGIC_COOKIE);
+	memcpy(message + 8, TEST_ID, STUN_TRANSACTION_ID_SIZE);
+
+	return STUN_HEADER_SIZE;
+}
+
+static size_t add_attribute(uint8_t* message, size_t length, uint16_t type, const uint8_t* value, uint16_t value_length) {
+	size_t padded = (value_length + 3) & ~3;
+
+	write_u16(message + length, type);
+	write_u16(message + length + 2, value_length);
+	memset(message + length + 4, 0, padded);
+	memcpy(message + length + 4, value, value_length);
+	length += 4 + padded;
+	write_u16(message + 2, length - STUN_HEADER_SIZE);
+
+	return length;
+}
+
+// value of a (XOR-)MAPPED-ADDRESS attribute for the address
+static uint16_t address_value(uint8_t* value, const uint8_t* message, bool xored, int family, const uint8_t* address) {
+	size_t address_length = family == AF_INET ? 4 : 16;
+
+	value[0] = 0;
+	value[1] = family == AF_INET ? STUN_ADDRESS_FAMILY_IPV4 : STUN_ADDRESS_FAMILY_IPV6;
+	write_u16(value + 2, 3478);
+
+	for(size_t i = 0; i < address_length; ++i) {
+		value[4 + i] = address[i] ^ (xored ? message[4 + i] : 0);
+	}
+
+	return 4 + address_length;
+}
+
+static bool test_parse(const uint8_t* message, size_t length, int* family, uint8_t* address) {
+	return stun_parse_binding_response(message, length, TEST_ID, family, address);
+}
+
+int main() {
+	uint8_t message[STUN_MAX_MESSAGE_SIZE], value[20], address[16];
+	size_t length;
+	uint16_t value_length;
+	int family;
+
+	// the request is a bare header
+	assert(stun_build_binding_request(message, STUN_HEADER_SIZE - 1, TEST_ID) == 0);
+	assert(stun_build_binding_request(message, sizeof(message), TEST_ID) == STUN_HEADER_SIZE);
+	assert(read_u16(message) == STUN_BINDING_REQUEST && read_u16(message + 2) == 0 && read_u32(message + 4) == STUN_MAGIC_COOKIE);
+	assert(memcmp(message + 8, TEST_ID, STUN_TRANSACTION_ID_SIZE) == 0);
+
+	// xored ipv4 and ipv6 addresses
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	value_length = address_value(value, message, true, AF_INET, TEST_IPV4);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, value, value_length);
+	assert(test_parse(message, length, &family, address) && family == AF_INET && memcmp(address, TEST_IPV4, 4) == 0);
+
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	value_length = address_value(value, message, true, AF_INET6, TEST_IPV6);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, value, value_length);
+	assert(test_parse(message, length, &family, address) && family == AF_INET6 && memcmp(address, TEST_IPV6, 16) == 0);
+
+	// a plain MAPPED-ADDRESS after an unknown attribute with padding
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	length = add_attribute(message, length, 0x8022, (const uint8_t*) "agent", 5);
+	value_length = address_value(value, message, false, AF_INET, TEST_IPV4);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_MAPPED_ADDRESS, value, value_length);
+	assert(test_parse(message, length, &family, address) && family == AF_INET && memcmp(address, TEST_IPV4, 4) == 0);
+
+	// the xored address wins over the plain one, whatever their order
+	uint8_t other[4] = { 198, 51, 100, 1 };
+	value_length = address_value(value, message, true, AF_INET, other);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, value, value_length);
+	assert(test_parse(message, length, &family, address) && memcmp(address, other, 4) == 0);
+
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	value_length = address_value(value, message, true, AF_INET, other);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, value, value_length);
+	value_length = address_value(value, message, false, AF_INET, TEST_IPV4);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_MAPPED_ADDRESS, value, value_length);
+	assert(test_parse(message, length, &family, address) && memcmp(address, other, 4) == 0);
+
+	// not an answer to the request: another transaction, another message type, no cookie
+	assert(!stun_parse_binding_response(message, length, (const uint8_t*) "abcdefghijkl", &family, address));
+	write_u16(message, 0x0111);
+	assert(!test_parse(message, length, &family, address));
+	write_u16(message, STUN_BINDING_SUCCESS);
+	write_u32(message + 4, 0);
+	assert(!test_parse(message, length, &family, address));
+
+	// truncated messages and attributes
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	value_length = address_value(value, message, true, AF_INET, TEST_IPV4);
+	length = add_attribute(message, length, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, value, value_length);
+	assert(!test_parse(message, STUN_HEADER_SIZE - 1, &family, address));
+	assert(!test_parse(message, length - 1, &family, address)); // shorter than its declared length
+	write_u16(message + STUN_HEADER_SIZE + 2, 12); // attribute past the end of the message
+	assert(!test_parse(message, length, &family, address));
+	write_u16(message + STUN_HEADER_SIZE + 2, 6); // address cut short
+	assert(!test_parse(message, length, &family, address));
+	write_u16(message + STUN_HEADER_SIZE + 2, 8);
+	message[STUN_HEADER_SIZE + 5] = 0x03; // unknown address family
+	assert(!test_parse(message, length, &family, address));
+
+	// an ipv6 family with the length of an ipv4 address
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	value_length = address_value(value, message, true, AF_INET, TEST_IPV4);
+	value[1] = STUN_ADDRESS_FAMILY_IPV6;
+	length = add_attribute(message, length, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, value, value_length);
+	assert(!test_parse(message, length, &family, address));
+
+	// no address at all, and a trailing partial attribute header
+	length = test_header(message, STUN_BINDING_SUCCESS);
+	assert(!test_parse(message, length, &family, address));
+	length = add_attribute(message, length, 0x8022, (const uint8_t*) "agent", 5);
+	memset(message + length, 0, 2);
+	write_u16(message + 2, length + 2 - STUN_HEADER_SIZE);
+	assert(!test_parse(message, length + 2, &family, address));
+
+	printf("PASSED\n");
+
+	return 0;
+}
+
+#endif
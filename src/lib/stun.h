@@ -0,0 +1,31 @@
+#ifndef STUN_H
+#define STUN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal stun client messages (rfc 5389), enough to learn the mapped address with a binding request
+ */
+
+#define STUN_DEFAULT_PORT 3478
+#define STUN_TRANSACTION_ID_SIZE 12
+#define STUN_HEADER_SIZE 20
+#define STUN_MAX_MESSAGE_SIZE 548
+
+/*
+ * Writes a binding request without attributes in buffer
+ * Returns the message length or 0 if the buffer is too small
+ */
+size_t stun_build_binding_request(uint8_t* buffer, size_t size, const uint8_t* transaction_id);
+
+/*
+ * Reads the mapped address from a binding success response to the request with the passed transaction id,
+ * XOR-MAPPED-ADDRESS is preferred over MAPPED-ADDRESS
+ * The family (AF_INET or AF_INET6) and the address in network byte order (4 or 16 bytes) are written
+ * Returns false if the message is not a valid response to the request or has no mapped address
+ */
+bool stun_parse_binding_response(const uint8_t* message, size_t length, const uint8_t* transaction_id, int* family, uint8_t* address);
+
+#endif
@@ -0,0 +1,92 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "lib/logger.h"
+#include "utils.h"
+
+struct metric_descriptor {
+	const char* name;
+	const char* type;
+	const char* help;
+};
+
+static const struct metric_descriptor METRICS[METRIC_COUNT] = {
+	[METRIC_DISCOVERY_RETRIES] = { "dyn_dns_discovery_retries_total", "counter", "Retried external address queries" },
+	[METRIC_PATCH_RETRIES] = { "dyn_dns_patch_retries_total", "counter", "Retried cloudflare record updates" },
+	[METRIC_DISCOVERY_HEDGES] = { "dyn_dns_discovery_hedges_total", "counter", "Hedged external address queries sent" },
+	[METRIC_DISCOVERY_HEDGE_WINS] = { "dyn_dns_discovery_hedge_wins_total", "counter", "Hedged external address queries that answered first" },
+	[METRIC_CIRCUIT_OPENED] = { "dyn_dns_circuit_opened_total", "counter", "Times a circuit breaker opened for an upstream host" },
+	[METRIC_CIRCUIT_REJECTED] = { "dyn_dns_circuit_rejected_total", "counter", "Calls failed fast by an open circuit breaker" },
+	[METRIC_RATE_LIMITED] = { "dyn_dns_rate_limited_total", "counter", "Api responses that asked to retry later" },
+	[METRIC_SCHEDULER_WAIT_MS] = { "dyn_dns_scheduler_wait_milliseconds_total", "counter", "Time spent pacing api calls to stay within the rate limits" },
+	[METRIC_SCHEDULER_DEFERRED] = { "dyn_dns_scheduler_deferred_total", "counter", "Api calls put off to the next run because the rate limits asked to wait too long" },
+	[METRIC_CALL_TIMEOUTS] = { "dyn_dns_call_timeouts_total", "counter", "Calls cut by their adaptive timeout" },
+	[METRIC_RESOLVER_QUERIES] = { "dyn_dns_resolver_queries_total", "counter", "Dns queries sent by the background resolver" },
+	[METRIC_RESOLVER_FAILURES] = { "dyn_dns_resolver_failures_total", "counter", "Upstream hosts the background resolver couldn't resolve" },
+	[METRIC_RESOLVER_HITS] = { "dyn_dns_resolver_hits_total", "counter", "Calls that used addresses from the resolver cache" },
+	[METRIC_RESOLVER_MISSES] = { "dyn_dns_resolver_misses_total", "counter", "Calls left to the curl resolver" },
+	[METRIC_PREWARMS] = { "dyn_dns_prewarms_total", "counter", "Connections opened ahead of a predicted run" },
+	[METRIC_PREWARM_SAVED_MS] = { "dyn_dns_prewarm_saved_milliseconds_total", "counter", "Connection setup time saved by prewarmed connections" },
+	[METRIC_PROVIDER_EXPLORATIONS] = { "dyn_dns_provider_explorations_total", "counter", "Discoveries sent to a provider other than the best one to refresh its statistics" },
+	[METRIC_DISCOVERY_DISAGREEMENTS] = { "dyn_dns_discovery_disagreements_total", "counter", "Quorum discoveries where the providers returned different addresses" },
+	[METRIC_TRIGGERED_RUNS] = { "dyn_dns_triggered_runs_total", "counter", "Runs started by a lease file, route or address change" },
+	[METRIC_VERIFY_QUERIES] = { "dyn_dns_verify_queries_total", "counter", "Dns queries sent to check the published records" },
+	[METRIC_VERIFY_SKIPPED_UPDATES] = { "dyn_dns_verify_skipped_updates_total", "counter", "Updates skipped because the authoritative nameservers already publish the address" },
+	[METRIC_RECONCILE_PAGES] = { "dyn_dns_reconcile_pages_total", "counter", "Pages of records listed to reconcile the published addresses" },
+	[METRIC_OUTBOX_COALESCED] = { "dyn_dns_outbox_coalesced_total", "counter", "Pending updates replaced by a newer address of the same record" },
+	[METRIC_OUTBOX_REPLAYED] = { "dyn_dns_outbox_replayed_total", "counter", "Pending outbox updates sent again" },
+	[METRIC_STATE_WRITES] = { "dyn_dns_state_writes_total", "counter", "Writes of the published addresses state file" },
+	[METRIC_STATE_WRITTEN_BYTES] = { "dyn_dns_state_written_bytes_total", "counter", "Bytes written to the published addresses state file" },
+	[METRIC_STATE_LAST_WRITE_BYTES] = { "dyn_dns_state_last_write_bytes", "gauge", "Bytes written by the last run to the published addresses state file" },
+	[METRIC_STATE_LAST_SYNC_MS] = { "dyn_dns_state_last_sync_milliseconds", "gauge", "Time the last run took to sync the published addresses state file" },
+};
+
+// updated by the resolver thread too, without a lock
+static _Atomic double values[METRIC_COUNT];
+
+void metrics_inc(enum metric metric) {
+	metrics_add(metric, 1);
+}
+
+void metrics_add(enum metric metric, double value) {
+	double current = atomic_load_explicit(values + metric, memory_order_relaxed);
+
+	// there is no atomic_fetch_add for floating types
+	while(!atomic_compare_exchange_weak(values + metric, &current, current + value));
+}
+
+void metrics_set(enum metric metric, double value) {
+	atomic_store(values + metric, value);
+}
+
+double metrics_get(enum metric metric) {
+	return atomic_load(values + metric);
+}
+
+bool metrics_write(const char* path) {
+	char* temp_path = format_string("%s.tmp", (char*) path);
+	FILE* file = fopen(temp_path, "w");
+
+	if(file == NULL) {
+		log_warning("Couldn't open the metrics file '%s'", temp_path);
+		free(temp_path);
+		return false;
+	}
+
+	for(int i = 0; i < METRIC_COUNT; ++i) {
+		fprintf(file, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n",
+			METRICS[i].name, METRICS[i].help, METRICS[i].name, METRICS[i].type, METRICS[i].name, atomic_load(values + i));
+	}
+
+	bool success = fclose(file) == 0 && rename(temp_path, path) == 0;
+
+	if(!success) {
+		log_warning("Couldn't write the metrics file '%s'", path);
+	}
+
+	free(temp_path);
+	return success;
+}
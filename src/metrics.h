@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H 1
+
+#include <stdbool.h>
+
+/**
+ * Daemon metrics, exported in the prometheus text format so that they can be
+ * picked up by the node_exporter textfile collector.
+ * All the functions are thread safe.
+ **/
+enum metric {
+	METRIC_DISCOVERY_RETRIES,
+	METRIC_PATCH_RETRIES,
+	METRIC_DISCOVERY_HEDGES,
+	METRIC_DISCOVERY_HEDGE_WINS,
+	METRIC_CIRCUIT_OPENED,
+	METRIC_CIRCUIT_REJECTED,
+	METRIC_RATE_LIMITED,
+	METRIC_SCHEDULER_WAIT_MS,
+	METRIC_SCHEDULER_DEFERRED,
+	METRIC_CALL_TIMEOUTS,
+	METRIC_RESOLVER_QUERIES,
+	METRIC_RESOLVER_FAILURES,
+	METRIC_RESOLVER_HITS,
+	METRIC_RESOLVER_MISSES,
+	METRIC_PREWARMS,
+	METRIC_PREWARM_SAVED_MS,
+	METRIC_PROVIDER_EXPLORATIONS,
+	METRIC_DISCOVERY_DISAGREEMENTS,
+	METRIC_TRIGGERED_RUNS,
+	METRIC_VERIFY_QUERIES,
+	METRIC_VERIFY_SKIPPED_UPDATES,
+	METRIC_RECONCILE_PAGES,
+	METRIC_OUTBOX_COALESCED,
+	METRIC_OUTBOX_REPLAYED,
+	METRIC_STATE_WRITES,
+	METRIC_STATE_WRITTEN_BYTES,
+	METRIC_STATE_LAST_WRITE_BYTES,
+	METRIC_STATE_LAST_SYNC_MS,
+	METRIC_COUNT
+};
+
+void metrics_inc(enum metric metric);
+
+void metrics_add(enum metric metric, double value);
+
+/**
+ * Overwrites the value, meant for gauges
+ **/
+void metrics_set(enum metric metric, double value);
+
+double metrics_get(enum metric metric);
+
+/**
+ * Writes all the metrics to the file at path (through a temporary file and a rename)
+ **/
+bool metrics_write(const char* path);
+
+#endif
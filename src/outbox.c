@@ -0,0 +1,217 @@
+#include "outbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lib/hashmap.h"
+#include "lib/logger.h"
+#include "metrics.h"
+#include "records.h"
+#include "utils.h"
+
+#define OUTBOX_LINE_MAX_LENGTH (CLOUDFLARE_ID_SIZE + ADDRESS_MAX_TEXT_LENGTH + 2)
+
+// pending update of a record, the records whose last line is a done one have none
+struct outbox_entry {
+	char record_id[CLOUDFLARE_ID_SIZE + 1];
+	struct address address;
+};
+
+static struct hashmap* entries = NULL;
+static int fd = -1;
+static char* log_path = NULL;
+
+static uint64_t entry_hash(const void* item, uint64_t seed0, uint64_t seed1) {
+	const struct outbox_entry* entry = item;
+	return hashmap_sip(entry->record_id, strlen(entry->record_id), seed0, seed1);
+}
+
+static int entry_compare(const void* a, const void* b, void* udata) {
+	(void) udata;
+	return strcmp(((const struct outbox_entry*) a)->record_id, ((const struct outbox_entry*) b)->record_id);
+}
+
+static struct outbox_entry* find_entry(const char* record_id) {
+	struct outbox_entry key = { 0 };
+
+	snprintf(key.record_id, sizeof(key.record_id), "%s", record_id);
+
+	return hashmap_get(entries, &key);
+}
+
+// NULL clears the pending update
+static void set_entry(const char* record_id, const struct address* address) {
+	struct outbox_entry entry = { 0 };
+
+	snprintf(entry.record_id, sizeof(entry.record_id), "%s", record_id);
+
+	if(address != NULL) {
+		entry.address = *address;
+		hashmap_set(entries, &entry);
+	}
+	else {
+		hashmap_delete(entries, &entry);
+	}
+}
+
+// a single write, so that a line is never interleaved with another one
+static void append_line(const char* record_id, const struct address* address) {
+	char line[OUTBOX_LINE_MAX_LENGTH + 1], text[ADDRESS_MAX_TEXT_LENGTH];
+	int length = snprintf(line, sizeof(line), "%s %s\n", record_id, address != NULL ? address_format(address, text, sizeof(text)) : "-");
+
+	if(fd == -1 || write(fd, line, length) != length) {
+		log_warning("Couldn't append the update of record '%s' to the outbox", record_id);
+	}
+}
+
+static bool write_pending(const void* item, void* udata) {
+	const struct outbox_entry* entry = item;
+	FILE* file = udata;
+	char text[ADDRESS_MAX_TEXT_LENGTH];
+
+	fprintf(file, "%s %s\n", entry->record_id, address_format(&entry->address, text, sizeof(text)));
+
+	return true;
+}
+
+// rewrites the log with the pending updates only
+static bool compact(const char* path) {
+	char* temp_path = format_string("%s.tmp", (char*) path);
+	FILE* file = fopen(temp_path, "w");
+	bool written = false;
+
+	if(file != NULL) {
+		hashmap_scan(entries, write_pending, file);
+		written = fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+		written = fclose(file) == 0 && written && rename(temp_path, path) == 0;
+	}
+
+	if(!written) {
+		log_warning("Couldn't compact the outbox '%s'", path);
+	}
+
+	free(temp_path);
+
+	return written;
+}
+
+bool outbox_open(const char* path) {
+	outbox_close();
+
+	entries = hashmap_new(sizeof(struct outbox_entry), 0, random(), random(), entry_hash, entry_compare, NULL);
+
+	if(entries == NULL) {
+		log_error("Couldn't allocate the outbox");
+		return false;
+	}
+
+	FILE* file = fopen(path, "r");
+
+	if(file != NULL) {
+		char* line;
+
+		// the last line of a record wins, a line cut by a crash is ignored
+		while((line = read_line(file)) != NULL) {
+			char* separator = strchr(line, ' ');
+			struct address address;
+
+			if(separator != NULL && separator - line <= CLOUDFLARE_ID_SIZE) {
+				*separator = 0;
+
+				if(strcmp(separator + 1, "-") == 0) {
+					set_entry(line, NULL);
+				}
+				else if(address_parse(separator + 1, 0, &address)) {
+					set_entry(line, &address);
+				}
+			}
+
+			free(line);
+		}
+
+		fclose(file);
+	}
+
+	compact(path);
+
+	log_path = format_string("%s", (char*) path);
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+	if(fd == -1) {
+		log_warning("Couldn't open the outbox '%s', pending updates won't survive a restart", path);
+	}
+
+	if(hashmap_count(entries) > 0) {
+		log_status("The outbox holds %zu pending updates", hashmap_count(entries));
+	}
+
+	return fd != -1;
+}
+
+void outbox_close() {
+	if(fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	hashmap_free(entries);
+	entries = NULL;
+
+	free(log_path);
+	log_path = NULL;
+}
+
+void outbox_append(const char* record_id, const struct address* address) {
+	if(entries == NULL) {
+		return;
+	}
+
+	// only the latest address of the record is kept
+	if(find_entry(record_id) != NULL) {
+		metrics_inc(METRIC_OUTBOX_COALESCED);
+	}
+
+	set_entry(record_id, address);
+	append_line(record_id, address);
+}
+
+void outbox_sync() {
+	if(fd != -1 && fdatasync(fd) != 0) {
+		log_warning("Couldn't sync the outbox");
+	}
+}
+
+void outbox_done(const char* record_id, const struct address* address) {
+	struct outbox_entry* entry = entries != NULL ? find_entry(record_id) : NULL;
+
+	if(entry == NULL || (address != NULL && !address_equal(&entry->address, address))) {
+		return;
+	}
+
+	set_entry(record_id, NULL);
+	append_line(record_id, NULL);
+
+	// nothing left to replay, the log starts over
+	if(hashmap_count(entries) == 0 && fd != -1 && ftruncate(fd, 0) != 0) {
+		log_warning("Couldn't truncate the outbox '%s'", log_path);
+	}
+}
+
+bool outbox_pending(const char* record_id, struct address* address) {
+	struct outbox_entry* entry = entries != NULL ? find_entry(record_id) : NULL;
+
+	if(entry == NULL) {
+		return false;
+	}
+
+	*address = entry->address;
+
+	return true;
+}
+
+size_t outbox_pending_count() {
+	return entries != NULL ? hashmap_count(entries) : 0;
+}
@@ -0,0 +1,40 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "address.h"
+
+/**
+ * Opens the append-only log of the pending record updates, lines are '<record_id> <address>' when an update is queued
+ * and '<record_id> -' once it is done. Only the last line of every record counts, the log is compacted to them.
+ **/
+bool outbox_open(const char* path);
+
+void outbox_close();
+
+/**
+ * Queues the update of the record, replacing the one still pending for it
+ **/
+void outbox_append(const char* record_id, const struct address* address);
+
+/**
+ * Makes the queued updates durable, one sync for all the updates of a run
+ **/
+void outbox_sync();
+
+/**
+ * Marks the update of the record as done, unless a newer address was queued in the meantime.
+ * With NULL the pending update is dropped whatever its address (the record is known to be up to date).
+ **/
+void outbox_done(const char* record_id, const struct address* address);
+
+/**
+ * Writes the pending address of the record, returns false if there is none
+ **/
+bool outbox_pending(const char* record_id, struct address* address);
+
+size_t outbox_pending_count();
+
+#endif
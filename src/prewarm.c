@@ -0,0 +1,135 @@
+#include "prewarm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/logger.h"
+#include "metrics.h"
+
+#define PREWARM_MAX_HOSTS 16
+
+// two consecutive intervals must be within this tolerance (percent) for the cadence to be considered regular
+#define PREWARM_INTERVAL_TOLERANCE 10
+#define PREWARM_MAX_INTERVAL_SEC 3600
+
+struct prewarm_entry {
+	char host[PREWARM_HOST_MAX_LENGTH + 1];
+	double setup_ms; // 0 when there is nothing pending
+};
+
+static struct prewarm_entry entries[PREWARM_MAX_HOSTS];
+static size_t entries_count = 0;
+
+static long lead_ms = 0;
+static struct timespec last_run;
+static long last_interval_ms = -1, interval_ms = -1;
+static bool has_run = false, done = false;
+
+static inline long timespec_diff_ms(const struct timespec* a, const struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+void prewarm_configure(long new_lead_ms) {
+	lead_ms = new_lead_ms > 0 ? new_lead_ms : 0;
+}
+
+void prewarm_run_started(bool regular) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	done = false;
+
+	if(!regular) {
+		return;
+	}
+
+	if(has_run) {
+		long current = timespec_diff_ms(&now, &last_run);
+		long difference = current > last_interval_ms ? current - last_interval_ms : last_interval_ms - current;
+
+		// runs triggered by a regular schedule (like the crontab entry) are predictable
+		interval_ms = last_interval_ms > 0 && difference * 100 <= last_interval_ms * PREWARM_INTERVAL_TOLERANCE
+			&& current <= PREWARM_MAX_INTERVAL_SEC * 1000L ? current : -1;
+		last_interval_ms = current;
+	}
+
+	last_run = now;
+	has_run = true;
+}
+
+void prewarm_uplink_changed() {
+	done = false;
+}
+
+long prewarm_due_in_ms(long run_ms) {
+	long due = -1;
+
+	if(lead_ms == 0 || done) {
+		return -1;
+	}
+
+	if(interval_ms > lead_ms) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		due = interval_ms - lead_ms - timespec_diff_ms(&now, &last_run);
+		due = due > 0 ? due : 0;
+	}
+
+	// a run of the triggers is known in advance, even when it is closer than the lead
+	if(run_ms >= 0 && (due < 0 || run_ms - lead_ms < due)) {
+		due = run_ms > lead_ms ? run_ms - lead_ms : 0;
+	}
+
+	return due;
+}
+
+void prewarm_done() {
+	done = true;
+}
+
+static struct prewarm_entry* find_entry(const char* host) {
+	for(size_t i = 0; i < entries_count; ++i) {
+		if(strcmp(entries[i].host, host) == 0) {
+			return entries + i;
+		}
+	}
+
+	if(entries_count >= PREWARM_MAX_HOSTS) {
+		return NULL;
+	}
+
+	struct prewarm_entry* entry = entries + entries_count++;
+
+	snprintf(entry->host, sizeof(entry->host), "%s", host);
+	entry->setup_ms = 0;
+
+	return entry;
+}
+
+void prewarm_record(const char* host, double setup_ms) {
+	struct prewarm_entry* entry = find_entry(host);
+
+	if(entry != NULL) {
+		entry->setup_ms = setup_ms;
+	}
+}
+
+void prewarm_account(const char* host, bool reused) {
+	struct prewarm_entry* entry = find_entry(host);
+
+	if(entry == NULL || entry->setup_ms == 0) {
+		return;
+	}
+
+	if(reused) {
+		metrics_add(METRIC_PREWARM_SAVED_MS, entry->setup_ms);
+		log_debug("The prewarmed connection to '%s' saved %.1f ms", host, entry->setup_ms);
+	}
+	else {
+		log_debug("The prewarmed connection to '%s' was not reused", host);
+	}
+
+	entry->setup_ms = 0;
+}
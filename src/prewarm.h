@@ -0,0 +1,46 @@
+#ifndef PREWARM_H
+#define PREWARM_H 1
+
+#include <stdbool.h>
+
+#define PREWARM_HOST_MAX_LENGTH 255
+
+/**
+ * Lead time of the prewarm before the predicted run, 0 disables it
+ **/
+void prewarm_configure(long lead_ms);
+
+/**
+ * To be called when a run starts, the time between the regular runs (those of the external timer) is used to predict
+ * the next one
+ **/
+void prewarm_run_started(bool regular);
+
+/**
+ * To be called when the uplink changed, the connections opened so far may not work anymore and are opened again
+ * before the next run
+ **/
+void prewarm_uplink_changed();
+
+/**
+ * Milliseconds until the connections should be prewarmed, for the predicted run or for the one already scheduled to
+ * start in run_ms (-1 if none), -1 if there is nothing to do for the current cycle
+ **/
+long prewarm_due_in_ms(long run_ms);
+
+/**
+ * Marks the prewarm of the current cycle as done
+ **/
+void prewarm_done();
+
+/**
+ * Stores the connection setup time paid by the prewarm call to the host
+ **/
+void prewarm_record(const char* host, double setup_ms);
+
+/**
+ * Called for every call of a run, the setup time paid by the prewarm is counted as saved if the call reused the connection
+ **/
+void prewarm_account(const char* host, bool reused);
+
+#endif
@@ -0,0 +1,230 @@
+#include "providers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "lib/logger.h"
+#include "address.h"
+#include "metrics.h"
+
+// weight of the newest sample in the moving averages
+#define PROVIDER_EWMA_ALPHA 0.2
+// a failed call costs about as much as a call cut by the timeout
+#define PROVIDER_ERROR_PENALTY_MS 5000
+#define PROVIDER_EXPLORE_PERCENT 10
+
+// only the configured providers are contacted, the defaults are the single service the daemon always used
+static const struct {
+	int family;
+	const char* url;
+} DEFAULT_PROVIDERS[] = {
+	{ AF_INET, "http://api.ipify.org/?format=text" },
+	{ AF_INET6, "http://api6.ipify.org/?format=text" }
+};
+
+static struct provider providers[PROVIDERS_MAX];
+static size_t provider_count = 0;
+
+// the same url can serve both families (stun), each has its own statistics
+static struct provider* find_provider(struct provider* list, size_t count, int family, const char* url) {
+	for(size_t i = 0; i < count; ++i) {
+		if(list[i].family == family && strcmp(list[i].url, url) == 0) {
+			return list + i;
+		}
+	}
+
+	return NULL;
+}
+
+static void add_provider(struct provider* list, size_t* count, int family, const char* url) {
+	if(family == AF_INET6 && strncmp(url, "natpmp://", strlen("natpmp://")) == 0) {
+		log_warning("Discovery provider '%s' ignored, nat-pmp only knows the ipv4 address", url);
+		return;
+	}
+
+	if(*count >= PROVIDERS_MAX || strlen(url) > PROVIDER_URL_MAX_LENGTH) {
+		log_warning("Discovery provider '%s' ignored, too many providers or url too long", url);
+		return;
+	}
+
+	struct provider* known = find_provider(providers, provider_count, family, url);
+
+	list[*count] = known != NULL ? *known : (struct provider) { .family = family };
+	strcpy(list[*count].url, url);
+	++*count;
+}
+
+static bool has_family(struct provider* list, size_t count, int family) {
+	for(size_t i = 0; i < count; ++i) {
+		if(list[i].family == family) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void providers_load(struct property* properties) {
+	struct provider loaded[PROVIDERS_MAX];
+	size_t count = 0;
+
+	for(struct property* property = find_property(properties, "PROVIDER"); property != NULL; property = find_property(property + 1, "PROVIDER")) {
+		char* separator = strchr(property->value, ',');
+
+		if(separator != NULL && strncmp(property->value, "A,", 2) == 0) {
+			add_provider(loaded, &count, AF_INET, separator + 1);
+		}
+		else if(separator != NULL && strncmp(property->value, "AAAA,", 5) == 0) {
+			add_provider(loaded, &count, AF_INET6, separator + 1);
+		}
+		else {
+			log_warning("Invalid PROVIDER '%s', expected '<A|AAAA>,<url>'", property->value);
+		}
+	}
+
+	bool configured_v4 = has_family(loaded, count, AF_INET),
+		configured_v6 = has_family(loaded, count, AF_INET6);
+
+	for(size_t i = 0; i < sizeof(DEFAULT_PROVIDERS) / sizeof(DEFAULT_PROVIDERS[0]); ++i) {
+		int family = DEFAULT_PROVIDERS[i].family;
+
+		if((family == AF_INET && !configured_v4) || (family == AF_INET6 && !configured_v6)) {
+			add_provider(loaded, &count, family, DEFAULT_PROVIDERS[i].url);
+		}
+	}
+
+	memcpy(providers, loaded, count * sizeof(struct provider));
+	provider_count = count;
+}
+
+struct provider* providers_get(size_t* count) {
+	*count = provider_count;
+
+	return providers;
+}
+
+// expected cost of a call, providers without samples come first so that all of them get tried
+static inline double provider_cost(const struct provider* provider) {
+	return provider->samples == 0 ? -1 : provider->latency_ms + provider->error_rate * PROVIDER_ERROR_PENALTY_MS;
+}
+
+static int compare_providers(const void* a, const void* b) {
+	double cost_a = provider_cost(*(struct provider* const*) a),
+		cost_b = provider_cost(*(struct provider* const*) b);
+
+	return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+static size_t sorted_providers(int family, struct provider** ranked, size_t max) {
+	size_t count = 0;
+
+	for(size_t i = 0; i < provider_count && count < max; ++i) {
+		if(providers[i].family == family) {
+			ranked[count++] = providers + i;
+		}
+	}
+
+	qsort(ranked, count, sizeof(struct provider*), compare_providers);
+
+	return count;
+}
+
+size_t providers_rank(int family, struct provider** ranked, size_t max) {
+	size_t count = sorted_providers(family, ranked, max);
+
+	if(count > 1 && random() % 100 < PROVIDER_EXPLORE_PERCENT) {
+		size_t explored = 1 + random() % (count - 1);
+		struct provider* provider = ranked[explored];
+
+		memmove(ranked + 1, ranked, explored * sizeof(struct provider*));
+		ranked[0] = provider;
+
+		log_debug("Exploring the discovery provider '%s'", provider->url);
+		metrics_inc(METRIC_PROVIDER_EXPLORATIONS);
+	}
+
+	return count;
+}
+
+struct provider* providers_best(int family) {
+	struct provider* ranked[PROVIDERS_MAX];
+
+	return sorted_providers(family, ranked, PROVIDERS_MAX) > 0 ? ranked[0] : NULL;
+}
+
+void providers_record(struct provider* provider, bool success, double latency_ms) {
+	if(provider->samples++ == 0) {
+		provider->latency_ms = success ? latency_ms : PROVIDER_ERROR_PENALTY_MS;
+		provider->error_rate = success ? 0 : 1;
+		return;
+	}
+
+	if(success) {
+		provider->latency_ms += PROVIDER_EWMA_ALPHA * (latency_ms - provider->latency_ms);
+	}
+
+	provider->error_rate += PROVIDER_EWMA_ALPHA * ((success ? 0 : 1) - provider->error_rate);
+}
+
+void providers_read_state(const char* path) {
+	FILE* file = fopen(path, "r");
+
+	// if it can't be opened nothing was learned yet
+	if(file == NULL) {
+		return;
+	}
+
+	char* line;
+
+	while((line = read_line(file)) != NULL) {
+		char type[5], url[PROVIDER_URL_MAX_LENGTH + 1];
+		double latency_ms, error_rate;
+		unsigned long samples;
+		struct provider* provider;
+
+		// the lines without the type, written by older versions, are skipped and their statistics learned again
+		if(sscanf(line, "%4s %255s %lf %lf %lu", type, url, &latency_ms, &error_rate, &samples) == 5
+				&& (strcmp(type, "A") == 0 || strcmp(type, "AAAA") == 0)
+				&& (provider = find_provider(providers, provider_count, strcmp(type, "A") == 0 ? AF_INET : AF_INET6, url)) != NULL) {
+			provider->latency_ms = latency_ms;
+			provider->error_rate = error_rate;
+			provider->samples = samples;
+		}
+
+		free(line);
+	}
+
+	fclose(file);
+}
+
+bool providers_write_state(const char* path) {
+	char* temp_path = format_string("%s.tmp", (char*) path);
+	FILE* file = fopen(temp_path, "w");
+
+	if(file == NULL) {
+		log_warning("Couldn't write the discovery provider statistics to '%s'", temp_path);
+		free(temp_path);
+		return false;
+	}
+
+	for(size_t i = 0; i < provider_count; ++i) {
+		if(providers[i].samples > 0) {
+			fprintf(file, "%s %s %.3f %.6f %lu\n", address_record_type(providers[i].family), providers[i].url, providers[i].latency_ms, providers[i].error_rate, providers[i].samples);
+		}
+	}
+
+	fclose(file);
+
+	bool written = rename(temp_path, path) == 0;
+
+	if(!written) {
+		log_warning("Couldn't replace the discovery provider statistics file '%s'", path);
+	}
+
+	free(temp_path);
+
+	return written;
+}
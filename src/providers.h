@@ -0,0 +1,52 @@
+#ifndef PROVIDERS_H
+#define PROVIDERS_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+#define PROVIDER_URL_MAX_LENGTH 255
+#define PROVIDERS_MAX 16
+
+/**
+ * External address discovery endpoint with the moving averages of its latency and of its error rate
+ **/
+struct provider {
+	char url[PROVIDER_URL_MAX_LENGTH + 1];
+	int family;
+	double latency_ms; // exponentially weighted moving average of the successful calls
+	double error_rate; // exponentially weighted moving average, 1 for a failed call and 0 for a successful one
+	unsigned long samples;
+};
+
+/**
+ * Replaces the providers with the 'PROVIDER=<A|AAAA>,<url>' properties, the defaults are used for the families without any.
+ * Providers that were already known keep their statistics.
+ **/
+void providers_load(struct property* properties);
+
+struct provider* providers_get(size_t* count);
+
+/**
+ * Writes the providers of the family in the order they should be tried, the best first.
+ * Every now and then another provider is moved to the front to keep its statistics up to date.
+ * Returns the number of providers written.
+ **/
+size_t providers_rank(int family, struct provider** ranked, size_t max);
+
+/**
+ * Best provider of the family without exploration, NULL if there is none
+ **/
+struct provider* providers_best(int family);
+
+void providers_record(struct provider* provider, bool success, double latency_ms);
+
+/**
+ * Restores the statistics persisted by providers_write_state, lines are '<A|AAAA> <url> <latency_ms> <error_rate> <samples>'
+ **/
+void providers_read_state(const char* path);
+
+bool providers_write_state(const char* path);
+
+#endif
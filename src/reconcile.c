@@ -0,0 +1,450 @@
+#include "reconcile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <curl/curl.h>
+
+#include "lib/json_stream.h"
+#include "lib/logger.h"
+#include "http.h"
+#include "metrics.h"
+#include "records.h"
+#include "scheduler.h"
+#include "utils.h"
+
+#define CLOUDFLARE_DNS_LIST_URL "https://" CLOUDFLARE_API_HOST "/client/v4/zones/%s/dns_records?per_page=%d&page=%ld"
+#define CLOUDFLARE_ZONE_LIST_URL "https://" CLOUDFLARE_API_HOST "/client/v4/zones?per_page=%d&page=%ld"
+
+#define RECONCILE_PAGE_SIZE 100
+#define RECONCILE_ZONE_PAGE_SIZE 50 // the maximum of the zone list
+#define RECONCILE_MAX_PAGES 64 // all zones together
+#define RECONCILE_MAX_PARALLEL 4
+#define RECONCILE_MAX_ATTEMPTS 2
+#define RECONCILE_POLL_MS 1000
+
+enum page_state {
+	PAGE_PENDING,
+	PAGE_RUNNING,
+	PAGE_DONE,
+	PAGE_FAILED
+};
+
+enum page_kind {
+	PAGE_ZONES, // to find the zones of the records set by name
+	PAGE_RECORDS
+};
+
+struct page {
+	enum page_kind kind;
+	const char* zone_id; // empty for the zone list
+	long number;
+	enum page_state state;
+	unsigned int attempts;
+	CURL* handle;
+	struct json_stream stream;
+	// fields of the zone or record object being read
+	char id[CLOUDFLARE_ID_SIZE + 1];
+	char name[JSON_STREAM_MAX_VALUE_LENGTH + 1];
+	char type[8];
+	char content[JSON_STREAM_MAX_VALUE_LENGTH + 1];
+	long total_pages;
+	bool success;
+	struct rate_limit_headers limits;
+};
+
+static struct page pages[RECONCILE_MAX_PAGES];
+// one per record, allocated for the scope of reconcile_records
+static bool* listed;
+static size_t* zone_match_length; // of the longest zone name found for the records set by name
+
+// true if name is zone or one of its subdomains
+static bool in_zone(const char* name, const char* zone) {
+	size_t name_length = strlen(name), zone_length = strlen(zone);
+
+	return zone_length > 0 && name_length >= zone_length && strcasecmp(name + name_length - zone_length, zone) == 0
+		&& (name_length == zone_length || name[name_length - zone_length - 1] == '.');
+}
+
+static char* page_url(const struct page* page) {
+	if(page->kind == PAGE_ZONES) {
+		return reg_ptr(format_string(CLOUDFLARE_ZONE_LIST_URL, RECONCILE_ZONE_PAGE_SIZE, page->number));
+	}
+
+	return reg_ptr(format_string(CLOUDFLARE_DNS_LIST_URL, (char*) page->zone_id, RECONCILE_PAGE_SIZE, page->number));
+}
+
+// a zone of the list is complete, it becomes the zone of the records set by name it contains
+static void apply_zone(struct page* page) {
+	size_t count;
+	struct record* records = records_get(&count);
+
+	for(size_t i = 0; i < count; ++i) {
+		if(records[i].by_name && records[i].record_id[0] == 0 && in_zone(records[i].name, page->name)
+				&& strlen(page->name) > zone_match_length[i] && strlen(page->id) <= CLOUDFLARE_ID_SIZE) {
+			strcpy(records[i].zone_id, page->id);
+			zone_match_length[i] = strlen(page->name);
+		}
+	}
+}
+
+// two names of the config can't take the same record of a round robin
+static bool id_taken(const char* id) {
+	size_t count;
+	struct record* records = records_get(&count);
+
+	for(size_t i = 0; i < count; ++i) {
+		if(strcmp(records[i].record_id, id) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// a record of the page is complete
+static void apply_record(struct page* page) {
+	size_t count;
+	struct record* records = records_get(&count);
+
+	for(size_t i = 0; i < count; ++i) {
+		if(strcmp(records[i].zone_id, page->zone_id) != 0) {
+			continue;
+		}
+
+		if(records[i].by_name && records[i].record_id[0] == 0 && strcasecmp(records[i].name, page->name) == 0
+				&& strcmp(address_record_type(records[i].family), page->type) == 0 && strlen(page->id) <= CLOUDFLARE_ID_SIZE && !id_taken(page->id)) {
+			log_status("Resolved the %s record '%s' to the id '%s'", page->type, records[i].name, page->id);
+			strcpy(records[i].record_id, page->id);
+		}
+
+		if(strcmp(records[i].record_id, page->id) != 0) {
+			continue;
+		}
+
+		struct address address;
+
+		// a content that isn't an address of the family can only be fixed by an update
+		if(!address_parse(page->content, records[i].family, &address)) {
+			address = (struct address) { 0 };
+		}
+
+		if(!address_equal(&records[i].published, &address)) {
+			log_status("The %s record '%s' holds '%s', not the address of the state file", address_record_type(records[i].family), records[i].record_id, page->content);
+		}
+
+		records[i].published = address;
+		listed[i] = true;
+	}
+}
+
+// '{"result":[{"id":"...","name":"...","type":"...","content":"...",...},...],"result_info":{"total_pages":3,...},"success":true}'
+static void page_value(struct json_stream* stream, const char* value, bool string) {
+	struct page* page = stream->userdata;
+
+	if(stream->depth == 1 && strcmp(stream->key, "success") == 0) {
+		page->success = !string && strcmp(value, "true") == 0;
+	}
+	else if(stream->depth == 2 && strcmp(stream->keys[2], "result_info") == 0 && strcmp(stream->key, "total_pages") == 0) {
+		page->total_pages = strtol(value, NULL, 10);
+	}
+	else if(stream->depth == 3 && strcmp(stream->keys[2], "result") == 0 && string) {
+		if(strcmp(stream->key, "id") == 0) {
+			snprintf(page->id, sizeof(page->id), "%s", value);
+		}
+		else if(strcmp(stream->key, "name") == 0) {
+			snprintf(page->name, sizeof(page->name), "%s", value);
+		}
+		else if(strcmp(stream->key, "type") == 0) {
+			snprintf(page->type, sizeof(page->type), "%s", value);
+		}
+		else if(strcmp(stream->key, "content") == 0) {
+			snprintf(page->content, sizeof(page->content), "%s", value);
+		}
+	}
+}
+
+static void page_close(struct json_stream* stream) {
+	struct page* page = stream->userdata;
+
+	if(stream->depth == 3 && stream->objects[3] && strcmp(stream->keys[2], "result") == 0) {
+		if(page->kind == PAGE_ZONES) {
+			apply_zone(page);
+		}
+		else {
+			apply_record(page);
+		}
+
+		page->id[0] = 0;
+		page->name[0] = 0;
+		page->type[0] = 0;
+		page->content[0] = 0;
+	}
+}
+
+// the records are applied while the body arrives, nothing of it is kept
+static size_t page_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata) {
+	struct page* page = userdata;
+	size_t size = itemSize * itemCount;
+
+	json_stream_feed(&page->stream, buffer, size);
+
+	return size;
+}
+
+static struct page* add_page(size_t* count, enum page_kind kind, const char* zone_id, long number) {
+	if(*count >= RECONCILE_MAX_PAGES) {
+		return NULL;
+	}
+
+	struct page* page = pages + (*count)++;
+
+	*page = (struct page) {
+		.kind = kind,
+		.zone_id = zone_id,
+		.number = number,
+		.state = PAGE_PENDING
+	};
+
+	return page;
+}
+
+static bool start_page(CURLM* multi, struct page* page, CURL* handle, const char* token, struct curl_slist* headers) {
+	char* url = page_url(page);
+	struct circuit_breaker* circuit = circuit_for_url(url);
+
+	if(!circuit_allow(circuit)) {
+		log_error("Listing the %s%s skipped, the circuit for the host is open", page->kind == PAGE_ZONES ? "zones" : "records of zone ", page->zone_id);
+		page->state = PAGE_FAILED;
+		return false;
+	}
+
+	if(!scheduler_acquire(token, page->zone_id)) {
+		circuit_release(circuit);
+		page->state = PAGE_FAILED;
+		return false;
+	}
+
+	page->handle = handle;
+	page->success = false;
+	page->limits = (struct rate_limit_headers) { -1, -1, -1, -1, -1 };
+	json_stream_init(&page->stream, page_value, page_close, page);
+
+	setup_call(handle, url, page_callback, page);
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, rate_limit_header_callback);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, &page->limits);
+	curl_multi_add_handle(multi, handle);
+
+	metrics_inc(METRIC_RECONCILE_PAGES);
+	page->state = PAGE_RUNNING;
+
+	return true;
+}
+
+static void complete_page(CURLM* multi, struct page* page, CURLcode result, const char* token) {
+	char* url = page_url(page);
+	struct circuit_breaker* circuit = circuit_for_url(url);
+	struct call_info info;
+
+	read_call_info(page->handle, &info);
+	curl_multi_remove_handle(multi, page->handle);
+	curl_easy_reset(page->handle);
+	page->handle = NULL;
+
+	scheduler_update(token, &page->limits);
+
+	if(result == CURLE_OK && page->success && !page->stream.failed) {
+		circuit_success(circuit);
+		record_call_latency(url, &info);
+		page->state = PAGE_DONE;
+		return;
+	}
+
+	log_warning("Call to list the %s%s failed (curl result = '%s', http status = %ld)", page->kind == PAGE_ZONES ? "zones" : "records of zone ", page->zone_id, curl_easy_strerror(result), info.http_status);
+
+	// the records already applied stay, the page is read again from the start
+	page->state = report_call_failure(circuit, result, &info) && ++page->attempts < RECONCILE_MAX_ATTEMPTS ? PAGE_PENDING : PAGE_FAILED;
+}
+
+/**
+ * Fetches the pages concurrently, with at most RECONCILE_MAX_PARALLEL calls in flight
+ **/
+static void fetch_pages(struct page* batch, size_t count, const char* token, struct curl_slist* headers) {
+	CURLM* multi = curl_multi_init();
+	CURL* handles[RECONCILE_MAX_PARALLEL] = { NULL };
+	bool used[RECONCILE_MAX_PARALLEL] = { false };
+
+	if(multi == NULL) {
+		return;
+	}
+
+	for(;;) {
+		size_t running = 0;
+
+		for(size_t i = 0; i < count; ++i) {
+			if(batch[i].state == PAGE_RUNNING) {
+				++running;
+			}
+		}
+
+		for(size_t i = 0; i < count && running < RECONCILE_MAX_PARALLEL; ++i) {
+			if(batch[i].state != PAGE_PENDING) {
+				continue;
+			}
+
+			size_t slot = 0;
+
+			while(used[slot]) {
+				++slot;
+			}
+
+			if(handles[slot] == NULL && (handles[slot] = curl_easy_init()) == NULL) {
+				batch[i].state = PAGE_FAILED;
+				continue;
+			}
+
+			if(start_page(multi, batch + i, handles[slot], token, headers)) {
+				used[slot] = true;
+				++running;
+			}
+		}
+
+		if(running == 0) {
+			break;
+		}
+
+		int still_running;
+		curl_multi_perform(multi, &still_running);
+
+		CURLMsg* message;
+		int queued;
+		bool completed = false;
+
+		while((message = curl_multi_info_read(multi, &queued)) != NULL) {
+			if(message->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			for(size_t i = 0; i < count; ++i) {
+				if(batch[i].state == PAGE_RUNNING && batch[i].handle == message->easy_handle) {
+					for(size_t slot = 0; slot < RECONCILE_MAX_PARALLEL; ++slot) {
+						if(handles[slot] == message->easy_handle) {
+							used[slot] = false;
+						}
+					}
+
+					complete_page(multi, batch + i, message->data.result, token);
+					completed = true;
+					break;
+				}
+			}
+		}
+
+		// the freed handles take the next pages right away
+		if(!completed) {
+			curl_multi_poll(multi, NULL, 0, RECONCILE_POLL_MS, NULL);
+		}
+	}
+
+	for(size_t slot = 0; slot < RECONCILE_MAX_PARALLEL; ++slot) {
+		curl_easy_cleanup(handles[slot]);
+	}
+
+	curl_multi_cleanup(multi);
+}
+
+/**
+ * Fetches the first pages from start to page_count, then all the other pages they announce at once
+ * Returns true if every page was listed
+ **/
+static bool fetch_listing(size_t start, size_t* page_count, const char* token, struct curl_slist* headers) {
+	size_t first_count = *page_count;
+	bool complete = true;
+
+	fetch_pages(pages + start, first_count - start, token, headers);
+
+	for(size_t i = start; i < first_count; ++i) {
+		if(pages[i].state != PAGE_DONE) {
+			complete = false;
+			continue;
+		}
+
+		for(long number = 2; number <= pages[i].total_pages; ++number) {
+			if(add_page(page_count, pages[i].kind, pages[i].zone_id, number) == NULL) {
+				log_warning("Too many pages to list, the %s%s are only partly listed (max %d pages)", pages[i].kind == PAGE_ZONES ? "zones" : "records of zone ", pages[i].zone_id, RECONCILE_MAX_PAGES);
+				complete = false;
+				break;
+			}
+		}
+	}
+
+	fetch_pages(pages + first_count, *page_count - first_count, token, headers);
+
+	for(size_t i = first_count; i < *page_count; ++i) {
+		complete = complete && pages[i].state == PAGE_DONE;
+	}
+
+	return complete;
+}
+
+bool reconcile_records(const char* token) {
+	size_t record_count, page_count = 0;
+	struct record* records = records_get(&record_count);
+	bool complete = true, unknown_zones = false;
+
+	struct curl_slist* headers = curl_slist_append(NULL, reg_ptr(format_string(CLOUDFLARE_AUTHORIZATION_HEADER, (char*) token)));
+	reg_ptr_fn(headers, (void (*)(void *)) curl_slist_free_all);
+
+	listed = reg_ptr(calloc(record_count + 1, sizeof(bool)));
+	zone_match_length = reg_ptr(calloc(record_count + 1, sizeof(size_t)));
+
+	if(listed == NULL || zone_match_length == NULL) {
+		log_error("Couldn't allocate the reconciliation of %zu records", record_count);
+		return false;
+	}
+
+	for(size_t i = 0; i < record_count; ++i) {
+		unknown_zones = unknown_zones || records[i].zone_id[0] == 0;
+	}
+
+	// the zones of the records set by name are found in the zone list, the records in the zones like the others
+	if(unknown_zones) {
+		add_page(&page_count, PAGE_ZONES, "", 1);
+		complete = fetch_listing(0, &page_count, token, headers);
+	}
+
+	size_t records_start = page_count;
+
+	// the first page of every zone tells how many there are
+	for(size_t i = 0; i < record_count; ++i) {
+		bool known = records[i].zone_id[0] == 0;
+
+		for(size_t j = records_start; j < page_count && !known; ++j) {
+			known = strcmp(pages[j].zone_id, records[i].zone_id) == 0;
+		}
+
+		if(!known) {
+			add_page(&page_count, PAGE_RECORDS, records[i].zone_id, 1);
+		}
+	}
+
+	if(page_count > records_start) {
+		complete = fetch_listing(records_start, &page_count, token, headers) && complete;
+	}
+
+	for(size_t i = 0; i < record_count; ++i) {
+		if(records[i].record_id[0] == 0) {
+			log_error("Couldn't find the %s record '%s' in the zones of the token", address_record_type(records[i].family), records[i].name);
+		}
+		else if(!listed[i] && complete) {
+			log_warning("The record '%s' is not in the records of zone '%s'", records[i].record_id, records[i].zone_id);
+		}
+	}
+
+	log_debug("Listed %zu pages, %s", page_count, complete ? "all the records are reconciled" : "some records keep the state file address");
+
+	return complete;
+}
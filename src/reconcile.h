@@ -0,0 +1,13 @@
+#ifndef RECONCILE_H
+#define RECONCILE_H 1
+
+#include <stdbool.h>
+
+/**
+ * Lists every record of the configured zones (pages fetched concurrently and parsed as they arrive) and replaces the
+ * published address of the configured records with the content the api really holds, so that the next comparison only
+ * patches the mismatches. Returns true if all the pages were listed.
+ **/
+bool reconcile_records(const char* token);
+
+#endif
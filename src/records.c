@@ -0,0 +1,425 @@
+#include "records.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sysexits.h>
+
+#include "lib/hashmap.h"
+#include "lib/logger.h"
+#include "metrics.h"
+
+// grows with the config, the pointers are valid until the next load
+static struct record* records = NULL;
+static size_t record_count = 0, record_allocated = 0;
+
+static bool add_record(int family, const char* zone_id, const char* record_id, const char* interface, const char* name) {
+	// the records set by name get their ids later
+	if(zone_id != NULL && (strlen(zone_id) == 0 || strlen(zone_id) > CLOUDFLARE_ID_SIZE || strlen(record_id) == 0 || strlen(record_id) > CLOUDFLARE_ID_SIZE)) {
+		log_warning("Invalid zone id '%s' or record id '%s'", zone_id, record_id);
+		return false;
+	}
+
+	if(interface != NULL && strlen(interface) > RECORD_INTERFACE_MAX_LENGTH) {
+		log_warning("Invalid interface '%s' for record '%s'", interface, record_id);
+		return false;
+	}
+
+	if(name != NULL && strlen(name) > RECORD_NAME_MAX_LENGTH) {
+		log_warning("Invalid name '%s' for record '%s'", name, record_id);
+		return false;
+	}
+
+	if(record_count >= record_allocated) {
+		record_allocated = record_allocated > 0 ? record_allocated * 2 : 16;
+		records = realloc(records, record_allocated * sizeof(struct record));
+
+		if(records == NULL) {
+			log_error("Couldn't allocate the %zu records of the configuration", record_allocated);
+			exit(EX_OSERR);
+		}
+	}
+
+	struct record* record = records + record_count++;
+
+	*record = (struct record) { .family = family, .by_name = zone_id == NULL };
+
+	if(zone_id != NULL) {
+		strcpy(record->zone_id, zone_id);
+		strcpy(record->record_id, record_id);
+	}
+
+	if(interface != NULL) {
+		strcpy(record->interface, interface);
+	}
+
+	if(name != NULL) {
+		strcpy(record->name, name);
+	}
+
+	return true;
+}
+
+static int parse_type(const char* type) {
+	return strcmp(type, "A") == 0 ? AF_INET : strcmp(type, "AAAA") == 0 ? AF_INET6 : 0;
+}
+
+// parses '<A|AAAA>,<zone_id>,<record_id>[,[<interface>][,<name>]]'
+static bool parse_record(const char* text, const char* default_interface) {
+	char fields[5][RECORD_NAME_MAX_LENGTH + 1] = { { 0 } };
+	size_t count = 0;
+
+	for(const char* field = text; count < 5; ++count) {
+		const char* end = strchr(field, ',');
+		size_t length = end != NULL ? (size_t) (end - field) : strlen(field);
+
+		if(length > RECORD_NAME_MAX_LENGTH) {
+			return false;
+		}
+
+		memcpy(fields[count], field, length);
+
+		if(end == NULL) {
+			break;
+		}
+
+		field = end + 1;
+	}
+
+	// more than five fields
+	if(count == 5 || count < 2) {
+		return false;
+	}
+
+	const char* interface = count >= 3 && fields[3][0] != 0 ? fields[3] : default_interface;
+	const char* name = count == 4 && fields[4][0] != 0 ? fields[4] : NULL;
+
+	return parse_type(fields[0]) != 0 && add_record(parse_type(fields[0]), fields[1], fields[2], interface, name);
+}
+
+// parses '<A|AAAA>,<name>[,<interface>]'
+static bool parse_host(const char* text, const char* default_interface) {
+	char type[5], name[RECORD_NAME_MAX_LENGTH + 1], interface[RECORD_INTERFACE_MAX_LENGTH + 1];
+	char rest;
+	int fields = sscanf(text, "%4[^,],%253[^,],%45[^,]%c", type, name, interface, &rest);
+
+	if((fields != 2 && fields != 3) || parse_type(type) == 0) {
+		return false;
+	}
+
+	return add_record(parse_type(type), NULL, NULL, fields == 3 ? interface : default_interface, name);
+}
+
+size_t records_load(struct property* properties) {
+	char *zone_id = get_property_value(properties, "ZONE_ID"),
+		*record_id = get_property_value(properties, "RECORD_ID"),
+		*record_id_aaaa = get_property_value(properties, "RECORD_ID_AAAA"),
+		*interface = get_property_value(properties, "INTERFACE"),
+		*name = get_property_value(properties, "RECORD_NAME");
+
+	record_count = 0;
+
+	if(zone_id != NULL && record_id != NULL) {
+		add_record(AF_INET, zone_id, record_id, interface, name);
+	}
+
+	if(zone_id != NULL && record_id_aaaa != NULL) {
+		add_record(AF_INET6, zone_id, record_id_aaaa, interface, name);
+	}
+
+	for(struct property* property = find_property(properties, "RECORD"); property != NULL; property = find_property(property + 1, "RECORD")) {
+		if(!parse_record(property->value, interface)) {
+			log_warning("Invalid RECORD '%s', expected '<A|AAAA>,<zone_id>,<record_id>[,[<interface>][,<name>]]'", property->value);
+		}
+	}
+
+	for(struct property* property = find_property(properties, "HOST"); property != NULL; property = find_property(property + 1, "HOST")) {
+		if(!parse_host(property->value, interface)) {
+			log_warning("Invalid HOST '%s', expected '<A|AAAA>,<name>[,<interface>]'", property->value);
+		}
+	}
+
+	return record_count;
+}
+
+struct record* records_get(size_t* count) {
+	*count = record_count;
+
+	return records;
+}
+
+bool records_need_family(int family) {
+	for(size_t i = 0; i < record_count; ++i) {
+		if(records[i].family == family) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Records indexed for a single read of a file: by id, or by family and name (case insensitive) for the ones set by name.
+ * The records sharing a key are chained through next, the index is built again for every read since the ids change.
+ **/
+struct record_index {
+	struct hashmap* map;
+	size_t* next;
+};
+
+struct index_entry {
+	const char* key;
+	int family; // 0 in the index by id
+	size_t first;
+};
+
+static uint64_t id_hash(const void* item, uint64_t seed0, uint64_t seed1) {
+	const char* key = ((const struct index_entry*) item)->key;
+	return hashmap_sip(key, strlen(key), seed0, seed1);
+}
+
+static int id_compare(const void* a, const void* b, void* udata) {
+	(void) udata;
+	return strcmp(((const struct index_entry*) a)->key, ((const struct index_entry*) b)->key);
+}
+
+static uint64_t name_hash(const void* item, uint64_t seed0, uint64_t seed1) {
+	const struct index_entry* entry = item;
+	char lower[RECORD_NAME_MAX_LENGTH + 1];
+	size_t length = 0;
+
+	for(; entry->key[length] != 0 && length < RECORD_NAME_MAX_LENGTH; ++length) {
+		lower[length] = tolower((unsigned char) entry->key[length]);
+	}
+
+	return hashmap_sip(lower, length, seed0, seed1) ^ (uint64_t) entry->family;
+}
+
+static int name_compare(const void* a, const void* b, void* udata) {
+	const struct index_entry *first = a, *second = b;
+
+	(void) udata;
+	return first->family != second->family ? first->family - second->family : strcasecmp(first->key, second->key);
+}
+
+static void index_build(struct record_index* index, bool by_name) {
+	index->map = hashmap_new(sizeof(struct index_entry), record_count, random(), random(),
+		by_name ? name_hash : id_hash, by_name ? name_compare : id_compare, NULL);
+	index->next = malloc((record_count + 1) * sizeof(size_t));
+
+	if(index->map == NULL || index->next == NULL) {
+		log_error("Couldn't allocate the index of the %zu records", record_count);
+		exit(EX_OSERR);
+	}
+
+	// built backwards so that every chain is in the order of the configuration
+	for(size_t i = record_count; i-- > 0;) {
+		struct index_entry entry = {
+			.key = by_name ? records[i].name : records[i].record_id,
+			.family = by_name ? records[i].family : 0,
+			.first = i
+		};
+
+		if((by_name && !records[i].by_name) || entry.key[0] == 0) {
+			continue;
+		}
+
+		const struct index_entry* replaced = hashmap_set(index->map, &entry);
+
+		if(replaced == NULL && hashmap_oom(index->map)) {
+			log_error("Couldn't allocate the index of the %zu records", record_count);
+			exit(EX_OSERR);
+		}
+
+		index->next[i] = replaced != NULL ? replaced->first : record_count;
+	}
+}
+
+// first record with the key, record_count if there is none
+static size_t index_find(const struct record_index* index, int family, const char* key) {
+	const struct index_entry* entry = hashmap_get(index->map, &(struct index_entry) { .key = key, .family = family });
+
+	return entry != NULL ? entry->first : record_count;
+}
+
+static void index_free(struct record_index* index) {
+	hashmap_free(index->map);
+	free(index->next);
+}
+
+void records_read_state(const char* path) {
+	FILE* file = fopen(path, "r");
+
+	for(size_t i = 0; i < record_count; ++i) {
+		records[i].published = (struct address) { 0 };
+	}
+
+	// if it can't be opened it does not exist and nothing was published yet
+	if(file == NULL) {
+		return;
+	}
+
+	struct record_index index;
+	char* line;
+
+	index_build(&index, false);
+
+	while((line = read_line(file)) != NULL) {
+		char* separator = strchr(line, ' ');
+		struct address address;
+
+		if(separator == NULL) {
+			// single address written by older versions, that only updated an A record
+			if(address_parse(line, AF_INET, &address)) {
+				for(size_t i = 0; i < record_count; ++i) {
+					if(records[i].family == AF_INET) {
+						records[i].published = address;
+					}
+				}
+			}
+		}
+		else {
+			*separator = 0;
+
+			for(size_t i = index_find(&index, 0, line); i < record_count; i = index.next[i]) {
+				if(address_parse(separator + 1, records[i].family, &address)) {
+					records[i].published = address;
+				}
+			}
+		}
+
+		free(line);
+	}
+
+	index_free(&index);
+	fclose(file);
+}
+
+bool records_write_state(const char* path) {
+	char* temp_path = format_string("%s.tmp", (char*) path);
+	FILE* file = fopen(temp_path, "w");
+
+	if(file == NULL) {
+		log_error("Couldn't write the published addresses to '%s'", temp_path);
+		free(temp_path);
+		return false;
+	}
+
+	for(size_t i = 0; i < record_count; ++i) {
+		char text[ADDRESS_MAX_TEXT_LENGTH];
+
+		if(records[i].published.family != 0) {
+			fprintf(file, "%s %s\n", records[i].record_id, address_format(&records[i].published, text, sizeof(text)));
+		}
+	}
+
+	// the rename only happens once the content is on disk, a crash leaves either the old state or the new one
+	long bytes = ftell(file);
+	struct timespec started, synced;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+	clock_gettime(CLOCK_MONOTONIC, &synced);
+
+	double sync_ms = (synced.tv_sec - started.tv_sec) * 1000.0 + (synced.tv_nsec - started.tv_nsec) / 1000000.0;
+
+	written = fclose(file) == 0 && written && rename(temp_path, path) == 0;
+
+	if(written) {
+		log_debug("Wrote %ld bytes of published addresses to '%s', the sync took %.3f ms", bytes, path, sync_ms);
+		metrics_inc(METRIC_STATE_WRITES);
+		metrics_add(METRIC_STATE_WRITTEN_BYTES, bytes);
+		metrics_set(METRIC_STATE_LAST_WRITE_BYTES, bytes);
+		metrics_set(METRIC_STATE_LAST_SYNC_MS, sync_ms);
+	}
+	else {
+		log_error("Couldn't replace the published addresses file '%s'", path);
+	}
+
+	free(temp_path);
+
+	return written;
+}
+
+size_t records_unresolved() {
+	size_t count = 0;
+
+	for(size_t i = 0; i < record_count; ++i) {
+		if(records[i].record_id[0] == 0) {
+			++count;
+		}
+	}
+
+	return count;
+}
+
+void records_forget(struct record* record) {
+	if(record->by_name) {
+		record->zone_id[0] = 0;
+		record->record_id[0] = 0;
+		record->published = (struct address) { 0 };
+	}
+}
+
+void records_read_cache(const char* path) {
+	FILE* file = fopen(path, "r");
+	char* line;
+
+	// nothing resolved yet
+	if(file == NULL) {
+		return;
+	}
+
+	struct record_index index;
+
+	index_build(&index, true);
+
+	while((line = read_line(file)) != NULL) {
+		char type[5], name[RECORD_NAME_MAX_LENGTH + 1], zone_id[CLOUDFLARE_ID_SIZE + 1], record_id[CLOUDFLARE_ID_SIZE + 1];
+
+		if(sscanf(line, "%4s %253s %32s %32s", type, name, zone_id, record_id) == 4 && parse_type(type) != 0) {
+			for(size_t i = index_find(&index, parse_type(type), name); i < record_count; i = index.next[i]) {
+				strcpy(records[i].zone_id, zone_id);
+				strcpy(records[i].record_id, record_id);
+			}
+		}
+
+		free(line);
+	}
+
+	index_free(&index);
+	fclose(file);
+}
+
+bool records_write_cache(const char* path) {
+	char* temp_path = format_string("%s.tmp", (char*) path);
+	FILE* file = fopen(temp_path, "w");
+
+	if(file == NULL) {
+		log_warning("Couldn't write the resolved record ids to '%s'", temp_path);
+		free(temp_path);
+		return false;
+	}
+
+	for(size_t i = 0; i < record_count; ++i) {
+		if(records[i].by_name && records[i].record_id[0] != 0) {
+			fprintf(file, "%s %s %s %s\n", address_record_type(records[i].family), records[i].name, records[i].zone_id, records[i].record_id);
+		}
+	}
+
+	fclose(file);
+
+	bool written = rename(temp_path, path) == 0;
+
+	if(!written) {
+		log_warning("Couldn't replace the resolved record ids file '%s'", path);
+	}
+
+	free(temp_path);
+
+	return written;
+}
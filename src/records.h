@@ -0,0 +1,77 @@
+#ifndef RECORDS_H
+#define RECORDS_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "address.h"
+#include "utils.h"
+
+#define CLOUDFLARE_API_HOST "api.cloudflare.com"
+#define CLOUDFLARE_AUTHORIZATION_HEADER "Authorization: Bearer %s"
+#define CLOUDFLARE_ID_SIZE 32
+// interface name or source address (for multi-wan hosts)
+#define RECORD_INTERFACE_MAX_LENGTH 45
+#define RECORD_NAME_MAX_LENGTH 253
+
+/**
+ * Dns record kept up to date, family is AF_INET for A records and AF_INET6 for AAAA ones
+ **/
+struct record {
+	char zone_id[CLOUDFLARE_ID_SIZE + 1];
+	char record_id[CLOUDFLARE_ID_SIZE + 1];
+	int family;
+	char interface[RECORD_INTERFACE_MAX_LENGTH + 1]; // uplink of the record, empty if not bound
+	char name[RECORD_NAME_MAX_LENGTH + 1]; // dns name of the record, empty if unknown
+	bool by_name; // the ids are resolved from the name (empty until then) and cached
+	struct address published; // last address written to the record
+};
+
+/**
+ * Replaces the records with the ones in the properties: ZONE_ID with RECORD_ID (A) and RECORD_ID_AAAA (AAAA),
+ * plus any number of 'RECORD=<A|AAAA>,<zone_id>,<record_id>[,[<interface or source address>][,<name>]]' lines
+ * and of 'HOST=<A|AAAA>,<name>[,<interface or source address>]' lines, whose ids are resolved from the name.
+ * INTERFACE is the interface of the records that don't name one, RECORD_NAME the name of the ZONE_ID ones.
+ * Returns the number of records.
+ **/
+size_t records_load(struct property* properties);
+
+/**
+ * The records of the last load, the pointers are valid until the next one
+ **/
+struct record* records_get(size_t* count);
+
+/**
+ * True if at least one record needs the address of the family
+ **/
+bool records_need_family(int family);
+
+/**
+ * Reads the published addresses from the state file, lines are '<record_id> <address>'.
+ * A file with a single address (written by older versions) applies to the A records.
+ **/
+void records_read_state(const char* path);
+
+/**
+ * Replaces the state file through a temporary file, synced once, meant to be called once per run with all its changes
+ **/
+bool records_write_state(const char* path);
+
+/**
+ * Number of records whose ids are not resolved yet
+ **/
+size_t records_unresolved();
+
+/**
+ * Clears the ids of a record resolved from its name (it doesn't exist anymore), so that they get resolved again
+ **/
+void records_forget(struct record* record);
+
+/**
+ * Reads the ids of the HOST records from the cache file, lines are '<A|AAAA> <name> <zone_id> <record_id>'
+ **/
+void records_read_cache(const char* path);
+
+bool records_write_cache(const char* path);
+
+#endif
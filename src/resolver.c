@@ -0,0 +1,633 @@
+#include "resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "lib/dns.h"
+#include "lib/logger.h"
+#include "metrics.h"
+
+#define RESOLV_CONF_PATH "/etc/resolv.conf"
+
+#define RESOLVER_MAX_HOSTS 16
+#define RESOLVER_MAX_ADDRESSES 8
+#define RESOLVER_ADDRESS_MAX_LENGTH (INET6_ADDRSTRLEN + 2) // ipv6 addresses are written between brackets
+
+#define RESOLVER_MIN_TTL_SEC 5
+#define RESOLVER_MAX_TTL_SEC 3600
+#define RESOLVER_FALLBACK_TTL_SEC 60 // for addresses coming from getaddrinfo
+#define RESOLVER_RETRY_SEC 5
+#define RESOLVER_QUERY_TIMEOUT_MS 1000
+#define RESOLVER_QUERY_ATTEMPTS 2
+
+struct resolver_entry {
+	char host[RESOLVER_HOST_MAX_LENGTH + 1];
+	char addresses[RESOLVER_MAX_ADDRESSES][RESOLVER_ADDRESS_MAX_LENGTH];
+	size_t addresses_count;
+	struct timespec expires; // the addresses can't be used after this
+	struct timespec refresh_at; // a bit before expires, so that the entry never goes stale while in use
+	bool passed; // the addresses went to curl, which keeps them in the dns cache of its handles
+};
+
+static struct resolver_entry entries[RESOLVER_MAX_HOSTS];
+static size_t entries_count = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static pthread_t thread;
+static bool running = false,
+	stopping = false,
+	enabled = true;
+
+static struct sockaddr_storage nameserver;
+static socklen_t nameserver_length = 0;
+
+static inline int timespec_compare(const struct timespec* a, const struct timespec* b) {
+	if(a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+
+	return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+static bool parse_nameserver(const char* text, struct sockaddr_storage* address, socklen_t* length) {
+	char host[INET6_ADDRSTRLEN + 1] = { 0 };
+	long port = 53;
+	const char* port_start = NULL;
+
+	if(text[0] == '[') {
+		const char* end = strchr(text, ']');
+
+		if(end == NULL || (size_t) (end - text - 1) > INET6_ADDRSTRLEN) {
+			return false;
+		}
+
+		memcpy(host, text + 1, end - text - 1);
+		port_start = end[1] == ':' ? end + 2 : NULL;
+	}
+	else if(strchr(text, ':') != strrchr(text, ':')) {
+		// bare ipv6 address, no port
+		snprintf(host, sizeof(host), "%s", text);
+	}
+	else {
+		const char* colon = strchr(text, ':');
+		size_t host_length = colon != NULL ? (size_t) (colon - text) : strlen(text);
+
+		if(host_length > INET6_ADDRSTRLEN) {
+			return false;
+		}
+
+		memcpy(host, text, host_length);
+		port_start = colon != NULL ? colon + 1 : NULL;
+	}
+
+	if(port_start != NULL) {
+		port = strtol(port_start, NULL, 10);
+
+		if(port <= 0 || port > 65535) {
+			return false;
+		}
+	}
+
+	struct sockaddr_in* v4 = (struct sockaddr_in*) address;
+	struct sockaddr_in6* v6 = (struct sockaddr_in6*) address;
+
+	memset(address, 0, sizeof(struct sockaddr_storage));
+
+	if(inet_pton(AF_INET, host, &v4->sin_addr) == 1) {
+		v4->sin_family = AF_INET;
+		v4->sin_port = htons(port);
+		*length = sizeof(struct sockaddr_in);
+	}
+	else if(inet_pton(AF_INET6, host, &v6->sin6_addr) == 1) {
+		v6->sin6_family = AF_INET6;
+		v6->sin6_port = htons(port);
+		*length = sizeof(struct sockaddr_in6);
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
+// first "nameserver" line of resolv.conf
+static bool read_resolv_conf(struct sockaddr_storage* address, socklen_t* length) {
+	FILE* file = fopen(RESOLV_CONF_PATH, "r");
+	char line[256], value[INET6_ADDRSTRLEN + 1];
+	bool found = false;
+
+	if(file == NULL) {
+		return false;
+	}
+
+	while(!found && fgets(line, sizeof(line), file) != NULL) {
+		found = sscanf(line, " nameserver %46s", value) == 1 && parse_nameserver(value, address, length);
+	}
+
+	fclose(file);
+
+	return found;
+}
+
+bool resolver_configure(const char* text) {
+	struct sockaddr_storage address;
+	socklen_t length = 0;
+	bool use_cache = true, valid = true;
+
+	if(text != NULL && strcmp(text, RESOLVER_SYSTEM) == 0) {
+		use_cache = false;
+	}
+	else if(text != NULL) {
+		valid = parse_nameserver(text, &address, &length);
+	}
+	else if(!read_resolv_conf(&address, &length)) {
+		// without a nameserver the background thread still resolves through getaddrinfo
+		length = 0;
+	}
+
+	if(!valid) {
+		return false;
+	}
+
+	pthread_mutex_lock(&lock);
+	enabled = use_cache;
+	nameserver = address;
+	nameserver_length = length;
+
+	if(running) {
+		pthread_cond_signal(&wake);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return true;
+}
+
+/**
+ * Sends the query to the nameserver and writes the returned addresses in curl format
+ * Returns the number of addresses or -1 if the nameserver didn't answer
+ **/
+static int query_nameserver(const struct sockaddr_storage* server, socklen_t server_length, const char* host, uint16_t type,
+		char (*addresses)[RESOLVER_ADDRESS_MAX_LENGTH], size_t max_addresses, uint32_t* min_ttl) {
+	uint8_t query[DNS_MAX_MESSAGE_SIZE], response[DNS_MAX_MESSAGE_SIZE];
+	uint16_t id = random() & 0xffff;
+	size_t query_length = dns_build_query(query, sizeof(query), id, host, type, true);
+
+	if(query_length == 0) {
+		return -1;
+	}
+
+	int fd = socket(server->ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	// connecting the socket discards datagrams coming from other addresses
+	if(fd == -1 || connect(fd, (const struct sockaddr*) server, server_length) == -1) {
+		if(fd != -1) {
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	struct dns_answer answers[RESOLVER_MAX_ADDRESSES];
+	int found = -1, rcode;
+
+	for(int attempt = 0; attempt < RESOLVER_QUERY_ATTEMPTS && found < 0; ++attempt) {
+		metrics_inc(METRIC_RESOLVER_QUERIES);
+
+		if(send(fd, query, query_length, 0) != (ssize_t) query_length) {
+			break;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		while(found < 0 && poll(&pfd, 1, RESOLVER_QUERY_TIMEOUT_MS) > 0) {
+			ssize_t received = recv(fd, response, sizeof(response), 0);
+
+			if(received > 0) {
+				found = dns_parse_response(response, received, id, type, answers, RESOLVER_MAX_ADDRESSES, &rcode);
+			}
+		}
+	}
+
+	close(fd);
+
+	if(found < 0 || (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN)) {
+		return -1;
+	}
+
+	int written = 0;
+
+	for(int i = 0; i < found && (size_t) written < max_addresses; ++i) {
+		char text[INET6_ADDRSTRLEN];
+
+		if(type == DNS_TYPE_A && answers[i].length == 4) {
+			inet_ntop(AF_INET, answers[i].data, text, sizeof(text));
+			snprintf(addresses[written++], RESOLVER_ADDRESS_MAX_LENGTH, "%s", text);
+		}
+		else if(type == DNS_TYPE_AAAA && answers[i].length == 16) {
+			inet_ntop(AF_INET6, answers[i].data, text, sizeof(text));
+			snprintf(addresses[written++], RESOLVER_ADDRESS_MAX_LENGTH, "[%s]", text);
+		}
+		else {
+			continue;
+		}
+
+		if(answers[i].ttl < *min_ttl) {
+			*min_ttl = answers[i].ttl;
+		}
+	}
+
+	return written;
+}
+
+// blocking system resolution, used when there is no nameserver to query directly
+static int query_system(const char* host, char (*addresses)[RESOLVER_ADDRESS_MAX_LENGTH], size_t max_addresses, uint32_t* min_ttl) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *result;
+
+	if(getaddrinfo(host, NULL, &hints, &result) != 0) {
+		return -1;
+	}
+
+	int written = 0;
+
+	for(struct addrinfo* current = result; current != NULL && (size_t) written < max_addresses; current = current->ai_next) {
+		char text[INET6_ADDRSTRLEN];
+
+		if(current->ai_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in*) current->ai_addr)->sin_addr, text, sizeof(text));
+			snprintf(addresses[written++], RESOLVER_ADDRESS_MAX_LENGTH, "%s", text);
+		}
+		else if(current->ai_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*) current->ai_addr)->sin6_addr, text, sizeof(text));
+			snprintf(addresses[written++], RESOLVER_ADDRESS_MAX_LENGTH, "[%s]", text);
+		}
+	}
+
+	freeaddrinfo(result);
+	*min_ttl = RESOLVER_FALLBACK_TTL_SEC;
+
+	return written;
+}
+
+// resolves the host at position index, called with the lock held (it gets released during the queries)
+static void refresh_entry(size_t index) {
+	char host[RESOLVER_HOST_MAX_LENGTH + 1];
+	char addresses[RESOLVER_MAX_ADDRESSES][RESOLVER_ADDRESS_MAX_LENGTH];
+	struct sockaddr_storage server = nameserver;
+	socklen_t server_length = nameserver_length;
+	uint32_t ttl = RESOLVER_MAX_TTL_SEC;
+	int count = -1;
+
+	memcpy(host, entries[index].host, sizeof(host));
+	pthread_mutex_unlock(&lock);
+
+	if(server_length > 0) {
+		int v4 = query_nameserver(&server, server_length, host, DNS_TYPE_A, addresses, RESOLVER_MAX_ADDRESSES, &ttl);
+		int v6 = v4 >= 0 ? query_nameserver(&server, server_length, host, DNS_TYPE_AAAA, addresses + v4, RESOLVER_MAX_ADDRESSES - v4, &ttl) : -1;
+
+		count = v4 >= 0 ? v4 + (v6 > 0 ? v6 : 0) : -1;
+	}
+
+	if(count <= 0) {
+		count = query_system(host, addresses, RESOLVER_MAX_ADDRESSES, &ttl);
+	}
+
+	if(ttl < RESOLVER_MIN_TTL_SEC) {
+		ttl = RESOLVER_MIN_TTL_SEC;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&lock);
+
+	struct resolver_entry* entry = entries + index;
+
+	if(count > 0) {
+		memcpy(entry->addresses, addresses, sizeof(addresses));
+		entry->addresses_count = count;
+
+		entry->expires = now;
+		entry->expires.tv_sec += ttl;
+		entry->refresh_at = now;
+		entry->refresh_at.tv_sec += ttl - ttl / 5;
+
+		log_debug("Resolved '%s' to %d addresses (ttl %u seconds)", host, count, ttl);
+	}
+	else {
+		// the previous addresses stay usable until they expire
+		metrics_inc(METRIC_RESOLVER_FAILURES);
+		log_warning("Couldn't resolve '%s', retrying in %d seconds", host, RESOLVER_RETRY_SEC);
+
+		entry->refresh_at = now;
+		entry->refresh_at.tv_sec += RESOLVER_RETRY_SEC;
+	}
+}
+
+static void* resolver_thread(void* arg) {
+	(void) arg;
+	pthread_mutex_lock(&lock);
+
+	while(!stopping) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		size_t next = entries_count;
+
+		for(size_t i = 0; i < entries_count; ++i) {
+			if(next == entries_count || timespec_compare(&entries[i].refresh_at, &entries[next].refresh_at) < 0) {
+				next = i;
+			}
+		}
+
+		if(next == entries_count || !enabled) {
+			pthread_cond_wait(&wake, &lock);
+		}
+		else if(timespec_compare(&entries[next].refresh_at, &now) <= 0) {
+			refresh_entry(next);
+		}
+		else {
+			pthread_cond_timedwait(&wake, &lock, &entries[next].refresh_at);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+bool resolver_start() {
+	pthread_condattr_t attributes;
+
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&wake, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	stopping = false;
+	running = pthread_create(&thread, NULL, resolver_thread, NULL) == 0;
+
+	if(!running) {
+		log_warning("Couldn't start the resolver thread, hosts will be resolved by curl");
+	}
+
+	return running;
+}
+
+void resolver_stop() {
+	if(!running) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	pthread_cond_destroy(&wake);
+	running = false;
+}
+
+// called with the lock held, returns NULL if the table is full
+static struct resolver_entry* find_entry(const char* host, bool create) {
+	for(size_t i = 0; i < entries_count; ++i) {
+		if(strcmp(entries[i].host, host) == 0) {
+			return entries + i;
+		}
+	}
+
+	if(!create || entries_count >= RESOLVER_MAX_HOSTS) {
+		return NULL;
+	}
+
+	struct resolver_entry* entry = entries + entries_count++;
+
+	memset(entry, 0, sizeof(struct resolver_entry));
+	snprintf(entry->host, sizeof(entry->host), "%s", host);
+
+	// due immediately
+	clock_gettime(CLOCK_MONOTONIC, &entry->refresh_at);
+	entry->expires = entry->refresh_at;
+
+	if(running) {
+		pthread_cond_signal(&wake);
+	}
+
+	return entry;
+}
+
+void resolver_watch(const char* host) {
+	pthread_mutex_lock(&lock);
+	find_entry(host, true);
+	pthread_mutex_unlock(&lock);
+}
+
+struct curl_slist* resolver_curl_resolve(const char* host, long port) {
+	struct curl_slist* list = NULL;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&lock);
+
+	struct resolver_entry* entry = running && enabled ? find_entry(host, true) : NULL;
+	char value[RESOLVER_HOST_MAX_LENGTH + 8 + RESOLVER_MAX_ADDRESSES * RESOLVER_ADDRESS_MAX_LENGTH];
+
+	// "-host:port" drops the addresses given before, the handles would otherwise keep them after a refresh
+	if(entry != NULL && entry->passed) {
+		snprintf(value, sizeof(value), "-%s:%ld", host, port);
+		list = curl_slist_append(list, value);
+	}
+
+	if(entry != NULL && entry->addresses_count > 0 && timespec_compare(&now, &entry->expires) < 0) {
+		// "host:port:address[,address...]"
+		int length = snprintf(value, sizeof(value), "%s:%ld:", host, port);
+
+		for(size_t i = 0; i < entry->addresses_count; ++i) {
+			length += snprintf(value + length, sizeof(value) - length, i > 0 ? ",%s" : "%s", entry->addresses[i]);
+		}
+
+		list = curl_slist_append(list, value);
+		entry->passed = true;
+		metrics_inc(METRIC_RESOLVER_HITS);
+	}
+	else if(running && enabled) {
+		metrics_inc(METRIC_RESOLVER_MISSES);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return list;
+}
+
+bool resolver_address(const char* host, int family, struct address* address) {
+	struct timespec now;
+	bool found = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&lock);
+
+	struct resolver_entry* entry = running && enabled ? find_entry(host, true) : NULL;
+
+	if(entry != NULL && timespec_compare(&now, &entry->expires) < 0) {
+		for(size_t i = 0; i < entry->addresses_count && !found; ++i) {
+			char text[RESOLVER_ADDRESS_MAX_LENGTH];
+			size_t length = strlen(entry->addresses[i]);
+
+			// ipv6 addresses are kept in brackets for curl
+			if(entry->addresses[i][0] == '[' && length >= 2) {
+				snprintf(text, sizeof(text), "%.*s", (int) length - 2, entry->addresses[i] + 1);
+			}
+			else {
+				snprintf(text, sizeof(text), "%s", entry->addresses[i]);
+			}
+
+			found = address_parse(text, family, address);
+		}
+	}
+
+	metrics_inc(found ? METRIC_RESOLVER_HITS : METRIC_RESOLVER_MISSES);
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
+
+bool resolver_nameserver(struct sockaddr_storage* address, socklen_t* length) {
+	pthread_mutex_lock(&lock);
+
+	*address = nameserver;
+	*length = nameserver_length;
+
+	pthread_mutex_unlock(&lock);
+
+	return *length > 0 || read_resolv_conf(address, length);
+}
+
+#ifdef RESOLVER_TEST
+
+// cc -DRESOLVER_TEST resolver.c address.c metrics.c utils.c lib/dns.c lib/logger.c -lcurl -lpthread && ./a.out
+
+#include <assert.h>
+
+static const uint8_t TEST_IPV4[4] = { 192, 0, 2, 7 };
+static const uint8_t TEST_IPV6[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7 };
+
+static int test_queries[2];
+
+/**
+ * Loopback nameserver answering for test.example. It drops the first A query to make the resolver retry
+ * and sends a datagram with another id before each answer. An empty datagram stops it.
+ **/
+static void* test_nameserver(void* arg) {
+	int fd = *(int*) arg;
+	uint8_t message[DNS_MAX_MESSAGE_SIZE];
+	struct sockaddr_storage client;
+	socklen_t client_length = sizeof(client);
+	ssize_t received;
+	char name[DNS_MAX_NAME_LENGTH + 1];
+
+	while((received = recvfrom(fd, message, sizeof(message) - 32, 0, (struct sockaddr*) &client, &client_length)) > 0) {
+		uint16_t type = message[received - 4] << 8 | message[received - 3];
+		bool ipv4 = type == DNS_TYPE_A;
+
+		assert(message[2] & 0x01); // recursion desired
+		assert(dns_read_name(message, received, 12, name, sizeof(name)) && strcmp(name, "test.example") == 0);
+		assert(type == DNS_TYPE_A || type == DNS_TYPE_AAAA);
+
+		if(test_queries[ipv4 ? 0 : 1]++ == 0 && ipv4) {
+			client_length = sizeof(client);
+			continue;
+		}
+
+		// header flags: response, recursion desired and available, then one answer pointing to the question name
+		uint8_t* answer = message + received;
+		size_t address_length = ipv4 ? 4 : 16;
+
+		message[2] = 0x81;
+		message[3] = 0x80;
+		message[7] = 1;
+		memcpy(answer, "\xc0\x0c\0\0\0\1\0\0\0\x1e\0", 11);
+		answer[3] = type;
+		answer[11] = address_length;
+		memcpy(answer + 12, ipv4 ? TEST_IPV4 : TEST_IPV6, address_length);
+
+		size_t length = received + 12 + address_length;
+
+		message[0] ^= 0xff;
+		sendto(fd, message, length, 0, (struct sockaddr*) &client, client_length);
+		message[0] ^= 0xff;
+		sendto(fd, message, length, 0, (struct sockaddr*) &client, client_length);
+
+		client_length = sizeof(client);
+	}
+
+	return NULL;
+}
+
+int main() {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in server = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t server_length = sizeof(server);
+	pthread_t responder;
+	char text[32];
+
+	assert(fd != -1 && bind(fd, (struct sockaddr*) &server, server_length) == 0);
+	assert(getsockname(fd, (struct sockaddr*) &server, &server_length) == 0);
+	assert(pthread_create(&responder, NULL, test_nameserver, &fd) == 0);
+
+	snprintf(text, sizeof(text), "127.0.0.1:%d", ntohs(server.sin_port));
+	assert(!resolver_configure("not an address"));
+	assert(resolver_configure(text));
+	assert(resolver_start());
+
+	// the first lookup only watches the host, the thread then resolves it through the loopback nameserver
+	struct address address;
+	bool found = resolver_address("test.example", AF_INET, &address);
+
+	assert(!found);
+	for(int i = 0; i < 50 && !found; ++i) {
+		usleep(100 * 1000);
+		found = resolver_address("test.example", AF_INET, &address);
+	}
+
+	assert(found && address.family == AF_INET && memcmp(address.bytes, TEST_IPV4, 4) == 0);
+	assert(resolver_address("test.example", AF_INET6, &address) && memcmp(address.bytes, TEST_IPV6, 16) == 0);
+	assert(test_queries[0] == 2 && test_queries[1] == 1);
+	assert(metrics_get(METRIC_RESOLVER_QUERIES) == 3 && metrics_get(METRIC_RESOLVER_FAILURES) == 0);
+
+	// curl gets the addresses, then a removal of the ones it was given before
+	struct curl_slist* list = resolver_curl_resolve("test.example", 443);
+
+	assert(list != NULL && strcmp(list->data, "test.example:443:192.0.2.7,[2001:db8::7]") == 0 && list->next == NULL);
+	curl_slist_free_all(list);
+
+	list = resolver_curl_resolve("test.example", 443);
+	assert(list != NULL && strcmp(list->data, "-test.example:443") == 0);
+	assert(list->next != NULL && strcmp(list->next->data, "test.example:443:192.0.2.7,[2001:db8::7]") == 0);
+	curl_slist_free_all(list);
+
+	resolver_stop();
+	assert(resolver_curl_resolve("test.example", 443) == NULL);
+
+	sendto(fd, "", 0, 0, (struct sockaddr*) &server, server_length);
+	pthread_join(responder, NULL);
+	close(fd);
+
+	printf("PASSED\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H 1
+
+#include <stdbool.h>
+
+#include <sys/socket.h>
+
+#include <curl/curl.h>
+
+#include "address.h"
+
+#define RESOLVER_HOST_MAX_LENGTH 255
+
+// value of the RESOLVER property that leaves the resolution to curl
+#define RESOLVER_SYSTEM "system"
+
+/**
+ * Sets the nameserver queried by the background resolver as "<ip>", "<ipv4>:<port>" or "[<ipv6>]:<port>".
+ * With NULL the first nameserver of /etc/resolv.conf is used, with RESOLVER_SYSTEM the cache is disabled.
+ * Returns false if the address can't be parsed.
+ **/
+bool resolver_configure(const char* nameserver);
+
+/**
+ * Starts the background thread that keeps the watched hosts resolved, refreshing them before their ttl expires.
+ * Must be called after blocking the signals handled by the main thread.
+ **/
+bool resolver_start();
+
+void resolver_stop();
+
+/**
+ * Adds the host to the ones kept resolved
+ **/
+void resolver_watch(const char* host);
+
+/**
+ * Returns a CURLOPT_RESOLVE list with the cached addresses of host, or NULL if there are none
+ * (the host gets watched and curl resolves it on its own in the meantime).
+ * Once addresses were returned for host the list starts with a removal of the ones curl may still hold.
+ **/
+struct curl_slist* resolver_curl_resolve(const char* host, long port);
+
+/**
+ * Writes the first cached address of host in the family, for the calls that don't go through curl.
+ * Returns false if there is none (the host gets watched).
+ **/
+bool resolver_address(const char* host, int family, struct address* address);
+
+/**
+ * Writes the recursive nameserver address (the one of /etc/resolv.conf when the cache is disabled).
+ * Returns false if there is none.
+ **/
+bool resolver_nameserver(struct sockaddr_storage* address, socklen_t* length);
+
+#endif
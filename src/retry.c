@@ -0,0 +1,44 @@
+#include "retry.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "lib/logger.h"
+
+unsigned int retry_backoff_ms(const struct retry_policy* policy, unsigned int attempt) {
+	unsigned long cap = policy->base_delay_ms;
+
+	// doubling until the max delay, the loop avoids overflowing on large attempt values
+	while(attempt-- > 0 && cap < policy->max_delay_ms) {
+		cap <<= 1;
+	}
+
+	if(cap > policy->max_delay_ms) {
+		cap = policy->max_delay_ms;
+	}
+
+	return (unsigned int) (random() % (cap + 1));
+}
+
+static void sleep_ms(unsigned int ms) {
+	struct timespec remaining = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L
+	};
+
+	while(nanosleep(&remaining, &remaining) == -1 && errno == EINTR);
+}
+
+bool retry_wait(const struct retry_policy* policy, unsigned int attempt) {
+	if(attempt + 1 >= policy->max_attempts) {
+		return false;
+	}
+
+	unsigned int delay = retry_backoff_ms(policy, attempt);
+
+	log_debug("Retrying in %u ms (attempt %u of %u)", delay, attempt + 2, policy->max_attempts);
+	sleep_ms(delay);
+
+	return true;
+}
@@ -0,0 +1,25 @@
+#ifndef RETRY_H
+#define RETRY_H 1
+
+#include <stdbool.h>
+
+struct retry_policy {
+	unsigned int max_attempts; // total attempts, including the first one
+	unsigned int base_delay_ms; // backoff cap for the first retry
+	unsigned int max_delay_ms; // upper bound of the backoff cap
+};
+
+/**
+ * Exponential backoff with full jitter: a random delay between 0 and
+ * min(max_delay_ms, base_delay_ms * 2^attempt)
+ **/
+unsigned int retry_backoff_ms(const struct retry_policy* policy, unsigned int attempt);
+
+/**
+ * To be called after the failed attempt number "attempt" (starting from 0).
+ * Returns false if the policy does not allow another attempt, otherwise it sleeps
+ * for the backoff delay and returns true.
+ **/
+bool retry_wait(const struct retry_policy* policy, unsigned int attempt);
+
+#endif
@@ -0,0 +1,538 @@
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sysexits.h>
+
+#include "lib/hashmap.h"
+#include "lib/logger.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define BUCKET_KEY_MAX_LENGTH 520
+
+struct token_bucket {
+	double tokens;
+	double capacity;
+	double rate; // tokens per millisecond
+	struct timespec updated;
+	struct timespec blocked_until;
+};
+
+struct bucket_entry {
+	char key[BUCKET_KEY_MAX_LENGTH + 1];
+	struct token_bucket bucket;
+};
+
+static long token_quota = RATE_LIMIT_DEFAULT_QUOTA,
+	token_window_sec = RATE_LIMIT_DEFAULT_WINDOW_SEC,
+	zone_quota = RATE_LIMIT_DEFAULT_QUOTA,
+	zone_window_sec = RATE_LIMIT_DEFAULT_WINDOW_SEC;
+
+static struct hashmap* buckets = NULL;
+
+static uint64_t bucket_hash(const void* item, uint64_t seed0, uint64_t seed1) {
+	const struct bucket_entry* entry = item;
+	return hashmap_sip(entry->key, strlen(entry->key), seed0, seed1);
+}
+
+static int bucket_compare(const void* a, const void* b, void* udata) {
+	(void) udata;
+	return strcmp(((const struct bucket_entry*) a)->key, ((const struct bucket_entry*) b)->key);
+}
+
+/**
+ * A tenth of the quota is allowed as burst and the rest is refilled over the window,
+ * so no window can ever see more requests than the quota
+ **/
+static void bucket_configure(struct token_bucket* bucket, long quota, long window_sec) {
+	bucket->capacity = quota / 10 > 0 ? quota / 10 : 1;
+	bucket->rate = (quota - bucket->capacity > 0 ? quota - bucket->capacity : 1) / (window_sec * 1000.0);
+
+	if(bucket->tokens > bucket->capacity) {
+		bucket->tokens = bucket->capacity;
+	}
+}
+
+static void bucket_key(char* key, const char* prefix, const char* name) {
+	snprintf(key, BUCKET_KEY_MAX_LENGTH + 1, "%s:%s", prefix, name);
+}
+
+static void bucket_create(const char* key, long quota, long window_sec) {
+	struct bucket_entry entry = { 0 };
+	strncpy(entry.key, key, BUCKET_KEY_MAX_LENGTH);
+
+	if(buckets == NULL) {
+		buckets = hashmap_new(sizeof(struct bucket_entry), 0, random(), random(), bucket_hash, bucket_compare, NULL);
+
+		if(buckets == NULL) {
+			log_error("Couldn't allocate the rate limit buckets");
+			exit(EX_OSERR);
+		}
+	}
+
+	if(hashmap_get(buckets, &entry) == NULL) {
+		bucket_configure(&entry.bucket, quota, window_sec);
+		entry.bucket.tokens = entry.bucket.capacity;
+		clock_gettime(CLOCK_MONOTONIC, &entry.bucket.updated);
+		entry.bucket.blocked_until = entry.bucket.updated;
+
+		hashmap_set(buckets, &entry);
+	}
+}
+
+// the pointer is valid until the next bucket gets created
+static struct token_bucket* bucket_get(const char* key) {
+	struct bucket_entry entry;
+	strncpy(entry.key, key, BUCKET_KEY_MAX_LENGTH);
+	entry.key[BUCKET_KEY_MAX_LENGTH] = 0;
+
+	struct bucket_entry* found = buckets != NULL ? hashmap_get(buckets, &entry) : NULL;
+
+	return found != NULL ? &found->bucket : NULL;
+}
+
+static void buckets_get(const char* token, const char* zone, struct token_bucket** token_bucket, struct token_bucket** zone_bucket) {
+	char token_key[BUCKET_KEY_MAX_LENGTH + 1], zone_key[BUCKET_KEY_MAX_LENGTH + 1];
+
+	bucket_key(token_key, "token", token);
+	bucket_key(zone_key, "zone", zone);
+
+	// both are created before getting the pointers since a creation can move the entries
+	bucket_create(token_key, token_quota, token_window_sec);
+	bucket_create(zone_key, zone_quota, zone_window_sec);
+
+	*token_bucket = bucket_get(token_key);
+	*zone_bucket = bucket_get(zone_key);
+}
+
+static inline long timespec_diff_ms(const struct timespec* a, const struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static void bucket_refill(struct token_bucket* bucket, const struct timespec* now) {
+	bucket->tokens += timespec_diff_ms(now, &bucket->updated) * bucket->rate;
+	bucket->updated = *now;
+
+	if(bucket->tokens > bucket->capacity) {
+		bucket->tokens = bucket->capacity;
+	}
+}
+
+// milliseconds until the bucket has a token available
+static long bucket_ready_in_ms(struct token_bucket* bucket, const struct timespec* now) {
+	bucket_refill(bucket, now);
+
+	long blocked_ms = timespec_diff_ms(&bucket->blocked_until, now),
+		refill_ms = bucket->tokens >= 1 ? 0 : (long) ((1 - bucket->tokens) / bucket->rate) + 1;
+
+	if(blocked_ms < 0) {
+		blocked_ms = 0;
+	}
+
+	return blocked_ms > refill_ms ? blocked_ms : refill_ms;
+}
+
+static long job_ready_in_ms(const struct api_job* job, const struct timespec* now) {
+	struct token_bucket *token_bucket, *zone_bucket;
+	buckets_get(job->token, job->zone, &token_bucket, &zone_bucket);
+
+	long token_ms = bucket_ready_in_ms(token_bucket, now),
+		zone_ms = bucket_ready_in_ms(zone_bucket, now);
+
+	return token_ms > zone_ms ? token_ms : zone_ms;
+}
+
+static void sleep_ms(long ms) {
+	struct timespec remaining = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L
+	};
+
+	metrics_add(METRIC_SCHEDULER_WAIT_MS, ms);
+
+	while(nanosleep(&remaining, &remaining) == -1 && errno == EINTR);
+}
+
+void scheduler_set_limits(long new_token_quota, long new_token_window_sec, long new_zone_quota, long new_zone_window_sec) {
+	token_quota = new_token_quota;
+	token_window_sec = new_token_window_sec;
+	zone_quota = new_zone_quota;
+	zone_window_sec = new_zone_window_sec;
+}
+
+bool scheduler_parse_limit(const char* limit, long* quota, long* window_sec) {
+	char* end;
+	long parsed_quota = strtol(limit, &end, 10);
+
+	if(end == limit || *end != '/' || parsed_quota <= 0) {
+		return false;
+	}
+
+	const char* window_start = end + 1;
+	long parsed_window = strtol(window_start, &end, 10);
+
+	if(end == window_start || parsed_window <= 0) {
+		return false;
+	}
+
+	*quota = parsed_quota;
+	*window_sec = parsed_window;
+
+	return true;
+}
+
+struct queued_job {
+	struct api_job job;
+	unsigned long sequence; // order of the enqueues, the oldest job goes first among the same priority
+};
+
+/**
+ * Jobs sharing their token and zone, they take from the same buckets so they all get ready at the same time.
+ * The jobs are a binary heap, the highest priority first.
+ **/
+struct job_group {
+	const char* token;
+	const char* zone;
+	struct queued_job* jobs;
+	size_t size, allocated;
+};
+
+// groups of the pending jobs, the slots past group_count keep their allocation for the next runs
+static struct job_group* groups = NULL;
+static size_t group_count = 0, groups_allocated = 0, queued_jobs = 0;
+static unsigned long next_sequence = 0;
+
+// start of the drain in progress, its waits count against the budget of the run
+static struct timespec drain_started;
+static bool draining = false;
+
+static bool job_before(const struct queued_job* a, const struct queued_job* b) {
+	return a->job.priority != b->job.priority ? a->job.priority < b->job.priority : a->sequence < b->sequence;
+}
+
+static void* grow(void* array, size_t* allocated, size_t size) {
+	*allocated = *allocated > 0 ? *allocated * 2 : 16;
+	array = realloc(array, *allocated * size);
+
+	if(array == NULL) {
+		log_error("Couldn't allocate the api job queue");
+		exit(EX_OSERR);
+	}
+
+	return array;
+}
+
+static struct job_group* find_group(const char* token, const char* zone) {
+	for(size_t i = 0; i < group_count; ++i) {
+		if(strcmp(groups[i].token, token) == 0 && strcmp(groups[i].zone, zone) == 0) {
+			return groups + i;
+		}
+	}
+
+	if(group_count >= groups_allocated) {
+		size_t previous = groups_allocated;
+
+		groups = grow(groups, &groups_allocated, sizeof(struct job_group));
+		memset(groups + previous, 0, (groups_allocated - previous) * sizeof(struct job_group));
+	}
+
+	struct job_group* group = groups + group_count++;
+
+	group->token = token;
+	group->zone = zone;
+	group->size = 0;
+
+	return group;
+}
+
+static void group_push(struct job_group* group, const struct queued_job* job) {
+	if(group->size >= group->allocated) {
+		group->jobs = grow(group->jobs, &group->allocated, sizeof(struct queued_job));
+	}
+
+	size_t index = group->size++;
+
+	while(index > 0 && job_before(job, group->jobs + (index - 1) / 2)) {
+		group->jobs[index] = group->jobs[(index - 1) / 2];
+		index = (index - 1) / 2;
+	}
+
+	group->jobs[index] = *job;
+}
+
+static struct api_job group_pop(struct job_group* group) {
+	struct api_job top = group->jobs[0].job;
+	struct queued_job last = group->jobs[--group->size];
+	size_t index = 0;
+
+	for(size_t child = 1; child < group->size; child = 2 * index + 1) {
+		if(child + 1 < group->size && job_before(group->jobs + child + 1, group->jobs + child)) {
+			++child;
+		}
+
+		if(!job_before(group->jobs + child, &last)) {
+			break;
+		}
+
+		group->jobs[index] = group->jobs[child];
+		index = child;
+	}
+
+	if(group->size > 0) {
+		group->jobs[index] = last;
+	}
+
+	return top;
+}
+
+static void clear_queue() {
+	group_count = 0;
+	queued_jobs = 0;
+}
+
+void scheduler_enqueue(const struct api_job* job) {
+	group_push(find_group(job->token, job->zone), &(struct queued_job) {
+		.job = *job,
+		.sequence = next_sequence++
+	});
+
+	++queued_jobs;
+}
+
+// milliseconds left to the drain in progress
+static long drain_budget_ms(const struct timespec* now) {
+	return draining ? SCHEDULER_DRAIN_BUDGET_MS - timespec_diff_ms(now, &drain_started) : LONG_MAX;
+}
+
+size_t scheduler_drain(CURL* curl) {
+	size_t failed = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &drain_started);
+	draining = true;
+
+	while(queued_jobs > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		// the ready group with the highest priority job, or the one that gets ready first
+		struct job_group* selected = NULL;
+		long selected_ms = -1;
+
+		for(size_t i = 0; i < group_count; ++i) {
+			struct job_group* group = groups + i;
+
+			if(group->size == 0) {
+				continue;
+			}
+
+			long ready_ms = job_ready_in_ms(&group->jobs[0].job, &now);
+
+			if(selected == NULL
+				|| (ready_ms == 0 && (selected_ms > 0 || job_before(group->jobs, selected->jobs)))
+				|| (ready_ms > 0 && selected_ms > 0 && ready_ms < selected_ms)) {
+				selected = group;
+				selected_ms = ready_ms;
+			}
+		}
+
+		long budget_ms = drain_budget_ms(&now);
+
+		if(selected_ms > SCHEDULER_MAX_WAIT_MS || selected_ms >= budget_ms) {
+			if(selected_ms > SCHEDULER_MAX_WAIT_MS) {
+				log_warning("Rate limited for %ld ms, %zu api calls are put off to the next run", selected_ms, queued_jobs);
+			}
+			else {
+				log_warning("The api calls of the run took %ld ms, %zu of them are put off to the next run", SCHEDULER_DRAIN_BUDGET_MS - budget_ms, queued_jobs);
+			}
+
+			metrics_add(METRIC_SCHEDULER_DEFERRED, queued_jobs);
+			failed += queued_jobs;
+			break;
+		}
+
+		if(selected_ms > 0) {
+			log_debug("Rate limited, waiting %ld ms before the next api call", selected_ms);
+			sleep_ms(selected_ms);
+		}
+
+		struct api_job job = group_pop(selected);
+		--queued_jobs;
+
+		if(!job.perform(curl, job.data)) {
+			++failed;
+		}
+	}
+
+	clear_queue();
+	draining = false;
+
+	return failed;
+}
+
+bool scheduler_acquire(const char* token, const char* zone) {
+	struct token_bucket *token_bucket, *zone_bucket;
+	struct timespec now;
+
+	buckets_get(token, zone, &token_bucket, &zone_bucket);
+
+	for(;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		long token_ms = bucket_ready_in_ms(token_bucket, &now),
+			zone_ms = bucket_ready_in_ms(zone_bucket, &now),
+			wait_ms = token_ms > zone_ms ? token_ms : zone_ms;
+
+		if(wait_ms == 0) {
+			break;
+		}
+
+		if(wait_ms > SCHEDULER_MAX_WAIT_MS || wait_ms >= drain_budget_ms(&now)) {
+			log_warning("Rate limited for %ld ms, the api call is put off to the next run", wait_ms);
+			metrics_inc(METRIC_SCHEDULER_DEFERRED);
+			return false;
+		}
+
+		log_debug("Rate limited, waiting %ld ms before the next api call", wait_ms);
+		sleep_ms(wait_ms);
+	}
+
+	--token_bucket->tokens;
+	--zone_bucket->tokens;
+
+	return true;
+}
+
+// value of the "name=<number>" parameter in a structured header like: "default";r=50;t=30
+static long header_parameter(const char* value, const char* name) {
+	size_t name_length = strlen(name);
+
+	for(const char* current = strchr(value, ';'); current != NULL; current = strchr(current + 1, ';')) {
+		const char* parameter = current + 1;
+
+		while(isspace((unsigned char) *parameter)) {
+			++parameter;
+		}
+
+		if(strncasecmp(parameter, name, name_length) == 0 && parameter[name_length] == '=') {
+			return strtol(parameter + name_length + 1, NULL, 10);
+		}
+	}
+
+	return -1;
+}
+
+size_t rate_limit_header_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata) {
+	struct rate_limit_headers* headers = userdata;
+	size_t size = itemSize * itemCount;
+	char line[256];
+
+	if(size >= sizeof(line)) {
+		return size;
+	}
+
+	memcpy(line, buffer, size);
+	line[size] = 0;
+
+	char* separator = strchr(line, ':');
+
+	if(separator == NULL) {
+		return size;
+	}
+
+	*separator = 0;
+	char* value = separator + 1;
+
+	while(isspace((unsigned char) *value)) {
+		++value;
+	}
+
+	if(strcasecmp(line, "Retry-After") == 0) {
+		if(isdigit((unsigned char) *value)) {
+			headers->retry_after_sec = strtol(value, NULL, 10);
+		}
+		else {
+			// http date form
+			time_t date = curl_getdate(value, NULL);
+
+			if(date != -1) {
+				headers->retry_after_sec = date > time(NULL) ? date - time(NULL) : 0;
+			}
+		}
+	}
+	else if(strcasecmp(line, "Ratelimit") == 0) {
+		headers->remaining = header_parameter(value, "r");
+		headers->reset_sec = header_parameter(value, "t");
+	}
+	else if(strcasecmp(line, "Ratelimit-Policy") == 0) {
+		headers->quota = header_parameter(value, "q");
+		headers->window_sec = header_parameter(value, "w");
+	}
+	else if(strcasecmp(line, "Ratelimit-Remaining") == 0 || strcasecmp(line, "X-Ratelimit-Remaining") == 0) {
+		headers->remaining = strtol(value, NULL, 10);
+	}
+	else if(strcasecmp(line, "Ratelimit-Reset") == 0) {
+		headers->reset_sec = strtol(value, NULL, 10);
+	}
+
+	return size;
+}
+
+void scheduler_update(const char* token, const struct rate_limit_headers* headers) {
+	char key[BUCKET_KEY_MAX_LENGTH + 1];
+	struct timespec now;
+
+	bucket_key(key, "token", token);
+	bucket_create(key, token_quota, token_window_sec);
+
+	struct token_bucket* bucket = bucket_get(key);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bucket_refill(bucket, &now);
+
+	if(headers->quota > 0 && headers->window_sec > 0) {
+		bucket_configure(bucket, headers->quota, headers->window_sec);
+	}
+
+	if(headers->remaining >= 0 && bucket->tokens > headers->remaining) {
+		bucket->tokens = headers->remaining;
+	}
+
+	long blocked_sec = -1;
+
+	if(headers->retry_after_sec >= 0) {
+		blocked_sec = headers->retry_after_sec;
+		metrics_inc(METRIC_RATE_LIMITED);
+	}
+	else if(headers->remaining == 0 && headers->reset_sec >= 0) {
+		blocked_sec = headers->reset_sec;
+	}
+
+	if(blocked_sec >= 0) {
+		log_warning("The api asked to wait %ld seconds before the next call", blocked_sec);
+
+		bucket->blocked_until = now;
+		bucket->blocked_until.tv_sec += blocked_sec;
+	}
+}
+
+void scheduler_cleanup() {
+	if(buckets != NULL) {
+		hashmap_free(buckets);
+		buckets = NULL;
+	}
+
+	for(size_t i = 0; i < groups_allocated; ++i) {
+		free(groups[i].jobs);
+	}
+
+	free(groups);
+	groups = NULL;
+	groups_allocated = 0;
+	clear_queue();
+}
@@ -0,0 +1,85 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <curl/curl.h>
+
+// the rate limit of the cloudflare api: 1200 requests every 5 minutes
+#define RATE_LIMIT_DEFAULT_QUOTA 1200
+#define RATE_LIMIT_DEFAULT_WINDOW_SEC 300
+// longest pause before an api call, the calls that would wait longer are put off to the next run
+#define SCHEDULER_MAX_WAIT_MS 10000
+// longest drain, the signals are not handled meanwhile: the calls left when it is over are put off to the next run
+#define SCHEDULER_DRAIN_BUDGET_MS 30000
+
+enum job_priority {
+	JOB_PRIORITY_ADDRESS_CHANGE, // records that point to a stale address
+	JOB_PRIORITY_BACKGROUND // everything that can wait, like the updates replayed from the outbox
+};
+
+/**
+ * Api call (with its own retries) queued to the scheduler.
+ * Jobs are paced through a token bucket for their api token and one for their zone.
+ **/
+struct api_job {
+	const char* token;
+	const char* zone;
+	enum job_priority priority;
+	bool (*perform)(CURL* curl, void* data);
+	void* data;
+};
+
+/**
+ * Rate limit informations read from the response headers, -1 when missing
+ **/
+struct rate_limit_headers {
+	long retry_after_sec;
+	long remaining;
+	long reset_sec;
+	long quota;
+	long window_sec;
+};
+
+/**
+ * Sets the limits used for the buckets, applies to the buckets not created yet
+ **/
+void scheduler_set_limits(long token_quota, long token_window_sec, long zone_quota, long zone_window_sec);
+
+/**
+ * Parses a "<requests>/<seconds>" limit string
+ **/
+bool scheduler_parse_limit(const char* limit, long* quota, long* window_sec);
+
+void scheduler_enqueue(const struct api_job* job);
+
+/**
+ * Performs all the queued jobs, highest priority first among the ones whose buckets are not empty.
+ * If no job gets ready within SCHEDULER_MAX_WAIT_MS, or once the drain took SCHEDULER_DRAIN_BUDGET_MS, the remaining
+ * ones are dropped, they are left to the next run.
+ * Returns the number of failed or dropped jobs.
+ **/
+size_t scheduler_drain(CURL* curl);
+
+/**
+ * Blocks until a request can be sent with the token to the zone and takes it from both buckets.
+ * Meant to be called by the jobs before every attempt.
+ * Returns false without waiting if that would take more than SCHEDULER_MAX_WAIT_MS or go past the budget of the drain,
+ * the call is then left to the next run.
+ **/
+bool scheduler_acquire(const char* token, const char* zone);
+
+/**
+ * CURLOPT_HEADERFUNCTION callback that fills a struct rate_limit_headers passed as CURLOPT_HEADERDATA
+ **/
+size_t rate_limit_header_callback(char* buffer, size_t itemSize, size_t itemCount, void* userdata);
+
+/**
+ * Applies the limits advertised by the api to the bucket of the token
+ **/
+void scheduler_update(const char* token, const struct rate_limit_headers* headers);
+
+void scheduler_cleanup();
+
+#endif
@@ -0,0 +1,73 @@
+#include "timeouts.h"
+
+#include <string.h>
+
+#include "lib/logger.h"
+
+#define TIMEOUTS_MAX_HOSTS 16
+
+static struct endpoint_latency endpoints[TIMEOUTS_MAX_HOSTS];
+static size_t endpoints_count = 0;
+
+static long timeout_min_ms = 500,
+	timeout_max_ms = 5000;
+static double timeout_factor = 3;
+
+struct endpoint_latency* endpoint_latency_get(const char* host) {
+	for(size_t i = 0; i < endpoints_count; ++i) {
+		if(strcmp(endpoints[i].host, host) == 0) {
+			return endpoints + i;
+		}
+	}
+
+	if(endpoints_count >= TIMEOUTS_MAX_HOSTS) {
+		return NULL;
+	}
+
+	struct endpoint_latency* endpoint = endpoints + endpoints_count++;
+
+	memset(endpoint, 0, sizeof(struct endpoint_latency));
+	strncpy(endpoint->host, host, TIMEOUTS_HOST_MAX_LENGTH);
+
+	return endpoint;
+}
+
+void timeouts_configure(long min_ms, long max_ms, double factor) {
+	timeout_min_ms = min_ms;
+	timeout_max_ms = max_ms > min_ms ? max_ms : min_ms;
+	timeout_factor = factor;
+}
+
+void endpoint_latency_record(struct endpoint_latency* endpoint, double connect_ms, double total_ms) {
+	if(endpoint == NULL) {
+		return;
+	}
+
+	if(connect_ms >= 0) {
+		latency_record(&endpoint->connect, connect_ms);
+	}
+
+	latency_record(&endpoint->total, total_ms);
+}
+
+static long window_timeout_ms(const struct latency_window* window) {
+	if(latency_count(window) < TIMEOUTS_MIN_SAMPLES) {
+		return timeout_max_ms;
+	}
+
+	long timeout = (long) (latency_percentile(window, TIMEOUTS_PERCENTILE) * timeout_factor);
+
+	if(timeout < timeout_min_ms) {
+		return timeout_min_ms;
+	}
+
+	return timeout > timeout_max_ms ? timeout_max_ms : timeout;
+}
+
+long endpoint_connect_timeout_ms(const struct endpoint_latency* endpoint) {
+	return endpoint != NULL ? window_timeout_ms(&endpoint->connect) : timeout_max_ms;
+}
+
+long endpoint_total_timeout_ms(const struct endpoint_latency* endpoint) {
+	return endpoint != NULL ? window_timeout_ms(&endpoint->total) : timeout_max_ms;
+}
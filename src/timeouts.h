@@ -0,0 +1,41 @@
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H 1
+
+#include "lib/latency.h"
+
+#define TIMEOUTS_HOST_MAX_LENGTH 255
+
+// samples needed before the percentiles replace the upper bound
+#define TIMEOUTS_MIN_SAMPLES 8
+#define TIMEOUTS_PERCENTILE 99
+
+/**
+ * Observed latencies of an upstream host, split by phase
+ **/
+struct endpoint_latency {
+	char host[TIMEOUTS_HOST_MAX_LENGTH + 1];
+	struct latency_window connect; // tcp and tls setup, only for calls that opened a new connection
+	struct latency_window total;
+};
+
+/**
+ * Returns the latencies of the host, creating the entry if needed.
+ * Returns NULL if the host table is full, the timeouts are then the upper bound.
+ **/
+struct endpoint_latency* endpoint_latency_get(const char* host);
+
+/**
+ * Bounds (in milliseconds) and multiplier applied to the percentiles to obtain the timeouts
+ **/
+void timeouts_configure(long min_ms, long max_ms, double factor);
+
+/**
+ * connect_ms < 0 when the call reused a connection
+ **/
+void endpoint_latency_record(struct endpoint_latency* endpoint, double connect_ms, double total_ms);
+
+long endpoint_connect_timeout_ms(const struct endpoint_latency* endpoint);
+
+long endpoint_total_timeout_ms(const struct endpoint_latency* endpoint);
+
+#endif
@@ -0,0 +1,379 @@
+#include "triggers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <ifaddrs.h>
+
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "lib/logger.h"
+#include "address.h"
+#include "metrics.h"
+
+// events come in bursts while a lease is renewed or an interface is reconfigured, the run waits for them to settle
+#define TRIGGER_SETTLE_MS 500
+#define RUN_BACKOFF_MIN_SEC 60
+#define TRIGGER_PATH_MAX_LENGTH 255
+#define TRIGGER_MAX_ADDRESSES 32
+
+struct lease_file {
+	char name[TRIGGER_PATH_MAX_LENGTH + 1]; // inotify reports the name of the file inside the watched directory
+	int watch;
+};
+
+static struct lease_file lease_files[TRIGGERS_MAX_LEASE_FILES];
+static size_t lease_file_count = 0;
+static int inotify_fd = -1, netlink_fd = -1;
+
+// global addresses of the host, the kernel announces them again whenever their lifetime is refreshed
+static struct address known_addresses[TRIGGER_MAX_ADDRESSES];
+static size_t known_address_count = 0;
+
+static long interval_ms = 0, backoff_ms = 0;
+static struct timespec next_run_at;
+static bool run_scheduled = false, changed_since_run = false;
+
+static inline long timespec_diff_ms(const struct timespec* a, const struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static void schedule_run(long delay_ms) {
+	struct timespec at;
+	clock_gettime(CLOCK_MONOTONIC, &at);
+
+	at.tv_sec += delay_ms / 1000;
+	at.tv_nsec += (delay_ms % 1000) * 1000000L;
+
+	if(at.tv_nsec >= 1000000000L) {
+		at.tv_nsec -= 1000000000L;
+		++at.tv_sec;
+	}
+
+	// an earlier run is never postponed
+	if(!run_scheduled || timespec_diff_ms(&at, &next_run_at) < 0) {
+		next_run_at = at;
+		run_scheduled = true;
+	}
+}
+
+void triggers_cleanup() {
+	if(inotify_fd != -1) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+
+	if(netlink_fd != -1) {
+		close(netlink_fd);
+		netlink_fd = -1;
+	}
+
+	lease_file_count = 0;
+	known_address_count = 0;
+}
+
+static void watch_lease_file(const char* path) {
+	char directory[TRIGGER_PATH_MAX_LENGTH + 1], name[TRIGGER_PATH_MAX_LENGTH + 1];
+
+	if(strlen(path) > TRIGGER_PATH_MAX_LENGTH || lease_file_count >= TRIGGERS_MAX_LEASE_FILES) {
+		log_warning("Lease file '%s' ignored, path too long or too many lease files", path);
+		return;
+	}
+
+	if(inotify_fd == -1 && (inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		log_warning("Couldn't watch the lease files, inotify is not available");
+		return;
+	}
+
+	// dhcp clients usually replace the lease file, so the directory is watched instead of the file
+	strcpy(directory, path);
+	strcpy(name, path);
+
+	struct lease_file* lease_file = lease_files + lease_file_count;
+
+	snprintf(lease_file->name, sizeof(lease_file->name), "%s", basename(name));
+	lease_file->watch = inotify_add_watch(inotify_fd, dirname(directory), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+	if(lease_file->watch == -1) {
+		log_warning("Couldn't watch the lease file '%s'", path);
+		return;
+	}
+
+	++lease_file_count;
+}
+
+static struct address* find_known_address(const struct address* address) {
+	for(size_t i = 0; i < known_address_count; ++i) {
+		if(address_equal(known_addresses + i, address)) {
+			return known_addresses + i;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns true if the address is new, or gone if added is false. When there are too many to remember, every
+ * announce counts as new
+ **/
+static bool update_known_address(const struct address* address, bool added) {
+	struct address* known = find_known_address(address);
+
+	if(added && known == NULL && known_address_count < TRIGGER_MAX_ADDRESSES) {
+		known_addresses[known_address_count++] = *address;
+	}
+	else if(!added && known != NULL) {
+		*known = known_addresses[--known_address_count];
+	}
+
+	return added ? known == NULL : known != NULL || known_address_count == TRIGGER_MAX_ADDRESSES;
+}
+
+static void load_known_addresses() {
+	struct ifaddrs *list, *current;
+
+	if(getifaddrs(&list) == -1) {
+		return;
+	}
+
+	for(current = list; current != NULL; current = current->ifa_next) {
+		struct address address = { 0 };
+
+		if(current->ifa_addr == NULL || (current->ifa_addr->sa_family != AF_INET && current->ifa_addr->sa_family != AF_INET6)) {
+			continue;
+		}
+
+		address.family = current->ifa_addr->sa_family;
+
+		if(address.family == AF_INET) {
+			memcpy(address.bytes, &((const struct sockaddr_in*) current->ifa_addr)->sin_addr, 4);
+		}
+		else {
+			memcpy(address.bytes, &((const struct sockaddr_in6*) current->ifa_addr)->sin6_addr, 16);
+		}
+
+		if(address_is_global(&address)) {
+			update_known_address(&address, true);
+		}
+	}
+
+	freeifaddrs(list);
+}
+
+static void watch_routes() {
+	struct sockaddr_nl address = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR
+	};
+
+	netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+	if(netlink_fd == -1 || bind(netlink_fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+		log_warning("Couldn't watch the route changes, netlink is not available");
+
+		if(netlink_fd != -1) {
+			close(netlink_fd);
+			netlink_fd = -1;
+		}
+
+		return;
+	}
+
+	load_known_addresses();
+}
+
+void triggers_load(struct property* properties) {
+	triggers_cleanup();
+
+	for(struct property* property = find_property(properties, "LEASE_FILE"); property != NULL; property = find_property(property + 1, "LEASE_FILE")) {
+		watch_lease_file(property->value);
+	}
+
+	char* temp = get_property_value(properties, "WATCH_ROUTES");
+
+	if(temp != NULL && strcmp(temp, "true") == 0) {
+		watch_routes();
+	}
+
+	temp = get_property_value(properties, "RUN_INTERVAL_SEC");
+	interval_ms = temp != NULL ? strtol(temp, NULL, 10) * 1000 : 0;
+
+	if(interval_ms < 0) {
+		log_warning("Invalid RUN_INTERVAL_SEC '%s', the internal timer is disabled", temp);
+		interval_ms = 0;
+	}
+
+	backoff_ms = interval_ms < RUN_BACKOFF_MIN_SEC * 1000L ? interval_ms : RUN_BACKOFF_MIN_SEC * 1000L;
+	run_scheduled = false;
+	changed_since_run = false;
+
+	if(interval_ms > 0) {
+		schedule_run(backoff_ms);
+	}
+}
+
+size_t triggers_fds(struct pollfd* fds, size_t max) {
+	size_t count = 0;
+
+	if(inotify_fd != -1 && count < max) {
+		fds[count++] = (struct pollfd) { .fd = inotify_fd, .events = POLLIN };
+	}
+
+	if(netlink_fd != -1 && count < max) {
+		fds[count++] = (struct pollfd) { .fd = netlink_fd, .events = POLLIN };
+	}
+
+	return count;
+}
+
+static bool read_lease_events() {
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	bool changed = false;
+
+	while((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+		for(char* position = buffer; position < buffer + length; position += sizeof(struct inotify_event) + ((struct inotify_event*) position)->len) {
+			const struct inotify_event* event = (const struct inotify_event*) position;
+
+			for(size_t i = 0; i < lease_file_count && event->len > 0; ++i) {
+				if(lease_files[i].watch == event->wd && strcmp(lease_files[i].name, event->name) == 0) {
+					log_debug("The lease file '%s' changed", event->name);
+					changed = true;
+				}
+			}
+		}
+	}
+
+	return changed;
+}
+
+/**
+ * The local address of the interface is in IFA_LOCAL, IFA_ADDRESS is the one of the peer on point to point links
+ **/
+static bool parse_address_message(const struct nlmsghdr* message, struct address* address) {
+	const struct ifaddrmsg* info = NLMSG_DATA(message);
+	int length = IFA_PAYLOAD(message);
+	size_t size = info->ifa_family == AF_INET ? 4 : 16;
+	bool found = false;
+
+	if(info->ifa_family != AF_INET && info->ifa_family != AF_INET6) {
+		return false;
+	}
+
+	for(const struct rtattr* attribute = IFA_RTA(info); RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+		if((attribute->rta_type == IFA_LOCAL || (attribute->rta_type == IFA_ADDRESS && !found)) && RTA_PAYLOAD(attribute) == size) {
+			address->family = info->ifa_family;
+			memcpy(address->bytes, RTA_DATA(attribute), size);
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+static bool read_route_events() {
+	char buffer[8192] __attribute__ ((aligned(__alignof__(struct nlmsghdr))));
+	ssize_t length;
+	bool changed = false;
+
+	while((length = recv(netlink_fd, buffer, sizeof(buffer), 0)) > 0) {
+		for(struct nlmsghdr* message = (struct nlmsghdr*) buffer; NLMSG_OK(message, (size_t) length); message = NLMSG_NEXT(message, length)) {
+			if(message->nlmsg_type == RTM_NEWROUTE || message->nlmsg_type == RTM_DELROUTE) {
+				const struct rtmsg* route = NLMSG_DATA(message);
+
+				// only the default route decides the uplink
+				if(route->rtm_dst_len == 0 && route->rtm_table == RT_TABLE_MAIN) {
+					log_debug("The default route changed");
+					changed = true;
+				}
+			}
+			else if(message->nlmsg_type == RTM_NEWADDR || message->nlmsg_type == RTM_DELADDR) {
+				struct address address = { 0 };
+				bool added = message->nlmsg_type == RTM_NEWADDR;
+
+				// an address is announced while it is checked for duplicates, then again once it can be used
+				if(!parse_address_message(message, &address) || !address_is_global(&address)
+					|| (added && (((const struct ifaddrmsg*) NLMSG_DATA(message))->ifa_flags & IFA_F_TENTATIVE))) {
+					continue;
+				}
+
+				if(update_known_address(&address, added)) {
+					char text[ADDRESS_MAX_TEXT_LENGTH];
+
+					log_debug("The global address '%s' was %s", address_format(&address, text, sizeof(text)), added ? "added" : "removed");
+					changed = true;
+				}
+			}
+		}
+	}
+
+	return changed;
+}
+
+bool triggers_handle(const struct pollfd* fds, size_t count) {
+	bool changed = false;
+
+	for(size_t i = 0; i < count; ++i) {
+		if(!(fds[i].revents & POLLIN)) {
+			continue;
+		}
+
+		if(fds[i].fd == inotify_fd) {
+			changed |= read_lease_events();
+		}
+		else if(fds[i].fd == netlink_fd) {
+			changed |= read_route_events();
+		}
+	}
+
+	if(changed) {
+		changed_since_run = true;
+		schedule_run(TRIGGER_SETTLE_MS);
+	}
+
+	return changed;
+}
+
+long triggers_due_in_ms() {
+	if(!run_scheduled) {
+		return -1;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long due = timespec_diff_ms(&next_run_at, &now);
+
+	return due > 0 ? due : 0;
+}
+
+void triggers_run_started() {
+	bool triggered = changed_since_run;
+
+	run_scheduled = false;
+	changed_since_run = false;
+
+	if(triggered) {
+		metrics_inc(METRIC_TRIGGERED_RUNS);
+	}
+
+	if(interval_ms == 0) {
+		return;
+	}
+
+	// right after a change the address may still move, then the checks get rarer up to the interval
+	if(triggered) {
+		backoff_ms = interval_ms < RUN_BACKOFF_MIN_SEC * 1000L ? interval_ms : RUN_BACKOFF_MIN_SEC * 1000L;
+	}
+	else {
+		backoff_ms = backoff_ms * 2 < interval_ms ? backoff_ms * 2 : interval_ms;
+	}
+
+	schedule_run(backoff_ms);
+}
@@ -0,0 +1,44 @@
+#ifndef TRIGGERS_H
+#define TRIGGERS_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <poll.h>
+
+#include "utils.h"
+
+#define TRIGGERS_MAX_LEASE_FILES 8
+#define TRIGGERS_MAX_FDS 2
+
+/**
+ * Runs triggered by the host itself: changes of the dhcp lease files (LEASE_FILE lines) and of the default route or
+ * of the global addresses (WATCH_ROUTES=true, only the addresses that come or go count, not the refreshes of their
+ * lifetime), plus an internal timer (RUN_INTERVAL_SEC, 0 disables it) that backs off from RUN_BACKOFF_MIN_SEC to the
+ * interval while nothing changes.
+ **/
+void triggers_load(struct property* properties);
+
+/**
+ * Writes the descriptors to poll for events, returns their number
+ **/
+size_t triggers_fds(struct pollfd* fds, size_t max);
+
+/**
+ * Reads the pending events of the polled descriptors, returns true if one of them should trigger a run
+ **/
+bool triggers_handle(const struct pollfd* fds, size_t count);
+
+/**
+ * Milliseconds until the next run should start, -1 if nothing is scheduled
+ **/
+long triggers_due_in_ms();
+
+/**
+ * To be called when a run starts, the backoff restarts from the minimum if an event happened since the previous run
+ **/
+void triggers_run_started();
+
+void triggers_cleanup();
+
+#endif
@@ -9,6 +9,8 @@
 
 #include <sys/stat.h>
 
+#include "lib/logger.h"
+
 // use standard functions instead of custom checked ones
 #define c_realloc realloc
 #define c_malloc malloc
@@ -140,9 +142,11 @@ struct property* read_property_file(FILE* file_ptr) {
 
 					if(new_size <= MAX_ELEMENTS) {
 						buffer = c_realloc(buffer, new_size * sizeof(struct property));
+						size = new_size;
 					}
 					else {
 						// if we are over MAX_ELEMENTS stop reading
+						log_error("Too many properties, the ones after the first %zu are ignored", read);
 						reading = false;
 					}
 				}
@@ -173,11 +177,11 @@ void free_properties(struct property *properties) {
 	free(properties);
 }
 
-char* get_property_value(struct property *properties, char *key) {
+struct property* find_property(struct property *properties, char *key) {
 	size_t i = 0;
 	while(properties[i].key != NULL) {
 		if(strcmp(properties[i].key, key) == 0) {
-			return properties[i].value;
+			return properties + i;
 		}
 
 		++i;
@@ -186,6 +190,12 @@ char* get_property_value(struct property *properties, char *key) {
 	return NULL;
 }
 
+char* get_property_value(struct property *properties, char *key) {
+	struct property* property = find_property(properties, key);
+
+	return property != NULL ? property->value : NULL;
+}
+
 #define FORMAT_CHAR '%'
 #define STRING_FORMAT_CHAR 's'
 
@@ -253,3 +263,13 @@ char* strstr_block(char* str, const char* word, char block) {
 
 	return NULL;
 }
+
+/**
+ * Milliseconds elapsed on the monotonic clock since start
+ **/
+long elapsed_ms_since(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
@@ -1,26 +1,34 @@
-#ifndef UTILS_H
-#define UTILS_H 1
-
-#include <stdio.h>
-#include "mlib.h"
-
-struct property {
-	char* key;
-	char* value;
-};
-
-char* read_file(FILE* file_ptr);
-
-char* read_line(FILE* file_ptr);
-
-struct property* read_property_file(FILE* file_ptr);
-
-char* get_property_value(struct property* properties, char* key);
-
-void free_properties(struct property* properties);
-
-char* format_string(char* format, ...);
-
-char* strstr_block(char* str, const char* word, char block);
-
+#ifndef UTILS_H
+#define UTILS_H 1
+
+#include <stdio.h>
+#include <time.h>
+#include "mlib.h"
+
+struct property {
+	char* key;
+	char* value;
+};
+
+char* read_file(FILE* file_ptr);
+
+char* read_line(FILE* file_ptr);
+
+struct property* read_property_file(FILE* file_ptr);
+
+char* get_property_value(struct property* properties, char* key);
+
+/**
+ * First property with the key, starting from properties. Repeated keys are iterated by searching again from the next property.
+ **/
+struct property* find_property(struct property* properties, char* key);
+
+void free_properties(struct property* properties);
+
+char* format_string(char* format, ...);
+
+char* strstr_block(char* str, const char* word, char block);
+
+long elapsed_ms_since(const struct timespec* start);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,524 @@
+#include "verify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "lib/dns.h"
+#include "lib/logger.h"
+#include "metrics.h"
+#include "resolver.h"
+
+#define VERIFY_TIMEOUT_MS 2000
+#define VERIFY_INITIAL_RTO_MS 250
+
+#define VERIFY_MAX_SERVERS 4 // authoritative addresses kept per zone
+#define VERIFY_MAX_ZONES 64 // zones whose nameservers are kept
+#define VERIFY_BATCH_RECORDS 64 // records checked by one round of queries
+#define VERIFY_MAX_SUFFIXES 4 // zone candidates per name, from the shortest one with two labels
+#define VERIFY_MAX_QUERIES (VERIFY_BATCH_RECORDS * VERIFY_MAX_SUFFIXES)
+#define VERIFY_MAX_ANSWERS 8
+
+#define VERIFY_MIN_ZONE_TTL_SEC 60
+#define VERIFY_MAX_ZONE_TTL_SEC 86400
+
+struct verify_server {
+	struct sockaddr_storage address;
+	socklen_t length;
+};
+
+struct verify_zone {
+	char name[DNS_MAX_NAME_LENGTH + 1];
+	struct verify_server servers[VERIFY_MAX_SERVERS];
+	size_t server_count;
+	struct timespec expires;
+};
+
+struct verify_query {
+	char name[DNS_MAX_NAME_LENGTH + 1];
+	uint16_t type, id;
+	const struct verify_server* servers; // tried in turn at every retransmission
+	size_t server_count, attempts;
+	long rto_ms;
+	struct timespec send_at;
+	bool done;
+	int rcode, answer_count; // answer_count is -1 without a valid response
+	struct dns_answer answers[VERIFY_MAX_ANSWERS];
+	uint8_t response[DNS_MAX_MESSAGE_SIZE]; // kept to read the compressed names of the answers
+	size_t response_length;
+};
+
+static bool enabled = false;
+
+// authoritative servers learned in the previous runs, until their ttl expires
+static struct verify_zone zones[VERIFY_MAX_ZONES];
+static size_t zone_count = 0;
+
+static struct verify_query queries[VERIFY_MAX_QUERIES];
+
+void verify_configure(bool enable) {
+	enabled = enable;
+}
+
+static inline long timespec_diff_ms(const struct timespec* a, const struct timespec* b) {
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+static inline void timespec_add_ms(struct timespec* time, long ms) {
+	time->tv_sec += ms / 1000;
+	time->tv_nsec += (ms % 1000) * 1000000L;
+
+	if(time->tv_nsec >= 1000000000L) {
+		time->tv_nsec -= 1000000000L;
+		++time->tv_sec;
+	}
+}
+
+static bool server_equal(const struct verify_server* server, const struct sockaddr_storage* address) {
+	if(server->address.ss_family != address->ss_family) {
+		return false;
+	}
+
+	if(address->ss_family == AF_INET) {
+		const struct sockaddr_in *a = (const struct sockaddr_in*) &server->address, *b = (const struct sockaddr_in*) address;
+
+		return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+	}
+
+	const struct sockaddr_in6 *a = (const struct sockaddr_in6*) &server->address, *b = (const struct sockaddr_in6*) address;
+
+	return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+// true if name is zone or one of its subdomains
+static bool in_zone(const char* name, const char* zone) {
+	size_t name_length = strlen(name), zone_length = strlen(zone);
+
+	return name_length >= zone_length && strcasecmp(name + name_length - zone_length, zone) == 0
+		&& (name_length == zone_length || name[name_length - zone_length - 1] == '.');
+}
+
+static struct verify_zone* find_zone(const char* name, const struct timespec* now) {
+	struct verify_zone* found = NULL;
+
+	for(size_t i = 0; i < zone_count; ++i) {
+		if(timespec_diff_ms(&zones[i].expires, now) > 0 && in_zone(name, zones[i].name)
+				&& (found == NULL || strlen(zones[i].name) > strlen(found->name))) {
+			found = zones + i;
+		}
+	}
+
+	return found;
+}
+
+static struct verify_query* add_query(size_t* count, const char* name, uint16_t type, const struct verify_server* servers, size_t server_count) {
+	for(size_t i = 0; i < *count; ++i) {
+		if(queries[i].type == type && queries[i].servers == servers && strcasecmp(queries[i].name, name) == 0) {
+			return queries + i;
+		}
+	}
+
+	if(*count >= VERIFY_MAX_QUERIES || server_count == 0) {
+		return NULL;
+	}
+
+	struct verify_query* query = queries + (*count)++;
+
+	*query = (struct verify_query) {
+		.type = type,
+		.servers = servers,
+		.server_count = server_count,
+		.rto_ms = VERIFY_INITIAL_RTO_MS,
+		.answer_count = -1
+	};
+	snprintf(query->name, sizeof(query->name), "%s", name);
+
+	// ids are unique in the batch, the responses are matched on them
+	bool unique;
+
+	do {
+		query->id = random() & 0xffff;
+		unique = true;
+
+		for(size_t i = 0; i + 1 < *count && unique; ++i) {
+			unique = queries[i].id != query->id;
+		}
+	} while(!unique);
+
+	return query;
+}
+
+static void send_query(struct verify_query* query, int* fds, bool recursion) {
+	uint8_t message[DNS_MAX_MESSAGE_SIZE];
+	size_t length = dns_build_query(message, sizeof(message), query->id, query->name, query->type, recursion);
+	const struct verify_server* server = query->servers + query->attempts++ % query->server_count;
+	int* fd = fds + (server->address.ss_family == AF_INET6);
+
+	if(*fd == -1) {
+		*fd = socket(server->address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	}
+
+	// a failed send is handled as a lost datagram, the next attempt may go to another server
+	if(length > 0 && *fd != -1) {
+		metrics_inc(METRIC_VERIFY_QUERIES);
+		sendto(*fd, message, length, 0, (const struct sockaddr*) &server->address, server->length);
+	}
+}
+
+static void receive_responses(int fd, struct verify_query* batch, size_t count) {
+	uint8_t message[DNS_MAX_MESSAGE_SIZE];
+	struct sockaddr_storage source;
+	socklen_t source_length = sizeof(source);
+	ssize_t received;
+
+	while((received = recvfrom(fd, message, sizeof(message), 0, (struct sockaddr*) &source, &source_length)) > 0) {
+		source_length = sizeof(source);
+
+		if(received < 2) {
+			continue;
+		}
+
+		uint16_t id = (uint16_t) (message[0] << 8 | message[1]);
+
+		for(size_t i = 0; i < count; ++i) {
+			struct verify_query* query = batch + i;
+
+			if(query->done || query->id != id) {
+				continue;
+			}
+
+			// only the servers the query was sent to can answer it
+			bool known = false;
+
+			for(size_t j = 0; j < query->server_count && !known; ++j) {
+				known = server_equal(query->servers + j, &source);
+			}
+
+			if(known) {
+				query->answer_count = dns_parse_response(message, received, id, query->type, query->answers, VERIFY_MAX_ANSWERS, &query->rcode);
+				query->done = query->answer_count >= 0;
+
+				if(query->done) {
+					memcpy(query->response, message, received);
+					query->response_length = received;
+				}
+			}
+
+			break;
+		}
+	}
+}
+
+/**
+ * Sends all the queries at once and retransmits the unanswered ones with a doubling interval until the timeout
+ **/
+static void run_queries(struct verify_query* batch, size_t count, bool recursion) {
+	int fds[2] = { -1, -1 }; // one socket per family
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(size_t i = 0; i < count; ++i) {
+		batch[i].send_at = start;
+	}
+
+	for(;;) {
+		long wait_ms = -1;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for(size_t i = 0; i < count; ++i) {
+			struct verify_query* query = batch + i;
+
+			if(query->done) {
+				continue;
+			}
+
+			if(timespec_diff_ms(&now, &start) >= VERIFY_TIMEOUT_MS) {
+				query->done = true;
+				continue;
+			}
+
+			if(timespec_diff_ms(&query->send_at, &now) <= 0) {
+				send_query(query, fds, recursion);
+				query->send_at = now;
+				timespec_add_ms(&query->send_at, query->rto_ms);
+				query->rto_ms *= 2;
+			}
+
+			long due_ms = timespec_diff_ms(&query->send_at, &now);
+
+			if(wait_ms < 0 || due_ms < wait_ms) {
+				wait_ms = due_ms;
+			}
+		}
+
+		if(wait_ms < 0) {
+			break;
+		}
+
+		struct pollfd pfds[2] = { { .fd = fds[0], .events = POLLIN }, { .fd = fds[1], .events = POLLIN } };
+
+		if(poll(pfds, 2, wait_ms) > 0) {
+			for(int i = 0; i < 2; ++i) {
+				if(pfds[i].revents & POLLIN) {
+					receive_responses(fds[i], batch, count);
+				}
+			}
+		}
+	}
+
+	for(int i = 0; i < 2; ++i) {
+		if(fds[i] != -1) {
+			close(fds[i]);
+		}
+	}
+}
+
+static void add_server(struct verify_zone* zone, const struct dns_answer* answer) {
+	if(zone->server_count >= VERIFY_MAX_SERVERS) {
+		return;
+	}
+
+	struct verify_server* server = zone->servers + zone->server_count;
+	memset(server, 0, sizeof(struct verify_server));
+
+	if(answer->type == DNS_TYPE_A && answer->length == 4) {
+		struct sockaddr_in* v4 = (struct sockaddr_in*) &server->address;
+
+		v4->sin_family = AF_INET;
+		v4->sin_port = htons(53);
+		memcpy(&v4->sin_addr, answer->data, 4);
+		server->length = sizeof(struct sockaddr_in);
+	}
+	else if(answer->type == DNS_TYPE_AAAA && answer->length == 16) {
+		struct sockaddr_in6* v6 = (struct sockaddr_in6*) &server->address;
+
+		v6->sin6_family = AF_INET6;
+		v6->sin6_port = htons(53);
+		memcpy(&v6->sin6_addr, answer->data, 16);
+		server->length = sizeof(struct sockaddr_in6);
+	}
+	else {
+		return;
+	}
+
+	++zone->server_count;
+}
+
+/**
+ * Finds the zones of the names that aren't cached: the ns queries for all their suffixes are sent at once to the
+ * recursive nameserver, the longest suffix with ns records is the zone, then its nameservers are resolved the same way
+ **/
+static void learn_zones(const char** names, size_t count, const struct timespec* now) {
+	static struct verify_server recursive;
+	size_t query_count = 0;
+
+	if(!resolver_nameserver(&recursive.address, &recursive.length)) {
+		log_warning("No recursive nameserver to find the authoritative ones");
+		return;
+	}
+
+	for(size_t i = 0; i < count; ++i) {
+		// suffixes from the shortest one with two labels
+		const char* suffixes[DNS_MAX_NAME_LENGTH / 2 + 1];
+		size_t suffix_count = 0;
+
+		for(const char* label = names[i]; label != NULL; label = strchr(label, '.') != NULL ? strchr(label, '.') + 1 : NULL) {
+			if(strchr(label, '.') != NULL) {
+				suffixes[suffix_count++] = label;
+			}
+		}
+
+		for(size_t j = suffix_count > VERIFY_MAX_SUFFIXES ? suffix_count - VERIFY_MAX_SUFFIXES : 0; j < suffix_count; ++j) {
+			add_query(&query_count, suffixes[j], DNS_TYPE_NS, &recursive, 1);
+		}
+	}
+
+	run_queries(queries, query_count, true);
+
+	// the ns queries are moved out of the way of the address ones
+	static struct verify_query ns_queries[VERIFY_MAX_QUERIES];
+	size_t ns_count = query_count;
+	struct verify_zone* new_zones[VERIFY_MAX_ZONES];
+	size_t new_zone_count = 0;
+
+	memcpy(ns_queries, queries, ns_count * sizeof(struct verify_query));
+	query_count = 0;
+
+	for(size_t i = 0; i < count; ++i) {
+		const struct verify_query* cut = NULL;
+
+		for(size_t j = 0; j < ns_count; ++j) {
+			if(ns_queries[j].answer_count > 0 && ns_queries[j].rcode == DNS_RCODE_NOERROR && in_zone(names[i], ns_queries[j].name)
+					&& (cut == NULL || strlen(ns_queries[j].name) > strlen(cut->name))) {
+				cut = ns_queries + j;
+			}
+		}
+
+		if(cut == NULL) {
+			log_warning("Couldn't find the authoritative nameservers of '%s'", names[i]);
+			continue;
+		}
+
+		bool known = false;
+
+		for(size_t j = 0; j < new_zone_count && !known; ++j) {
+			known = strcasecmp(new_zones[j]->name, cut->name) == 0;
+		}
+
+		if(known) {
+			continue;
+		}
+
+		// reuses the slot of the same zone or of an expired one
+		struct verify_zone* zone = NULL;
+
+		for(size_t j = 0; j < zone_count && zone == NULL; ++j) {
+			if(strcasecmp(zones[j].name, cut->name) == 0 || timespec_diff_ms(&zones[j].expires, now) <= 0) {
+				zone = zones + j;
+			}
+		}
+
+		if(zone == NULL && zone_count < VERIFY_MAX_ZONES) {
+			zone = zones + zone_count++;
+		}
+
+		if(zone == NULL) {
+			continue;
+		}
+
+		uint32_t ttl = VERIFY_MAX_ZONE_TTL_SEC;
+		*zone = (struct verify_zone) { .expires = *now };
+		snprintf(zone->name, sizeof(zone->name), "%s", cut->name);
+		new_zones[new_zone_count++] = zone;
+
+		for(int j = 0; j < cut->answer_count; ++j) {
+			char host[DNS_MAX_NAME_LENGTH + 1];
+
+			if(dns_read_name(cut->response, cut->response_length, cut->answers[j].offset, host, sizeof(host))) {
+				add_query(&query_count, host, DNS_TYPE_A, &recursive, 1);
+				add_query(&query_count, host, DNS_TYPE_AAAA, &recursive, 1);
+			}
+
+			if(cut->answers[j].ttl < ttl) {
+				ttl = cut->answers[j].ttl;
+			}
+		}
+
+		zone->expires.tv_sec += ttl < VERIFY_MIN_ZONE_TTL_SEC ? VERIFY_MIN_ZONE_TTL_SEC : ttl;
+	}
+
+	run_queries(queries, query_count, true);
+
+	// the addresses of every zone nameserver, in the order of the ns answers
+	for(size_t i = 0; i < new_zone_count; ++i) {
+		struct verify_zone* zone = new_zones[i];
+
+		for(size_t j = 0; j < ns_count; ++j) {
+			if(strcasecmp(ns_queries[j].name, zone->name) != 0 || ns_queries[j].answer_count <= 0) {
+				continue;
+			}
+
+			for(int k = 0; k < ns_queries[j].answer_count; ++k) {
+				char host[DNS_MAX_NAME_LENGTH + 1];
+
+				if(!dns_read_name(ns_queries[j].response, ns_queries[j].response_length, ns_queries[j].answers[k].offset, host, sizeof(host))) {
+					continue;
+				}
+
+				for(size_t l = 0; l < query_count; ++l) {
+					if(strcasecmp(queries[l].name, host) == 0 && queries[l].answer_count > 0) {
+						for(int m = 0; m < queries[l].answer_count; ++m) {
+							add_server(zone, queries[l].answers + m);
+						}
+					}
+				}
+			}
+		}
+
+		log_debug("Zone '%s' has %zu authoritative nameserver addresses", zone->name, zone->server_count);
+	}
+}
+
+// at most VERIFY_BATCH_RECORDS records
+static size_t verify_batch(struct record* const* records, const struct address* addresses, size_t count, bool* matches) {
+	const char* missing[VERIFY_BATCH_RECORDS];
+	size_t missing_count = 0, query_count = 0, match_count = 0;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for(size_t i = 0; i < count; ++i) {
+		if(records[i]->name[0] != 0 && find_zone(records[i]->name, &now) == NULL) {
+			missing[missing_count++] = records[i]->name;
+		}
+	}
+
+	if(missing_count > 0) {
+		learn_zones(missing, missing_count, &now);
+	}
+
+	struct verify_query* record_queries[VERIFY_BATCH_RECORDS] = { NULL };
+
+	for(size_t i = 0; i < count; ++i) {
+		struct verify_zone* zone = records[i]->name[0] != 0 ? find_zone(records[i]->name, &now) : NULL;
+
+		if(zone != NULL) {
+			record_queries[i] = add_query(&query_count, records[i]->name, records[i]->family == AF_INET6 ? DNS_TYPE_AAAA : DNS_TYPE_A,
+				zone->servers, zone->server_count);
+		}
+	}
+
+	// authoritative answers, without recursion
+	run_queries(queries, query_count, false);
+
+	for(size_t i = 0; i < count; ++i) {
+		const struct verify_query* query = record_queries[i];
+
+		if(query == NULL || query->answer_count < 0) {
+			continue;
+		}
+
+		struct address published = { .family = records[i]->family };
+
+		// several addresses can't be replaced by one without an update
+		if(query->answer_count == 1 && query->answers[0].length == (records[i]->family == AF_INET6 ? 16 : 4)) {
+			memcpy(published.bytes, query->answers[0].data, query->answers[0].length);
+			matches[i] = address_equal(&published, addresses + i);
+		}
+
+		if(matches[i]) {
+			++match_count;
+		}
+	}
+
+	return match_count;
+}
+
+size_t verify_published(struct record* const* records, const struct address* addresses, size_t count, bool* matches) {
+	size_t match_count = 0;
+
+	for(size_t i = 0; i < count; ++i) {
+		matches[i] = false;
+	}
+
+	if(!enabled) {
+		return 0;
+	}
+
+	for(size_t i = 0; i < count; i += VERIFY_BATCH_RECORDS) {
+		size_t batch = count - i < VERIFY_BATCH_RECORDS ? count - i : VERIFY_BATCH_RECORDS;
+
+		match_count += verify_batch(records + i, addresses + i, batch, matches + i);
+	}
+
+	return match_count;
+}
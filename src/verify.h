@@ -0,0 +1,23 @@
+#ifndef VERIFY_H
+#define VERIFY_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "address.h"
+#include "records.h"
+
+/**
+ * Enables the check of the authoritative nameservers before patching a record (VERIFY_DNS), so that a lost or stale
+ * state file doesn't cause an update of every record
+ **/
+void verify_configure(bool enabled);
+
+/**
+ * Asks the authoritative nameservers of the records (only the ones with a name) for their published value, all the
+ * queries are sent at once. matches[i] is set to true if records[i] already publishes addresses[i] and nothing else.
+ * Returns the number of matches, 0 if the check is disabled.
+ **/
+size_t verify_published(struct record* const* records, const struct address* addresses, size_t count, bool* matches);
+
+#endif